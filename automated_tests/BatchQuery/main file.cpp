@@ -0,0 +1,7 @@
+void foo() {}
+
+int main() {
+    foo();
+    foo();
+    return 0;
+}
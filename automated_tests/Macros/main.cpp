@@ -0,0 +1,6 @@
+#define TWICE(x) ((x) * 2)
+
+int main() {
+    int a = TWICE(1);
+    return TWICE(a);
+}
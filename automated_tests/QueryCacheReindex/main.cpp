@@ -0,0 +1,6 @@
+void foo() {}
+
+int main() {
+    foo();
+    return 0;
+}
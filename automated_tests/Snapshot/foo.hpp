@@ -0,0 +1,6 @@
+#pragma once
+
+int foo()
+{
+    return 42;
+}
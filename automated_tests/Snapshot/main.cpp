@@ -0,0 +1,6 @@
+#include "foo.hpp"
+
+int main()
+{
+    return foo();
+}
@@ -0,0 +1,8 @@
+int main()
+{
+    for (int i = 0; i < 10; ++i) {
+        if (i == 5)
+            break;
+    }
+    return 0;
+}
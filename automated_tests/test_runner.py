@@ -8,19 +8,27 @@
 # into the project folder.
 #
 import os
+import re
 import sys
 import json
+import shutil
+import tempfile
 import subprocess as sp
-from hamcrest import assert_that, has_length, has_item
+from hamcrest import assert_that, has_length, has_item, has_key, equal_to, greater_than_or_equal_to
 
 sys.dont_write_bytecode = True
 os.environ["PYTHONDONTWRITEBYTECODE"] = "1"
 socket_file = "/var/tmp/rdm_dev"
+engines = ("visitor", "callbacks", "session")
+# rdm arguments per engine, session is the callbacks engine with rp sessions
+engine_args = {"visitor": ["--index-engine", "visitor"],
+               "callbacks": ["--index-engine", "callbacks"],
+               "session": ["--index-engine", "callbacks", "--rp-session-jobs", "8"]}
 
 
 def create_compile_commands(test_dir, test_files):
     return [dict(directory=os.path.abspath(test_dir), file=test_file,
-                 command="clang++ -std=c++11 -I. -c %s" % os.path.join(test_dir, test_file))
+                 command="clang++ -std=c++11 -I. -c \"%s\"" % os.path.join(test_dir, test_file))
             for test_file in (src_file for src_file in test_files
                               if src_file.endswith('.cpp'))]
 
@@ -30,6 +38,31 @@ def read_locations(project_dir, lines):
     return [Location(os.path.join(project_dir, line[0]), line[1], line[2]) for line in lines]
 
 
+def read_elisp_locations(project_dir, output):
+    # The whole output has to be a single, complete list
+    depth = 0
+    in_string = False
+    escaped = False
+    for c in output:
+        if in_string:
+            if escaped:
+                escaped = False
+            elif c == '\\':
+                escaped = True
+            elif c == '"':
+                in_string = False
+        elif c == '"':
+            in_string = True
+        elif c == '(':
+            depth += 1
+        elif c == ')':
+            depth -= 1
+            assert_that(depth, greater_than_or_equal_to(0))
+    assert_that(depth, equal_to(0))
+    locations = re.findall(r"\(cons 'loc \"([^\"]+)\"\)", output)
+    return [Location.from_str(os.path.join(project_dir, loc)) for loc in locations]
+
+
 class Location:
     def __init__(self, file, line, col):
         self.file, self.line, self.col = str(file), int(line), int(col)
@@ -64,11 +97,45 @@ def wait_for(p, match):
             break
 
 
-def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations):
+def apply_edit(rdm, test_dir, edit, originals):
+    # Replaces a source file with another version of it and waits for rdm
+    # to reindex it. The original is restored once the directory is done.
+    source = os.path.join(test_dir, edit["file"])
+    if source not in originals:
+        originals[source] = open(source, 'r').read()
+    shutil.copyfile(os.path.join(test_dir, edit["content"]), source)
+    run_rc(["--reindex=" + source])
+    wait_for(rdm, "Jobs took")
+
+
+def import_snapshot(rdm, test_dir, engine):
+    # Exports the project with rdm --export-snapshot and imports it into a
+    # copy of test_dir under another directory. Returns the rdm that
+    # imported it, the temporary directory and the copy of test_dir.
+    root = run_rc(["--current-project"]).strip()
+    rdm.terminate()
+    rdm.wait()
+    tmp = os.path.realpath(tempfile.mkdtemp())
+    archive = os.path.join(tmp, "snapshot")
+    sp.check_call(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B",
+                   "--export-snapshot", archive], cwd=test_dir)
+    new_root = os.path.join(tmp, "project")
+    new_test_dir = os.path.normpath(os.path.join(new_root, os.path.relpath(test_dir, root)))
+    shutil.copytree(test_dir, new_test_dir)
+    rdm = sp.Popen(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B",
+                    "--import-snapshot", archive] + engine_args[engine],
+                   cwd=new_root, stdout=sp.PIPE, stderr=sp.STDOUT)
+    wait_for(rdm, "Imported snapshot")
+    return rdm, tmp, new_test_dir
+
+
+def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations, elisp=False):
     print 'running test'
-    actual_locations = \
-        read_locations(project_dir,
-                       run_rc([c.format(test_dir) for c in rc_command]))
+    output = run_rc([c.format(test_dir) for c in rc_command])
+    if elisp:
+        actual_locations = read_elisp_locations(project_dir, output)
+    else:
+        actual_locations = read_locations(project_dir, output)
     # Compare that we have the same results in length and content
     assert_that(actual_locations, has_length(len(expected_locations)))
     print 'checking location'
@@ -76,8 +143,43 @@ def run(rdm, project_dir, test_dir, test_files, rc_command, expected_locations):
         expected_location = Location.from_str(expected_location_string.format(test_dir))
         assert_that(actual_locations, has_item(expected_location))
 
-def setup_rdm(test_dir, test_files):
-    rdm = sp.Popen(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B", "-C"],
+def read_batch(project_dir, output):
+    # Each query's output is preceded by "<line> <status> <number of lines>"
+    results = {}
+    lines = output.split("\n")
+    i = 0
+    while i < len(lines):
+        if len(lines[i]) == 0:
+            i += 1
+            continue
+        line, status, count = lines[i].split(" ")
+        count = int(count)
+        results[line] = (int(status), "\n".join(lines[i + 1:i + 1 + count]))
+        i += 1 + count
+    return results
+
+
+def run_batch(project_dir, test_dir, batch, expected):
+    print 'running batch test'
+    batch_file = os.path.join(test_dir, "batch.tmp")
+    try:
+        open(batch_file, 'w').write("\n".join(l.format(test_dir) for l in batch) + "\n")
+        results = read_batch(project_dir, run_rc(["--batch", batch_file]))
+    finally:
+        os.remove(batch_file)
+    assert_that(results, has_length(len(expected)))
+    for line, expected_locations in expected.items():
+        assert_that(results, has_key(line))
+        status, output = results[line]
+        assert_that(status, equal_to(0))
+        actual_locations = read_locations(project_dir, output)
+        assert_that(actual_locations, has_length(len(expected_locations)))
+        for expected_location_string in expected_locations:
+            expected_location = Location.from_str(expected_location_string.format(test_dir))
+            assert_that(actual_locations, has_item(expected_location))
+
+def setup_rdm(test_dir, test_files, engine):
+    rdm = sp.Popen(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B", "-C"] + engine_args[engine],
                    stdout=sp.PIPE, stderr=sp.STDOUT)
     wait_for(rdm, "Includepaths")
 
@@ -96,9 +198,31 @@ def test_generator():
         if "ForwardDeclaration" in test_dir:
           continue
         expectations = json.load(open(os.path.join(test_dir, "expectation.json"), 'r'))
-        rdm = setup_rdm(test_dir, test_files)
-        for e in expectations:
-            test_generator.__name__ = os.path.basename(test_dir)
-            yield run, rdm, project_dir, test_dir, test_files, e["rc-command"], e["expectation"]
-        rdm.terminate()
-        rdm.wait()
+        # All index engines have to find the same symbols
+        for engine in engines:
+            rdm = setup_rdm(test_dir, test_files, engine)
+            originals = {}
+            snapshot_root = None
+            query_dir = test_dir
+            try:
+                for e in expectations:
+                    if engine not in e.get("engines", engines):
+                        continue
+                    test_generator.__name__ = "%s_%s" % (os.path.basename(test_dir), engine)
+                    if "edit" in e:
+                        apply_edit(rdm, test_dir, e["edit"], originals)
+                    if "snapshot" in e and not snapshot_root:
+                        rdm, snapshot_root, query_dir = import_snapshot(rdm, test_dir, engine)
+                    if "batch" in e:
+                        yield run_batch, project_dir, query_dir, e["batch"], e["expectation-batch"]
+                    elif "expectation-elisp" in e:
+                        yield run, rdm, project_dir, query_dir, test_files, e["rc-command"], e["expectation-elisp"], True
+                    else:
+                        yield run, rdm, project_dir, query_dir, test_files, e["rc-command"], e["expectation"]
+            finally:
+                for source, contents in originals.items():
+                    open(source, 'w').write(contents)
+                rdm.terminate()
+                rdm.wait()
+                if snapshot_root:
+                    shutil.rmtree(snapshot_root)
@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+# coding=utf-8
+#
+# Compares the engines rp can build the index with (rdm --index-engine) on
+# the tests in automated_tests. Assuming that the bins are in build/bin,
+# run with
+#
+#     PATH=$(pwd)/build/bin:$PATH python scripts/index_engine_benchmark.py
+#
+# into the project folder. Every test is indexed with each engine. The
+# time rp spent visiting, the cursors it looked at and the wall time until
+# rdm was done are printed per engine, followed by the rc commands from
+# expectation.json whose output differs between the engines. Exits with 1
+# if any output differs. session is the callbacks engine in rp sessions,
+# its parse time against callbacks' is what skipping the bodies of headers
+# a session has already parsed saves.
+#
+import os
+import re
+import sys
+import json
+import time
+import subprocess as sp
+
+sys.dont_write_bytecode = True
+base_test_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.path.pardir, "automated_tests")
+sys.path.insert(0, base_test_dir)
+from test_runner import create_compile_commands, engine_args, engines, run_rc, socket_file
+
+# "... 1234 cursors ...) (parse/visit/write ms)" from the indexer message
+stats_re = re.compile(r" (\d+) cursors.*\((\d+)/(\d+)/(\d+)ms\)")
+
+
+def wait_for(rdm, match, stats=None):
+    while rdm.poll() is None:
+        l = rdm.stdout.readline()
+        m = stats_re.search(l)
+        if m and stats is not None:
+            stats["cursors"] += int(m.group(1))
+            stats["parse"] += int(m.group(2))
+            stats["visit"] += int(m.group(3))
+            stats["write"] += int(m.group(4))
+        if match in l:
+            break
+
+
+def index(test_dir, test_files, engine):
+    rdm = sp.Popen(["rdm", "-n", socket_file, "-d", "~/.rtags_dev", "-o", "-B", "-C"] + engine_args[engine],
+                   stdout=sp.PIPE, stderr=sp.STDOUT)
+    wait_for(rdm, "Includepaths")
+    stats = dict(cursors=0, parse=0, visit=0, write=0, wall=0.0)
+    for c in create_compile_commands(test_dir, test_files):
+        start = time.time()
+        run_rc(["-c", c['command']])
+        wait_for(rdm, "Jobs took", stats)
+        stats["wall"] += time.time() - start
+    return rdm, stats
+
+
+def query(test_dir, expectations):
+    # sorted since the engines may report the same locations in a different order
+    return [sorted(run_rc([c.format(test_dir) for c in e["rc-command"]]).split("\n"))
+            for e in expectations]
+
+
+def plain(expectations):
+    # Edits and batches depend on running in order, leave them to test_runner,
+    # as well as what only some engines are expected to find
+    return [e for e in expectations if "rc-command" in e and "edit" not in e and "engines" not in e]
+
+
+def main():
+    differences = 0
+    for test_dir, _, test_files in tuple(os.walk(base_test_dir))[1:]:
+        expectations = plain(json.load(open(os.path.join(test_dir, "expectation.json"), 'r')))
+        results = {}
+        print os.path.basename(test_dir)
+        for engine in engines:
+            rdm, stats = index(test_dir, test_files, engine)
+            results[engine] = query(test_dir, expectations)
+            rdm.terminate()
+            rdm.wait()
+            print "  %-10s %6d cursors, parse %5dms, visit %5dms, write %5dms, wall %.2fs" % \
+                (engine, stats["cursors"], stats["parse"], stats["visit"], stats["write"], stats["wall"])
+        for i, e in enumerate(expectations):
+            outputs = [results[engine][i] for engine in engines]
+            if any(o != outputs[0] for o in outputs[1:]):
+                differences += 1
+                print "  differs:", " ".join(e["rc-command"]).format(test_dir)
+                for engine, output in zip(engines, outputs):
+                    print "    %s: %s" % (engine, ", ".join(l for l in output if l))
+    return 1 if differences else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,57 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef CancellationToken_h
+#define CancellationToken_h
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "rct/Rct.h"
+
+/*
+ * Shared between a query and whoever may want to stop it. A query is
+ * cancelled when cancel() is called, e.g. because the client disconnected, or
+ * when its deadline (in Rct::monoMs() time, 0 means none) has passed. A
+ * token with a parent is also cancelled when the parent is. Long running
+ * lookups check it once per file.
+ */
+class CancellationToken
+{
+public:
+    CancellationToken(uint64_t deadline = 0, const std::shared_ptr<const CancellationToken> &parent = nullptr)
+        : mCancelled(false), mDeadline(deadline), mParent(parent)
+    {}
+
+    void cancel() { mCancelled = true; }
+    bool isCancelled() const
+    {
+        if (mCancelled)
+            return true;
+        if (mDeadline && Rct::monoMs() >= mDeadline)
+            return true;
+        return mParent && mParent->isCancelled();
+    }
+    uint64_t deadline() const { return mDeadline; }
+
+    static bool isCancelled(const CancellationToken *token) { return token && token->isCancelled(); }
+private:
+    std::atomic<bool> mCancelled;
+    const uint64_t mDeadline;
+    const std::shared_ptr<const CancellationToken> mParent;
+};
+
+#endif
@@ -16,6 +16,10 @@
 #define RTAGS_SINGLE_THREAD
 #include "ClangIndexer.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <unistd.h>
 #if CINDEX_VERSION >= CINDEX_VERSION_ENCODE(0, 25)
 #include <clang-c/Documentation.h>
@@ -28,6 +32,7 @@
 #include "rct/Connection.h"
 #include "rct/EventLoop.h"
 #include "rct/SHA256.h"
+#include "rct/ThreadPool.h"
 #include "RTags.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
@@ -69,14 +74,17 @@ struct VerboseVisitorUserData {
 
 Flags<Server::Option> ClangIndexer::sServerOpts;
 Path ClangIndexer::sServerSandboxRoot;
-ClangIndexer::ClangIndexer()
-    : mClangUnit(0), mIndex(0), mLastCursor(nullCursor), mLastCallExpr(nullCursor),
+ClangIndexer::ClangIndexer(Session *session)
+    : mClangUnit(0), mIndex(0), mSession(session), mLastCursor(nullCursor), mLastCallExpr(nullCursor),
       mVisitFileResponseMessageFileId(0), mVisitFileResponseMessageVisit(0), mParseDuration(0),
       mVisitDuration(0), mBlocked(0), mAllowed(0), mIndexed(1), mVisitFileTimeout(0),
       mIndexDataMessageTimeout(0), mFileIdsQueried(0), mFileIdsQueriedTime(0),
-      mCursorsVisited(0), mLogFile(0), mConnection(Connection::create(RClient::NumOptions)),
-      mUnionRecursion(false)
+      mCursorsVisited(0), mCursorsPruned(0), mLogFile(0), mConnection(Connection::create(RClient::NumOptions)),
+      mUnionRecursion(false), mIndexerCallbacks(false), mIndexedInSession(false), mIndexTokens(false), mWriteThreads(1), mWriteThreadsUsed(0),
+      mUnitsWritten(0), mUnitsUnchanged(0), mBytesSkipped(0)
 {
+    for (int i=0; i<WriteDurationCount; ++i)
+        mWriteDurations[i] = 0;
     mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
                                                 std::placeholders::_1, std::placeholders::_2));
 }
@@ -87,7 +95,7 @@ ClangIndexer::~ClangIndexer()
         fclose(mLogFile);
     if (mClangUnit)
         clang_disposeTranslationUnit(mClangUnit);
-    if (mIndex)
+    if (mIndex && !mSession)
         clang_disposeIndex(mIndex);
 }
 
@@ -119,12 +127,20 @@ bool ClangIndexer::exec(const String &data)
     deserializer >> connectTimeout;
     deserializer >> connectAttempts;
     deserializer >> niceValue;
+    deserializer >> mWriteThreads;
     deserializer >> sServerOpts;
     deserializer >> mUnsavedFiles;
     deserializer >> mDataDir;
     deserializer >> mDebugLocations;
     deserializer >> blockedFiles;
 
+    // The tokens map is big and only used for rc --tokens, rdm tokenizes
+    // on demand for projects that don't ask for it.
+    {
+        const Map<String, String> config = RTags::rtagsConfig(mSourceFile);
+        mIndexTokens = config.contains("index-tokens") && config.value("index-tokens") != "false";
+    }
+
 #if 0
     while (true) {
         FILE *f = fopen((String("/tmp/stop_") + mSourceFile.fileName()).constData(), "r+");
@@ -141,7 +157,8 @@ bool ClangIndexer::exec(const String &data)
 
     const uint64_t parseTime = Rct::currentTimeMs();
 
-    if (niceValue != INT_MIN) {
+    // a session only needs to be niced once
+    if (niceValue != INT_MIN && (!mSession || !mSession->jobs)) {
         errno = 0;
         if (nice(niceValue) == -1) {
             error() << "Failed to nice rp" << Rct::strerror();
@@ -183,6 +200,8 @@ bool ClangIndexer::exec(const String &data)
     assert(mConnection->isConnected());
     mIndexDataMessage.files()[mSource.fileId] |= IndexDataMessage::Visited;
     parse() && visit() && diagnose();
+    if (mSession)
+        ++mSession->jobs;
     String message = mSourceFile.toTilde();
     String err;
     StopWatch sw;
@@ -199,19 +218,37 @@ bool ClangIndexer::exec(const String &data)
     int symbolNameCount = 0;
     for (const auto &unit : mUnits) {
         cursorCount += unit.second->symbols.size();
-        symbolNameCount += unit.second->symbolNames.size();
+        unit.second->symbolNames.sort();
+        symbolNameCount += unit.second->symbolNames.keyCount();
     }
     if (mClangUnit) {
         String queryData;
         if (mFileIdsQueried)
             queryData = String::format(", %d queried %dms", mFileIdsQueried, mFileIdsQueriedTime);
-        const char *format = "(%d syms, %d symNames, %d includes, %d of %d files, symbols: %d of %d, %d cursors%s%s) (%d/%d/%dms)";
+        String pruneData;
+        if (ClangIndexer::serverOpts() & Server::PruneBlockedHeaders)
+            pruneData = String::format(", %d pruned", mCursorsPruned);
+        if (mSession)
+            pruneData += String::format(", session job %d%s", mSession->jobs, mIndexedInSession ? "" : " reparsed");
+        String writeData;
+        if (writeDuration != -1) {
+            writeData = String::format<256>(" (%d units on %d threads, %d unchanged, %llu bytes skipped: "
+                                            "symbols %d, targets %d, usrs %d, symnames %d, tokens %d, commit %d, sync %dms)",
+                                            mUnitsWritten, mWriteThreadsUsed, mUnitsUnchanged,
+                                            static_cast<unsigned long long>(mBytesSkipped.load()),
+                                            mWriteDurations[WriteSymbols].load(), mWriteDurations[WriteTargets].load(),
+                                            mWriteDurations[WriteUsrs].load(), mWriteDurations[WriteSymbolNames].load(),
+                                            mWriteDurations[WriteTokens].load(), mWriteDurations[WriteCommit].load(),
+                                            mWriteDurations[WriteSync].load());
+        }
+        const char *format = "(%d syms, %d symNames, %d includes, %d of %d files, symbols: %d of %d, %d cursors%s%s%s%s) (%d/%d/%dms)%s";
         message += String::format<1024>(format, cursorCount, symbolNameCount,
                                         mIndexDataMessage.includes().size(), mIndexed,
                                         mIndexDataMessage.files().size(), mAllowed,
                                         mAllowed + mBlocked, mCursorsVisited,
-                                        queryData.constData(), mIndexDataMessage.flags() & IndexDataMessage::UsedPCH ? ", pch" : "",
-                                        mParseDuration, mVisitDuration, writeDuration);
+                                        pruneData.constData(), queryData.constData(), mIndexDataMessage.flags() & IndexDataMessage::UsedPCH ? ", pch" : "",
+                                        ClangIndexer::serverOpts() & Server::IndexerCallbacks ? ", callbacks" : "",
+                                        mParseDuration, mVisitDuration, writeDuration, writeData.constData());
     }
     if (mIndexDataMessage.indexerJobFlags() & IndexerJob::Dirty) {
         message += " (dirty)";
@@ -222,13 +259,16 @@ bool ClangIndexer::exec(const String &data)
 
     mIndexDataMessage.setMessage(message);
     sw.restart();
+    mIndexDataMessage.sharePayload();
     if (!mConnection->send(mIndexDataMessage)) {
         error() << "Couldn't send IndexDataMessage" << mSourceFile;
+        mIndexDataMessage.unlinkSharedPayload();
         return false;
     }
     mConnection->finished().connect(std::bind(&EventLoop::quit, EventLoop::eventLoop()));
     if (EventLoop::eventLoop()->exec(mIndexDataMessageTimeout) == EventLoop::Timeout) {
         error() << "Timed out sending IndexDataMessage" << mSourceFile;
+        mIndexDataMessage.unlinkSharedPayload();
         return false;
     }
     if (getenv("RDM_DEBUG_INDEXERMESSAGE"))
@@ -247,6 +287,39 @@ void ClangIndexer::onMessage(const std::shared_ptr<Message> &msg, const std::sha
     EventLoop::eventLoop()->quit();
 }
 
+ClangIndexer::CachedFile ClangIndexer::resolveFile(CXFile file)
+{
+    CachedFile ret = { 0, CachedFile::Unknown };
+    CXString fileName = clang_getFileName(file);
+    const char *fn = clang_getCString(fileName);
+    if (!fn || !*fn || !strcmp("<built-in>", fn) || !strcmp("<command line>", fn)) {
+        clang_disposeString(fileName);
+        return ret;
+    }
+    // the blocked state is decided the first time it's asked for, like
+    // createLocation(Path) would
+    ret.fileId = createLocation(RTags::eatString(fileName), 1, 1).fileId();
+    return ret;
+}
+
+bool ClangIndexer::isBlocked(uint32_t fileId)
+{
+    Hash<uint32_t, Flags<IndexDataMessage::FileFlag> >::iterator it = mIndexDataMessage.files().find(fileId);
+    if (it == mIndexDataMessage.files().end()) {
+        // the only reason we already have an id for a file that isn't
+        // in the mIndexDataMessage.mFiles is that it's blocked from the outset.
+        // The assumption is that we never will go and fetch a file id
+        // for a location without passing blockedPtr since any reference
+        // to a symbol in another file should have been preceded by that
+        // header in which case we would have to make a decision on
+        // whether or not to index it. This is a little hairy but we
+        // have to try to optimize this process.
+        mIndexDataMessage.files()[fileId] = IndexDataMessage::NoFileFlag;
+        return true;
+    }
+    return !it->second;
+}
+
 Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line, unsigned int col, bool *blockedPtr)
 {
     uint32_t id = Location::fileId(sourceFile);
@@ -270,28 +343,9 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
     assert(!resolved.contains("/../"));
 
     if (id) {
-        if (blockedPtr) {
-            Hash<uint32_t, Flags<IndexDataMessage::FileFlag> >::iterator it = mIndexDataMessage.files().find(id);
-            if (it == mIndexDataMessage.files().end()) {
-                // the only reason we already have an id for a file that isn't
-                // in the mIndexDataMessage.mFiles is that it's blocked from the outset.
-                // The assumption is that we never will go and fetch a file id
-                // for a location without passing blockedPtr since any reference
-                // to a symbol in another file should have been preceded by that
-                // header in which case we would have to make a decision on
-                // whether or not to index it. This is a little hairy but we
-                // have to try to optimize this process.
-#ifndef NDEBUG
-                if (resolved.isEmpty())
-                    resolved = sourceFile.resolved();
-#endif
-                mIndexDataMessage.files()[id] = IndexDataMessage::NoFileFlag;
-                *blockedPtr = true;
-                return Location();
-            } else if (!it->second) {
-                *blockedPtr = true;
-                return Location();
-            }
+        if (blockedPtr && isBlocked(id)) {
+            *blockedPtr = true;
+            return Location();
         }
         return Location(id, line, col);
     }
@@ -483,7 +537,7 @@ String ClangIndexer::addNamePermutations(const CXCursor &cursor, Location locati
         if (!trailer.isEmpty()) {
             ret += trailer;
             if (cursorType != RTags::Type_Reference)
-                unit(location.fileId())->symbolNames[ret].insert(location);
+                unit(location.fileId())->symbolNames.insert(ret, location);
         }
     } else {
         ret.assign(buf + cutoff, std::max<int>(0, sizeof(buf) - cutoff - 1));
@@ -506,7 +560,7 @@ String ClangIndexer::addNamePermutations(const CXCursor &cursor, Location locati
             const String name(ch, std::max<int>(0, sizeof(buf) - (ch - buf) - 1));
             if (name.isEmpty())
                 continue;
-            unit(location.fileId())->symbolNames[name].insert(location);
+            unit(location.fileId())->symbolNames.insert(name, location);
             if (!type.isEmpty() && (originalKind != CXCursor_ParmDecl || !strchr(ch, '('))) {
                 // We only want to add the type to the final declaration for ParmDecls
                 // e.g.
@@ -519,7 +573,7 @@ String ClangIndexer::addNamePermutations(const CXCursor &cursor, Location locati
                 // or
                 // void foo(int)::int bar
 
-                unit(location.fileId())->symbolNames[type + name].insert(location);
+                unit(location.fileId())->symbolNames.insert(type + name, location);
             }
         }
 
@@ -639,6 +693,12 @@ CXChildVisitResult ClangIndexer::indexVisitor(CXCursor cursor)
     const CXCursorKind kind = clang_getCursorKind(cursor);
     const RTags::CursorType type = RTags::cursorType(kind);
     if (type == RTags::Type_Other) {
+        if (clang_isDeclaration(kind)
+            && ClangIndexer::serverOpts() & Server::PruneBlockedHeaders
+            && isBlockedRegion(cursor)) {
+            ++mCursorsPruned;
+            return CXChildVisit_Continue;
+        }
         return CXChildVisit_Recurse;
     }
 
@@ -970,34 +1030,29 @@ bool ClangIndexer::handleReference(const CXCursor &cursor, CXCursorKind kind, Lo
     if (c->kind == CXCursor_MacroExpansion) {
         for (const auto &t : targets) {
             if (RTags::targetsValueKind(t.second) == CXCursor_MacroDefinition) {
-                for (const auto &u : mUnits) { // ### should only search the ones we depend on
-                    const auto it = u.second->usrs.find(t.first);
-                    if (it != u.second->usrs.end()) {
-                        auto mit = mMacroTokens.find(*it->second.begin());
-                        if (mit != mMacroTokens.end()) {
-                            const String id = RTags::eatString(clang_getCursorSpelling(cursor));
-                            auto idit = mit->second.data.find(id);
-                            if (idit != mit->second.data.end()) {
-                                List<Location> &locs = idit->second.locations;
-                                assert(!locs.isEmpty());
-                                location = locs.front();
-                                if (locs.size() == 1) {
-                                    if (mit->second.data.size() == 1) {
-                                        mMacroTokens.erase(mit);
-                                    } else {
-                                        mit->second.data.erase(idit);
-                                    }
-                                } else {
-                                    locs.remove(0, 1);
-                                }
-                                std::shared_ptr<Unit> u = unit(location);
-                                c = &u->symbols[location];
-                                Map<String, uint16_t> &t = u->targets[location];
-                                t[refUsr] = refTargetValue;
-                                setTarget = false;
+                const auto it = mMacroDefinitions.find(t.first);
+                auto mit = it != mMacroDefinitions.end() ? mMacroTokens.find(it->second) : mMacroTokens.end();
+                if (mit != mMacroTokens.end()) {
+                    const String id = RTags::eatString(clang_getCursorSpelling(cursor));
+                    auto idit = mit->second.data.find(id);
+                    if (idit != mit->second.data.end()) {
+                        List<Location> &locs = idit->second.locations;
+                        assert(!locs.isEmpty());
+                        location = locs.front();
+                        if (locs.size() == 1) {
+                            if (mit->second.data.size() == 1) {
+                                mMacroTokens.erase(mit);
+                            } else {
+                                mit->second.data.erase(idit);
                             }
+                        } else {
+                            locs.remove(0, 1);
                         }
-                        break;
+                        std::shared_ptr<Unit> u = unit(location);
+                        c = &u->symbols[location];
+                        Map<String, uint16_t> &t = u->targets[location];
+                        t[refUsr] = refTargetValue;
+                        setTarget = false;
                     }
                 }
                 break;
@@ -1115,32 +1170,36 @@ void ClangIndexer::handleInclude(const CXCursor &cursor, CXCursorKind kind, Loca
 {
     assert(kind == CXCursor_InclusionDirective);
     (void)kind;
-    CXFile includedFile = clang_getIncludedFile(cursor);
-    if (includedFile) {
-        const Location refLoc = createLocation(includedFile, 1, 1);
-        if (!refLoc.isNull()) {
-            Symbol &c = unit(location)->symbols[location];
-            if (!c.isNull())
-                return;
-
-            String include = "#include ";
-            Path path = refLoc.path();
-            Sandbox::encode(path);
-            assert(mSource.fileId);
-            unit(location)->symbolNames[(include + path)].insert(location);
-            unit(location)->symbolNames[(include + path.fileName())].insert(location);
-            mIndexDataMessage.includes().push_back(std::make_pair(location.fileId(), refLoc.fileId()));
-            c.symbolName = "#include " + RTags::eatString(clang_getCursorDisplayName(cursor));
-            c.kind = cursor.kind;
-            c.symbolLength = c.symbolName.size() + 2;
-            c.location = location;
-            unit(location)->targets[location][refLoc.toString(Location::NoColor|Location::ConvertToRelative)] = 0; // ### what targets value to create for this?
-            // this fails for things like:
-            // # include    <foobar.h>
-            return;
-        }
-    }
-    error() << "couldn't create included file" << cursor;
+    if (!addInclude(location, clang_getIncludedFile(cursor), RTags::eatString(clang_getCursorDisplayName(cursor))))
+        error() << "couldn't create included file" << cursor;
+}
+
+bool ClangIndexer::addInclude(Location location, CXFile includedFile, const String &fileName)
+{
+    if (!includedFile)
+        return false;
+    const Location refLoc = createLocation(includedFile, 1, 1);
+    if (refLoc.isNull())
+        return false;
+    Symbol &c = unit(location)->symbols[location];
+    if (!c.isNull())
+        return true;
+
+    String include = "#include ";
+    Path path = refLoc.path();
+    Sandbox::encode(path);
+    assert(mSource.fileId);
+    unit(location)->symbolNames.insert((include + path), location);
+    unit(location)->symbolNames.insert((include + path.fileName()), location);
+    mIndexDataMessage.includes().push_back(std::make_pair(location.fileId(), refLoc.fileId()));
+    c.symbolName = "#include " + fileName;
+    c.kind = CXCursor_InclusionDirective;
+    c.symbolLength = c.symbolName.size() + 2;
+    c.location = location;
+    unit(location)->targets[location][refLoc.toString(Location::NoColor|Location::ConvertToRelative)] = 0; // ### what targets value to create for this?
+    // this fails for things like:
+    // # include    <foobar.h>
+    return true;
 }
 
 CXChildVisitResult ClangIndexer::handleStatement(const CXCursor &cursor, CXCursorKind kind, Location location)
@@ -1183,7 +1242,7 @@ CXChildVisitResult ClangIndexer::handleStatement(const CXCursor &cursor, CXCurso
             if (scope.type == Scope::FunctionDefinition) {
                 c.kind = kind;
                 c.symbolName = "return";
-                u->symbolNames[c.symbolName].insert(location);
+                u->symbolNames.insert(c.symbolName, location);
                 c.kind = kind;
                 c.symbolLength = 6;
                 c.location = location;
@@ -1213,7 +1272,7 @@ CXChildVisitResult ClangIndexer::handleStatement(const CXCursor &cursor, CXCurso
         case CXCursor_DoStmt: c.symbolName = "do"; break;
         default: assert(0); break;
         }
-        u->symbolNames[c.symbolName].insert(location);
+        u->symbolNames.insert(c.symbolName, location);
         c.symbolLength = c.symbolName.size();
         c.location = location;
         if (kind != CXCursor_IfStmt) {
@@ -1251,7 +1310,7 @@ CXChildVisitResult ClangIndexer::handleStatement(const CXCursor &cursor, CXCurso
         }
         setRange(c, clang_getCursorExtent(cursor));
         c.symbolName = kind == CXCursor_BreakStmt ? "break" : "continue";
-        u->symbolNames[c.symbolName].insert(location);
+        u->symbolNames.insert(c.symbolName, location);
         c.kind = kind;
         c.symbolLength = c.symbolName.size();
         c.location = location;
@@ -1311,7 +1370,7 @@ CXChildVisitResult ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKi
     if (!c.isNull()) {
         if (c.kind == CXCursor_MacroExpansion) {
             addNamePermutations(cursor, location, RTags::Type_Cursor);
-            unit(location)->usrs[usr].insert(location);
+            unit(location)->usrs.insert(usr, location);
         }
         return CXChildVisit_Recurse;
     }
@@ -1459,6 +1518,9 @@ CXChildVisitResult ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKi
         unsigned numTokens = 0;
         clang_tokenize(mClangUnit, range, &tokens, &numTokens);
         MacroData &macroData = mMacroTokens[location];
+        Location &definition = mMacroDefinitions[c.usr];
+        if (definition.isNull() || location < definition)
+            definition = location;
         enum {
             Unset,
             GettingArgs,
@@ -1562,7 +1624,7 @@ CXChildVisitResult ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKi
     // their definition and their declaration.  Using the canonical
     // cursor's usr allows us to join them. Check JSClassRelease in
     // JavaScriptCore for an example.
-    unit(location)->usrs[c.usr].insert(location);
+    unit(location)->usrs.insert(c.usr, location);
     if (c.linkage == CXLinkage_External && !c.isDefinition()) {
         switch (c.kind) {
         case CXCursor_FunctionDecl:
@@ -1665,7 +1727,16 @@ bool ClangIndexer::parse()
     StopWatch sw;
     assert(!mClangUnit);
     assert(!mIndex);
-    mIndex = clang_createIndex(0, 1);
+    mFiles.clear();
+    if (mSession) {
+        if (!mSession->index) {
+            mSession->index = clang_createIndex(0, 1);
+            mSession->action = clang_IndexAction_create(mSession->index);
+        }
+        mIndex = mSession->index;
+    } else {
+        mIndex = clang_createIndex(0, 1);
+    }
     assert(mIndex);
     Flags<Source::CommandLineFlag> commandLineFlags = Source::Default;
     if (ClangIndexer::serverOpts() & Server::PCHEnabled)
@@ -1706,8 +1777,28 @@ bool ClangIndexer::parse()
     if (usedPch)
         mIndexDataMessage.setFlag(IndexDataMessage::UsedPCH);
 
-    RTags::parseTranslationUnit(mSourceFile, args, mClangUnit,
-                                mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+    if (mSession) {
+        indexInSession(args, &unsavedFiles[0], unsavedIndex, flags);
+        if (mClangUnit && sessionSkippedVisitedBodies()) {
+            // Start over outside the session. The files keep the decisions
+            // rdm made for them.
+            clang_disposeTranslationUnit(mClangUnit);
+            mClangUnit = 0;
+            mIndexedInSession = false;
+            mUnits.clear();
+            mMacroTokens.clear();
+            mMacroDefinitions.clear();
+            mIndexDataMessage.includes().clear();
+            mCursorsVisited = mBlocked = mAllowed = 0;
+            RTags::parseTranslationUnit(mSourceFile, args, mClangUnit,
+                                        mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+        }
+        for (const auto &it : mIndexDataMessage.files())
+            mSession->parsed.insert(it.first);
+    } else {
+        RTags::parseTranslationUnit(mSourceFile, args, mClangUnit,
+                                    mIndex, &unsavedFiles[0], unsavedIndex, flags, &mClangLine);
+    }
 
     warning() << "CI::parse loading unit:" << mClangLine << " " << (mClangUnit != 0);
     if (mClangUnit) {
@@ -1729,19 +1820,77 @@ bool ClangIndexer::parse()
     return false;
 }
 
-static inline Map<String, Set<Location> > convertTargets(const Map<Location, Map<String, uint16_t> > &in)
+static inline FileMapBuilder<String, Set<Location> > convertTargets(const Map<Location, Map<String, uint16_t> > &in)
 {
-    Map<String, Set<Location> > ret;
+    Hash<String, Set<Location> > locations;
     for (const auto &v : in) {
         for (const auto &u : v.second) {
-            ret[u.first].insert(v.first);
+            locations[u.first].insert(v.first);
         }
     }
+    FileMapBuilder<String, Set<Location> > ret;
+    ret.reserve(locations.size());
+    for (auto &v : locations)
+        ret.append(String(v.first), std::move(v.second));
     return ret;
 }
 
+namespace {
+// Shared with the pool jobs, like ParallelScan. A job that only starts
+// after writeFiles() has returned finds no units left and never touches
+// write.
+struct WriteState
+{
+    WriteState(size_t count, const std::function<void(size_t)> &func)
+        : units(count), next(0), finished(0), write(func)
+    {}
+
+    // Returns false when there are no units left to start
+    bool writeNext()
+    {
+        const size_t unit = next++;
+        if (unit >= units)
+            return false;
+        write(unit);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (++finished == units)
+            condition.notify_one();
+        return true;
+    }
+
+    const size_t units;
+    std::atomic<size_t> next;
+    size_t finished;
+    const std::function<void(size_t)> &write;
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+class WriteJob : public ThreadPool::Job
+{
+public:
+    WriteJob(const std::shared_ptr<WriteState> &state)
+        : mState(state)
+    {}
+protected:
+    virtual void run() override
+    {
+        while (mState->writeNext()) {}
+    }
+private:
+    const std::shared_ptr<WriteState> mState;
+};
+}
+
 bool ClangIndexer::writeFiles(const Path &root, String &error)
 {
+    uint32_t fileMapOpts = 0;
+    if (ClangIndexer::serverOpts() & Server::NoFileLock)
+        fileMapOpts |= FileMap<int, int>::NoLock;
+    if (ClangIndexer::serverOpts() & Server::SyncFileMaps)
+        fileMapOpts |= FileMap<int, int>::Sync;
+
+    List<std::pair<uint32_t, Unit *> > units;
     for (const auto &unit : mUnits) {
         if (!(mIndexDataMessage.files().value(unit.first) & IndexDataMessage::Visited)) {
             ::error() << "Wanting to write something for"
@@ -1754,39 +1903,57 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
                       << unit.second->tokens.size();
             continue;
         }
-        assert(mIndexDataMessage.files().value(unit.first) & IndexDataMessage::Visited);
+        units.push_back(std::make_pair(unit.first, unit.second.get()));
+    }
+    // created up front so the threads only ever create their own unit directory
+    Path::mkdir(root, Path::Recursive);
+
+    // Each unit is independent of the others, a header heavy TU can have
+    // hundreds of them. rdm picks the thread count so that all its rps
+    // together don't use more threads than there are cores.
+    String firstError;
+    std::mutex errorMutex;
+    List<char> unchanged(units.size(), false);
+    const std::function<void(size_t)> write = [&](size_t idx) {
         String unitRoot = root;
-        unitRoot << unit.first;
-        Path::mkdir(unitRoot, Path::Recursive);
-        // ::error() << "Writing file" << Location::path(unit.first) << unitRoot << unit.second->symbols.size()
-        //           << unit.second->targets.size()
-        //           << unit.second->usrs.size()
-        //           << unit.second->symbolNames.size();
-        uint32_t fileMapOpts = 0;
-        if (ClangIndexer::serverOpts() & Server::NoFileLock)
-            fileMapOpts |= FileMap<int, int>::NoLock;
-        if (!FileMap<Location, Symbol>::write(unitRoot + "/symbols", unit.second->symbols, fileMapOpts)) {
-            error = "Failed to write symbols";
-            return false;
-        }
-        if (!FileMap<String, Set<Location> >::write(unitRoot + "/targets", convertTargets(unit.second->targets), fileMapOpts)) {
-            error = "Failed to write targets";
-            return false;
-        }
-        if (!FileMap<String, Set<Location> >::write(unitRoot + "/usrs", unit.second->usrs, fileMapOpts)) {
-            error = "Failed to write usrs";
-            return false;
+        unitRoot << units.at(idx).first;
+        String err;
+        bool same = false;
+        const bool ok = writeUnit(units.at(idx).second, unitRoot, fileMapOpts, &same, err);
+        unchanged[idx] = same;
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (firstError.isEmpty())
+                firstError = err;
         }
-        // SBROOT
-        if (!FileMap<String, Set<Location> >::write(unitRoot + "/symnames", unit.second->symbolNames, fileMapOpts)) {
-            error = "Failed to write symbolNames";
-            return false;
-        }
-        if (!FileMap<uint32_t, Token>::write(unitRoot + "/tokens", unit.second->tokens, fileMapOpts)) {
-            error = "Failed to write symbolNames";
-            return false;
+    };
+
+    mUnitsWritten = units.size();
+    mWriteThreadsUsed = std::max<size_t>(1, std::min<size_t>(mWriteThreads, units.size()));
+    if (mWriteThreadsUsed == 1) {
+        for (size_t i=0; i<units.size() && firstError.isEmpty(); ++i)
+            write(i);
+    } else {
+        ThreadPool pool(mWriteThreadsUsed - 1);
+        auto state = std::make_shared<WriteState>(units.size(), write);
+        for (int i=1; i<mWriteThreadsUsed; ++i)
+            pool.start(std::make_shared<WriteJob>(state));
+        while (state->writeNext()) {}
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->finished < state->units)
+            state->condition.wait(lock);
+    }
+    if (!firstError.isEmpty()) {
+        error = firstError;
+        return false;
+    }
+    for (size_t i=0; i<units.size(); ++i) {
+        if (unchanged.at(i)) {
+            mIndexDataMessage.files()[units.at(i).first] |= IndexDataMessage::Unchanged;
+            ++mUnitsUnchanged;
         }
     }
+
     String sourceRoot = root;
     sourceRoot << mSource.fileId;
     Path::mkdir(sourceRoot, Path::Recursive);
@@ -1805,6 +1972,110 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
     return true;
 }
 
+bool ClangIndexer::writeUnit(Unit *unit, const Path &unitRoot, uint32_t fileMapOpts, bool *unchanged, String &error)
+{
+    Path::mkdir(unitRoot, Path::Recursive);
+    // ::error() << "Writing file" << unitRoot << unit->symbols.size()
+    //           << unit->targets.size()
+    //           << unit->usrs.size()
+    //           << unit->symbolNames.size();
+
+    // A header that is visited again without changes produces the same
+    // maps. The maps are written to their temporary files and hashed on the
+    // way, if the digest matches the one kept from last time the temporary
+    // files are dropped and rdm keeps its cached copies.
+    const Path digestPath = unitRoot + "/digest";
+    const String oldDigest = digestPath.readAll();
+    List<const char *> names = { "symbols", "targets", "usrs", "symnames" };
+    if (mIndexTokens)
+        names.append("tokens");
+    auto path = [&unitRoot](const char *name) { return Path(unitRoot + "/" + name); };
+    SHA256 digest;
+    if (!writeMaps(unit, unitRoot, fileMapOpts | FileMap<int, int>::Staged, &digest, error)) {
+        for (const char *name : names)
+            FileMapWriter<int, int>::discard(path(name));
+        return false;
+    }
+    StopWatch sw;
+    const String hash = digest.hash();
+    if (hash == oldDigest && path("symbols").isFile()) {
+        *unchanged = true;
+        for (const char *name : names) {
+            FileMapWriter<int, int>::discard(path(name));
+            mBytesSkipped += std::max<int64_t>(0, path(name).fileSize());
+        }
+        mWriteDurations[WriteCommit] += sw.restart();
+        return true;
+    }
+
+    // removed first so maps that are only partially replaced never match
+    unlink(digestPath.constData());
+    bool ok = true;
+    for (const char *name : names) {
+        if (ok && !FileMapWriter<int, int>::commit(path(name))) {
+            error = String::format<128>("Failed to write %s", name);
+            ok = false;
+        } else if (!ok) {
+            FileMapWriter<int, int>::discard(path(name));
+        }
+    }
+    if (!ok)
+        return false;
+    if (!mIndexTokens) // don't leave tokens from when the project had index-tokens behind
+        unlink(path("tokens").constData());
+    FILE *f = fopen(digestPath.constData(), "w");
+    if (f) {
+        fwrite(hash.constData(), 1, hash.size(), f);
+        fclose(f);
+    }
+    mWriteDurations[WriteCommit] += sw.restart();
+
+    if (fileMapOpts & FileMap<int, int>::Sync && !RTags::syncDirectory(unitRoot)) {
+        error = "Failed to sync " + unitRoot;
+        return false;
+    }
+    mWriteDurations[WriteSync] += sw.restart();
+    return true;
+}
+
+bool ClangIndexer::writeMaps(Unit *unit, const Path &unitRoot, uint32_t fileMapOpts, SHA256 *digest, String &error)
+{
+    auto path = [&unitRoot, digest](const char *name) {
+        if (digest)
+            digest->update(name, strlen(name));
+        return Path(unitRoot + "/" + name);
+    };
+    StopWatch sw;
+    auto done = [this, &sw](WriteDuration type) { mWriteDurations[type] += sw.restart(); };
+    if (!FileMap<Location, Symbol>::write(path("symbols"), unit->symbols, fileMapOpts, digest)) {
+        error = "Failed to write symbols";
+        return false;
+    }
+    done(WriteSymbols);
+    if (!convertTargets(unit->targets).write(path("targets"), fileMapOpts, digest)) {
+        error = "Failed to write targets";
+        return false;
+    }
+    done(WriteTargets);
+    if (!unit->usrs.write(path("usrs"), fileMapOpts, digest)) {
+        error = "Failed to write usrs";
+        return false;
+    }
+    done(WriteUsrs);
+    // SBROOT
+    if (!unit->symbolNames.write(path("symnames"), fileMapOpts, digest)) {
+        error = "Failed to write symbolNames";
+        return false;
+    }
+    done(WriteSymbolNames);
+    if (mIndexTokens && !unit->tokens.write(path("tokens"), fileMapOpts, digest)) {
+        error = "Failed to write tokens";
+        return false;
+    }
+    done(WriteTokens);
+    return true;
+}
+
 static inline bool compareFile(CXFile l, CXFile r)
 {
     CXString fnl = clang_getFileName(l);
@@ -2018,7 +2289,8 @@ bool ClangIndexer::diagnose()
                         found = true;
                 }
 #endif
-                tokenize(file, it.first, path);
+                if (mIndexTokens)
+                    tokenize(file, it.first, path);
             }
             if (!found) {
                 const Map<Location, Diagnostic>::const_iterator x = mIndexDataMessage.diagnostics().lower_bound(loc);
@@ -2040,21 +2312,23 @@ void ClangIndexer::tokenize(CXFile file, uint32_t fileId, const Path &path)
     CXSourceRange range = clang_getRange(startLoc, endLoc);
     CXToken *tokens = 0;
     unsigned numTokens = 0;
-    auto &map = unit(fileId)->tokens;
+    // clang_tokenize() returns them in order so there's nothing to sort
+    auto &builder = unit(fileId)->tokens;
     clang_tokenize(mClangUnit, range, &tokens, &numTokens);
+    builder.reserve(builder.size() + numTokens);
     for (unsigned i=0; i<numTokens; ++i) {
         const CXSourceRange range = clang_getTokenExtent(mClangUnit, tokens[i]);
         unsigned offset, endOffset;
         const CXSourceLocation start = clang_getRangeStart(range);
         clang_getSpellingLocation(start, 0, 0, 0, &offset);
         clang_getSpellingLocation(clang_getRangeEnd(range), 0, 0, 0, &endOffset);
-        map[offset] = {
-            clang_getTokenKind(tokens[i]),
-            RTags::eatString(clang_getTokenSpelling(mClangUnit, tokens[i])),
-            createLocation(start),
-            offset,
-            endOffset - offset
-        };
+        builder.append(offset, {
+                clang_getTokenKind(tokens[i]),
+                RTags::eatString(clang_getTokenSpelling(mClangUnit, tokens[i])),
+                createLocation(start),
+                offset,
+                endOffset - offset
+            });
     }
 
     clang_disposeTokens(mClangUnit, tokens, numTokens);
@@ -2068,7 +2342,16 @@ bool ClangIndexer::visit()
 
     StopWatch watch;
 
-    visit(clang_getTranslationUnitCursor(mClangUnit));
+    if (mIndexedInSession) {
+        indexMacros();
+    } else if (ClangIndexer::serverOpts() & Server::IndexerCallbacks) {
+        indexWithCallbacks();
+        indexMacros();
+    } else {
+        if (ClangIndexer::serverOpts() & Server::PruneBlockedHeaders)
+            findIncludeOffsets();
+        visit(clang_getTranslationUnitCursor(mClangUnit));
+    }
 
     for (const auto &it : mIndexDataMessage.files()) {
         if (it.second & IndexDataMessage::Visited)
@@ -2096,6 +2379,231 @@ bool ClangIndexer::visit()
     return true;
 }
 
+IndexerCallbacks ClangIndexer::indexerCallbacks()
+{
+    IndexerCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.abortQuery = ClangIndexer::abortQuery;
+    callbacks.ppIncludedFile = ClangIndexer::ppIncludedFile;
+    callbacks.indexDeclaration = ClangIndexer::indexDeclaration;
+    callbacks.indexEntityReference = ClangIndexer::indexEntityReference;
+    return callbacks;
+}
+
+void ClangIndexer::indexWithCallbacks()
+{
+    IndexerCallbacks callbacks = indexerCallbacks();
+    // The translation unit is already parsed (diagnose() and tokenize()
+    // need it) so there's no parsing left for
+    // CXIndexOpt_SkipParsedBodiesInSession to skip.
+    mIndexerCallbacks = true;
+    CXIndexAction action = clang_IndexAction_create(mIndex);
+    if (clang_indexTranslationUnit(action, this, &callbacks, sizeof(callbacks),
+                                   CXIndexOpt_IndexFunctionLocalSymbols, mClangUnit)) {
+        error() << "clang_indexTranslationUnit failed for" << mSourceFile;
+    }
+    clang_IndexAction_dispose(action);
+    mIndexerCallbacks = false;
+}
+
+void ClangIndexer::indexMacros()
+{
+    // The preprocessing record is made of the translation unit's children so
+    // there's no need to recurse
+    const CXCursor unitCursor = clang_getTranslationUnitCursor(mClangUnit);
+    mParents.append(unitCursor);
+    clang_visitChildren(unitCursor, ClangIndexer::macroVisitor, this);
+    mParents.removeLast();
+}
+
+CXChildVisitResult ClangIndexer::macroVisitor(CXCursor cursor, CXCursor, CXClientData userData)
+{
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(userData);
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    if (kind != CXCursor_MacroDefinition && kind != CXCursor_MacroExpansion)
+        return CXChildVisit_Continue;
+    ++indexer->mCursorsVisited;
+
+    bool blocked;
+    const Location loc = indexer->createLocation(cursor, &blocked);
+    if (blocked) {
+        ++indexer->mBlocked;
+        return CXChildVisit_Continue;
+    } else if (loc.isNull()) {
+        return CXChildVisit_Continue;
+    }
+    ++indexer->mAllowed;
+
+    if (kind == CXCursor_MacroDefinition) {
+        indexer->handleCursor(cursor, kind, loc);
+    } else {
+        indexer->handleReference(cursor, kind, loc, clang_getCursorReferenced(cursor));
+    }
+    indexer->mLastCursor = cursor;
+    return CXChildVisit_Continue;
+}
+
+void ClangIndexer::indexInSession(const List<String> &args, CXUnsavedFile *unsaved, int unsavedCount,
+                                  Flags<CXTranslationUnit_Flags> flags)
+{
+    mClangLine = "clang ";
+    List<const char*> clangArgs(args.size(), 0);
+    for (size_t i=0; i<args.size(); ++i) {
+        clangArgs[i] = args.at(i).constData();
+        mClangLine += '"' + args.at(i) + "\" ";
+    }
+    mClangLine += mSourceFile;
+
+    // Parses and indexes in one go so the callbacks come before mClangUnit
+    // is set. Bodies of functions in headers this session has parsed
+    // before, and in system headers, are skipped.
+    IndexerCallbacks callbacks = indexerCallbacks();
+    mIndexerCallbacks = true;
+    if (clang_indexSourceFile(mSession->action, this, &callbacks, sizeof(callbacks),
+                              CXIndexOpt_IndexFunctionLocalSymbols|CXIndexOpt_SkipParsedBodiesInSession,
+                              mSourceFile.constData(), clangArgs.data(), clangArgs.size(),
+                              unsaved, unsavedCount, &mClangUnit, flags.cast<unsigned int>())) {
+        error() << "clang_indexSourceFile failed for" << mSourceFile;
+    }
+    mIndexerCallbacks = false;
+    mIndexedInSession = mClangUnit != 0;
+}
+
+bool ClangIndexer::sessionSkippedVisitedBodies() const
+{
+    // libclang skips the bodies in files this session parsed for an earlier
+    // job, where they may have been blocked, and always in system headers
+    for (const auto &it : mIndexDataMessage.files()) {
+        if (!(it.second & IndexDataMessage::Visited))
+            continue;
+        if (mSession->parsed.contains(it.first))
+            return true;
+        const Path path = Location::path(it.first);
+        const CXFile file = clang_getFile(mClangUnit, path.constData());
+        if (file && clang_Location_isInSystemHeader(clang_getLocationForOffset(mClangUnit, file, 0)))
+            return true;
+    }
+    return false;
+}
+
+int ClangIndexer::abortQuery(CXClientData, void *)
+{
+    return 0;
+}
+
+CXIdxClientFile ClangIndexer::ppIncludedFile(CXClientData userData, const CXIdxIncludedFileInfo *info)
+{
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(userData);
+    ++indexer->mCursorsVisited;
+    bool blocked;
+    const Location loc = indexer->createLocation(clang_indexLoc_getCXSourceLocation(info->hashLoc), &blocked);
+    if (blocked) {
+        ++indexer->mBlocked;
+    } else if (!loc.isNull()) {
+        ++indexer->mAllowed;
+        if (!indexer->addInclude(loc, info->file, info->filename))
+            error() << "couldn't create included file" << info->filename << loc;
+    }
+    return 0;
+}
+
+void ClangIndexer::indexDeclaration(CXClientData userData, const CXIdxDeclInfo *info)
+{
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(userData);
+    ++indexer->mCursorsVisited;
+    const CXCursor cursor = info->cursor;
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+    if (RTags::cursorType(kind) != RTags::Type_Cursor)
+        return;
+
+    bool blocked;
+    const Location loc = indexer->createLocation(cursor, &blocked);
+    if (blocked) {
+        ++indexer->mBlocked;
+        return;
+    } else if (loc.isNull()) {
+        return;
+    }
+    ++indexer->mAllowed;
+
+    if (Symbol::isClass(kind))
+        indexer->mLastClass = loc;
+    indexer->mParents.append(info->lexicalContainer ? info->lexicalContainer->cursor : nullCursor);
+    indexer->handleCursor(cursor, kind, loc);
+    if (const CXIdxCXXClassDeclInfo *classInfo = clang_index_getCXXClassDeclInfo(info)) {
+        for (unsigned int i=0; i<classInfo->numBases; ++i)
+            indexer->handleBaseClassSpecifier(classInfo->bases[i]->cursor);
+    }
+    indexer->mParents.removeLast();
+    indexer->mLastCursor = cursor;
+}
+
+void ClangIndexer::indexEntityReference(CXClientData userData, const CXIdxEntityRefInfo *info)
+{
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(userData);
+    ++indexer->mCursorsVisited;
+    if (!info->referencedEntity)
+        return;
+    const CXCursor cursor = info->cursor;
+    const CXCursorKind kind = clang_getCursorKind(cursor);
+
+    bool blocked;
+    const Location loc = indexer->createLocation(clang_indexLoc_getCXSourceLocation(info->loc), &blocked);
+    if (blocked) {
+        ++indexer->mBlocked;
+        return;
+    } else if (loc.isNull()) {
+        return;
+    }
+    ++indexer->mAllowed;
+
+    indexer->mParents.append(info->container ? info->container->cursor : nullCursor);
+    indexer->handleReference(cursor, kind, loc, info->referencedEntity->cursor);
+    indexer->mParents.removeLast();
+    indexer->mLastCursor = cursor;
+}
+
+void ClangIndexer::findIncludeOffsets()
+{
+    mIncludeOffsets.clear();
+    clang_getInclusions(mClangUnit, ClangIndexer::inclusionVisitor, this);
+    for (auto &it : mIncludeOffsets)
+        std::sort(it.second.begin(), it.second.end());
+}
+
+void ClangIndexer::inclusionVisitor(CXFile, CXSourceLocation *includeStack,
+                                    unsigned includeLen, CXClientData userData)
+{
+    if (!includeLen) // the source file itself
+        return;
+    ClangIndexer *indexer = static_cast<ClangIndexer*>(userData);
+    CXFile file;
+    unsigned int offset;
+    clang_getSpellingLocation(includeStack[0], &file, 0, 0, &offset);
+    if (file)
+        indexer->mIncludeOffsets[file].append(offset);
+}
+
+bool ClangIndexer::isBlockedRegion(const CXCursor &cursor)
+{
+    const CXSourceRange range = clang_getCursorExtent(cursor);
+    CXFile file, endFile;
+    unsigned int start, end;
+    clang_getSpellingLocation(clang_getRangeStart(range), &file, 0, 0, &start);
+    clang_getSpellingLocation(clang_getRangeEnd(range), &endFile, 0, 0, &end);
+    if (!file || file != endFile)
+        return false;
+    bool blocked;
+    createLocation(file, 1, 1, &blocked);
+    if (!blocked)
+        return false;
+    const auto includes = mIncludeOffsets.find(file);
+    if (includes == mIncludeOffsets.end())
+        return true;
+    const auto it = std::lower_bound(includes->second.begin(), includes->second.end(), start);
+    return it == includes->second.end() || *it >= end;
+}
+
 CXChildVisitResult ClangIndexer::verboseVisitor(CXCursor cursor, CXCursor, CXClientData userData)
 {
     VerboseVisitorUserData *u = reinterpret_cast<VerboseVisitorUserData*>(userData);
@@ -2139,9 +2647,9 @@ void ClangIndexer::addFileSymbol(uint32_t file)
     Path path = Location::path(file);
     Sandbox::encode(path);
     auto ref = unit(loc);
-    ref->symbolNames[path].insert(loc);
+    ref->symbolNames.insert(path, loc);
     const char *fn = path.fileName();
-    ref->symbolNames[fn].insert(loc);
+    ref->symbolNames.insert(fn, loc);
     Symbol &sym = ref->symbols[loc];
     sym.location = loc;
 }
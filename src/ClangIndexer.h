@@ -17,11 +17,15 @@
 #define ClangIndexer_h
 
 #include <sys/stat.h>
+#include <atomic>
 #include "Token.h"
 
+#include "FileMapBuilder.h"
 #include "IndexDataMessage.h"
+#include "LocationIndex.h"
 #include "rct/Hash.h"
 #include "rct/Path.h"
+#include "rct/Set.h"
 #include "rct/StopWatch.h"
 #include "RTags.h"
 #include "Server.h"
@@ -34,7 +38,29 @@ public:
     static const CXSourceLocation nullLocation;
     static const CXCursor nullCursor;
 
-    ClangIndexer();
+    // A persistent rp (rp --session) indexes all its jobs with the same
+    // CXIndexAction so libclang can skip function bodies it has already
+    // parsed (CXIndexOpt_SkipParsedBodiesInSession). parsed holds the files
+    // of all the jobs so far, blocked ones included, so a job that gets to
+    // visit one of them can be parsed again without skipping.
+    struct Session {
+        Session()
+            : index(0), action(0), jobs(0)
+        {}
+        ~Session()
+        {
+            if (action)
+                clang_IndexAction_dispose(action);
+            if (index)
+                clang_disposeIndex(index);
+        }
+        CXIndex index;
+        CXIndexAction action;
+        int jobs;
+        Set<uint32_t> parsed;
+    };
+
+    ClangIndexer(Session *session = 0);
     ~ClangIndexer();
 
     bool exec(const String &data);
@@ -44,6 +70,9 @@ private:
     bool diagnose();
     bool visit();
     bool parse();
+    void indexInSession(const List<String> &args, CXUnsavedFile *unsaved, int unsavedCount,
+                        Flags<CXTranslationUnit_Flags> flags);
+    bool sessionSkippedVisitedBodies() const;
     void tokenize(CXFile file, uint32_t fileId, const Path &path);
     bool writeFiles(const Path &root, String &error);
 
@@ -53,45 +82,33 @@ private:
 
     inline Location createLocation(const CXSourceLocation &location, bool *blocked = 0, unsigned *offset = 0)
     {
-        CXString fileName;
         unsigned int line, col;
         CXFile file;
         clang_getSpellingLocation(location, &file, &line, &col, offset);
-        if (file) {
-            fileName = clang_getFileName(file);
-        } else {
-            if (blocked)
-                *blocked = false;
-            return Location();
-        }
-        const char *fn = clang_getCString(fileName);
-        assert(fn);
-        if (!*fn || !strcmp("<built-in>", fn) || !strcmp("<command line>", fn)) {
-            if (blocked)
-                *blocked = false;
-            clang_disposeString(fileName);
-            return Location();
-        }
-        const Path path = RTags::eatString(fileName);
-        const Location ret = createLocation(path, line, col, blocked);
-        return ret;
+        return createLocation(file, line, col, blocked);
     }
-    Location createLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked = 0)
+    inline Location createLocation(CXFile file, unsigned int line, unsigned int col, bool *blocked = 0)
     {
         if (blocked)
             *blocked = false;
         if (!file)
             return Location();
 
-        CXString fn = clang_getFileName(file);
-        const char *cstr = clang_getCString(fn);
-        if (!cstr) {
-            clang_disposeString(fn);
+        Hash<CXFile, CachedFile>::iterator it = mFiles.find(file);
+        if (it == mFiles.end())
+            it = mFiles.insert(std::make_pair(file, resolveFile(file))).first;
+        CachedFile &cached = it->second;
+        if (!cached.fileId)
             return Location();
+        if (blocked) {
+            if (cached.state == CachedFile::Unknown)
+                cached.state = isBlocked(cached.fileId) ? CachedFile::Blocked : CachedFile::Allowed;
+            if (cached.state == CachedFile::Blocked) {
+                *blocked = true;
+                return Location();
+            }
         }
-        const Path p = Path::resolved(cstr);
-        clang_disposeString(fn);
-        return createLocation(p, line, col, blocked);
+        return Location(cached.fileId, line, col);
     }
     inline Location createLocation(const CXCursor &cursor, bool *blocked = 0)
     {
@@ -101,6 +118,32 @@ private:
         return createLocation(location, blocked);
     }
     Location createLocation(const Path &file, unsigned int line, unsigned int col, bool *blocked = 0);
+
+    // Every cursor in a file resolves to the same file id and blocked state
+    // so they're looked up once per CXFile of the translation unit. fileId
+    // 0 means that locations in the file are ignored, e.g. <built-in>.
+    struct CachedFile {
+        enum State {
+            Unknown,
+            Blocked,
+            Allowed
+        };
+        uint32_t fileId;
+        State state;
+    };
+    CachedFile resolveFile(CXFile file);
+    bool isBlocked(uint32_t fileId);
+
+    // With Server::PruneBlockedHeaders declarations that lie entirely
+    // within a blocked file are skipped without visiting their children,
+    // unless something is #included inside them (e.g. extern "C" blocks).
+    // mIncludeOffsets has the sorted offsets of the #include directives in
+    // each file of the translation unit.
+    void findIncludeOffsets();
+    static void inclusionVisitor(CXFile includedFile, CXSourceLocation *includeStack,
+                                 unsigned includeLen, CXClientData userData);
+    bool isBlockedRegion(const CXCursor &cursor);
+    Hash<CXFile, List<unsigned int> > mIncludeOffsets;
     String addNamePermutations(const CXCursor &cursor,
                                Location location,
                                RTags::CursorType cursorType);
@@ -112,6 +155,7 @@ private:
                          Symbol **cursorPtr = 0);
     void handleBaseClassSpecifier(const CXCursor &cursor);
     void handleInclude(const CXCursor &cursor, CXCursorKind kind, Location location);
+    bool addInclude(Location location, CXFile includedFile, const String &fileName);
     CXChildVisitResult handleStatement(const CXCursor &cursor, CXCursorKind kind, Location location);
     Location findByUSR(const CXCursor &cursor, CXCursorKind kind, Location loc) const;
     void addOverriddenCursors(const CXCursor &cursor, Location location);
@@ -120,6 +164,9 @@ private:
                                                   Symbol **cursorPtr = 0);
     void visit(CXCursor cursor)
     {
+        // libclang hands the callbacks engine the children as well
+        if (mIndexerCallbacks)
+            return;
         mParents.append(cursor);
         clang_visitChildren(cursor, visitorHelper, this);
         mParents.removeLast();
@@ -129,14 +176,29 @@ private:
     static CXChildVisitResult verboseVisitor(CXCursor cursor, CXCursor, CXClientData userData);
     static CXChildVisitResult resolveAutoTypeRefVisitor(CXCursor cursor, CXCursor, CXClientData data);
 
+    // Server::IndexerCallbacks, builds the index from the declarations and
+    // references clang_indexTranslationUnit() reports instead of walking
+    // the AST. Both engines feed the same handleCursor()/handleReference().
+    // libclang has no callbacks for macros so indexMacros() picks up their
+    // definitions and expansions from the preprocessing record afterwards.
+    void indexWithCallbacks();
+    void indexMacros();
+    static CXChildVisitResult macroVisitor(CXCursor cursor, CXCursor, CXClientData userData);
+    static IndexerCallbacks indexerCallbacks();
+    static int abortQuery(CXClientData userData, void *);
+    static CXIdxClientFile ppIncludedFile(CXClientData userData, const CXIdxIncludedFileInfo *info);
+    static void indexDeclaration(CXClientData userData, const CXIdxDeclInfo *info);
+    static void indexEntityReference(CXClientData userData, const CXIdxEntityRefInfo *info);
+
     void onMessage(const std::shared_ptr<Message> &msg, const std::shared_ptr<Connection> &conn);
 
+    // symbols and targets are looked up and updated while visiting so they
+    // stay Maps, the rest is only appended to
     struct Unit {
         Map<Location, Symbol> symbols;
         Map<Location, Map<String, uint16_t> > targets;
-        Map<String, Set<Location> > usrs;
-        Map<String, Set<Location> > symbolNames;
-        Map<uint32_t, Token> tokens;
+        LocationIndex usrs, symbolNames;
+        FileMapBuilder<uint32_t, Token> tokens;
     };
 
     std::shared_ptr<Unit> unit(uint32_t fileId)
@@ -147,6 +209,8 @@ private:
         return unit;
     }
     std::shared_ptr<Unit> unit(Location loc) { return unit(loc.fileId()); }
+    bool writeUnit(Unit *unit, const Path &unitRoot, uint32_t fileMapOpts, bool *unchanged, String &error);
+    bool writeMaps(Unit *unit, const Path &unitRoot, uint32_t fileMapOpts, SHA256 *digest, String &error);
 
     enum FindResult {
         Found,
@@ -164,8 +228,11 @@ private:
         Map<String, MacroLocationData> data;
     };
     Map<Location, MacroData> mMacroTokens;
+    // usr -> location of the first definition of each macro
+    Hash<String, Location> mMacroDefinitions;
 
     Hash<uint32_t, std::shared_ptr<Unit> > mUnits;
+    Hash<CXFile, CachedFile> mFiles;
 
     Path mProject;
     Source mSource;
@@ -173,6 +240,7 @@ private:
     IndexDataMessage mIndexDataMessage;
     CXTranslationUnit mClangUnit;
     CXIndex mIndex;
+    Session *mSession;
     CXCursor mLastCursor, mLastCallExpr;
     Location mLastClass;
     String mClangLine;
@@ -182,13 +250,33 @@ private:
     StopWatch mTimer;
     int mParseDuration, mVisitDuration, mBlocked, mAllowed,
         mIndexed, mVisitFileTimeout, mIndexDataMessageTimeout,
-        mFileIdsQueried, mFileIdsQueriedTime, mCursorsVisited;
+        mFileIdsQueried, mFileIdsQueriedTime, mCursorsVisited, mCursorsPruned;
     UnsavedFiles mUnsavedFiles;
     List<String> mDebugLocations;
     FILE *mLogFile;
     std::shared_ptr<Connection> mConnection;
     Path mDataDir;
     bool mUnionRecursion;
+    bool mIndexerCallbacks;
+    bool mIndexedInSession;
+    bool mIndexTokens;
+
+    // Units are written on up to mWriteThreads threads. The durations are
+    // summed over all units and threads.
+    enum WriteDuration {
+        WriteSymbols,
+        WriteTargets,
+        WriteUsrs,
+        WriteSymbolNames,
+        WriteTokens,
+        WriteCommit, // comparing the digest and renaming or dropping the files
+        WriteSync,
+        WriteDurationCount
+    };
+    std::atomic<int> mWriteDurations[WriteDurationCount];
+    uint32_t mWriteThreads;
+    int mWriteThreadsUsed, mUnitsWritten, mUnitsUnchanged;
+    std::atomic<uint64_t> mBytesSkipped;
 
     struct Scope {
         enum ScopeType {
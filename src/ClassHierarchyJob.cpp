@@ -42,6 +42,8 @@ int ClassHierarchyJob::execute()
                                                                                          int indent,
                                                                                          FindFunc find)
     {
+        if (isAborted())
+            return;
         auto classes = find(sym);
         if (!indent) {
             if (classes.isEmpty()) {
@@ -66,7 +68,7 @@ int ClassHierarchyJob::execute()
     recurse(symbol, "Superclasses:", 0, [this](const Symbol &sym) {
             Set<Symbol> ret;
             for (const String &usr : sym.baseClasses) {
-                for (const auto &s : project()->findByUsr(usr, sym.location.fileId(), Project::ArgDependsOn)) {
+                for (const auto &s : project()->findByUsr(usr, sym.location.fileId(), Project::ArgDependsOn, Location(), cancellation())) {
                     if (s.isDefinition()) {
                         ret.insert(s);
                         break;
@@ -75,6 +77,6 @@ int ClassHierarchyJob::execute()
             }
             return ret;
         });
-    recurse(symbol, "Subclasses:", 0, [this](const Symbol &sym) { return project()->findSubclasses(sym); });
+    recurse(symbol, "Subclasses:", 0, [this](const Symbol &sym) { return project()->findSubclasses(sym, cancellation()); });
     return 0;
 }
@@ -0,0 +1,493 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "DependencyGraph.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rct/Log.h"
+#include "rct/Rct.h"
+
+namespace {
+enum { Magic = 0x47445452 }; // "RTDG"
+struct Header {
+    uint32_t magic, version;
+    uint64_t stamp;
+    uint32_t nodeCount, edgeCount;
+};
+}
+
+static inline void insertSorted(List<uint32_t> &list, uint32_t fileId)
+{
+    auto it = std::lower_bound(list.begin(), list.end(), fileId);
+    if (it == list.end() || *it != fileId)
+        list.insert(it, fileId);
+}
+
+static inline void removeSorted(List<uint32_t> &list, uint32_t fileId)
+{
+    auto it = std::lower_bound(list.begin(), list.end(), fileId);
+    if (it != list.end() && *it == fileId)
+        list.erase(it);
+}
+
+static inline DependencyGraph::Edges edges(const List<uint32_t> &list)
+{
+    return DependencyGraph::Edges(list.data(), list.data() + list.size());
+}
+
+DependencyGraph::DependencyGraph()
+    : mPendingCompaction(false), mSize(0), mNodeCount(0), mNodes(0), mIncludeOffsets(0), mIncludes(0),
+      mDependentOffsets(0), mDependents(0), mCount(0), mStamp(0)
+{
+}
+
+DependencyGraph::~DependencyGraph()
+{
+    unmap();
+}
+
+DependencyGraph::Mapping::~Mapping()
+{
+    munmap(const_cast<char*>(mPointer), mSize);
+}
+
+void DependencyGraph::unmap()
+{
+    mMapping.reset();
+    mSize = 0;
+    mNodeCount = 0;
+    mNodes = mIncludeOffsets = mIncludes = mDependentOffsets = mDependents = 0;
+}
+
+void DependencyGraph::clear()
+{
+    unmap();
+    mOverlay.clear();
+    {
+        std::lock_guard<std::mutex> lock(mClosureCache.mutex);
+        mClosureCache.clear();
+    }
+    mCount = 0;
+    mStamp = 0;
+}
+
+int DependencyGraph::mappedIndex(uint32_t fileId) const
+{
+    const uint32_t *end = mNodes + mNodeCount;
+    const uint32_t *it = std::lower_bound(mNodes, end, fileId);
+    if (it == end || *it != fileId)
+        return -1;
+    return it - mNodes;
+}
+
+const DependencyGraph::Row *DependencyGraph::overlayRow(uint32_t fileId) const
+{
+    const auto it = mOverlay.find(fileId);
+    return it == mOverlay.end() ? 0 : &it->second;
+}
+
+bool DependencyGraph::contains(uint32_t fileId) const
+{
+    if (const Row *row = overlayRow(fileId))
+        return !row->removed;
+    return mappedIndex(fileId) != -1;
+}
+
+List<uint32_t> DependencyGraph::fileIds() const
+{
+    List<uint32_t> ret;
+    ret.reserve(mCount);
+    for (uint32_t i=0; i<mNodeCount; ++i) {
+        if (!mOverlay.contains(mNodes[i]))
+            ret.append(mNodes[i]);
+    }
+    for (const auto &row : mOverlay) {
+        if (!row.second.removed)
+            ret.append(row.first);
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+DependencyGraph::Edges DependencyGraph::includes(uint32_t fileId) const
+{
+    if (const Row *row = overlayRow(fileId))
+        return edges(row->includes);
+    const int idx = mappedIndex(fileId);
+    if (idx == -1)
+        return Edges();
+    return Edges(mIncludes + mIncludeOffsets[idx], mIncludes + mIncludeOffsets[idx + 1]);
+}
+
+DependencyGraph::Edges DependencyGraph::dependents(uint32_t fileId) const
+{
+    if (const Row *row = overlayRow(fileId))
+        return edges(row->dependents);
+    const int idx = mappedIndex(fileId);
+    if (idx == -1)
+        return Edges();
+    return Edges(mDependents + mDependentOffsets[idx], mDependents + mDependentOffsets[idx + 1]);
+}
+
+DependencyGraph::Row &DependencyGraph::materialize(uint32_t fileId)
+{
+    auto it = mOverlay.find(fileId);
+    if (it == mOverlay.end()) {
+        Row &row = mOverlay[fileId];
+        const int idx = mappedIndex(fileId);
+        if (idx != -1) {
+            const Edges inc(mIncludes + mIncludeOffsets[idx], mIncludes + mIncludeOffsets[idx + 1]);
+            const Edges dep(mDependents + mDependentOffsets[idx], mDependents + mDependentOffsets[idx + 1]);
+            row.includes.assign(inc.begin(), inc.end());
+            row.dependents.assign(dep.begin(), dep.end());
+        } else {
+            ++mCount;
+        }
+        return row;
+    }
+    if (it->second.removed) {
+        it->second.removed = false;
+        ++mCount;
+    }
+    return it->second;
+}
+
+void DependencyGraph::insert(uint32_t fileId)
+{
+    if (!contains(fileId))
+        materialize(fileId);
+}
+
+void DependencyGraph::include(uint32_t includer, uint32_t inclusiary)
+{
+    if (includes(includer).contains(inclusiary))
+        return;
+    invalidateClosures(includer, inclusiary);
+    insertSorted(materialize(includer).includes, inclusiary);
+    insertSorted(materialize(inclusiary).dependents, includer);
+}
+
+void DependencyGraph::clearIncludes(uint32_t fileId)
+{
+    if (includes(fileId).isEmpty())
+        return;
+    // every closure that goes through one of the removed edges contains fileId
+    invalidateClosures(fileId);
+    Row &row = materialize(fileId);
+    List<uint32_t> includes;
+    std::swap(includes, row.includes);
+    for (uint32_t inc : includes)
+        removeSorted(materialize(inc).dependents, fileId);
+}
+
+bool DependencyGraph::remove(uint32_t fileId)
+{
+    if (!contains(fileId))
+        return false;
+    invalidateClosures(fileId);
+    Row &row = materialize(fileId);
+    List<uint32_t> includes, dependents;
+    std::swap(includes, row.includes);
+    std::swap(dependents, row.dependents);
+    for (uint32_t inc : includes)
+        removeSorted(materialize(inc).dependents, fileId);
+    for (uint32_t dep : dependents)
+        removeSorted(materialize(dep).includes, fileId);
+    if (mappedIndex(fileId) != -1) {
+        mOverlay[fileId].removed = true;
+    } else {
+        mOverlay.remove(fileId);
+    }
+    --mCount;
+    return true;
+}
+
+std::shared_ptr<const FileIdSet> DependencyGraph::ClosureCache::find(uint64_t key)
+{
+    const std::shared_ptr<Entry> entry = entries.value(key);
+    if (!entry)
+        return std::shared_ptr<const FileIdSet>();
+    lru.remove(entry);
+    lru.append(entry);
+    return entry->value;
+}
+
+void DependencyGraph::ClosureCache::insert(uint64_t key, const std::shared_ptr<const FileIdSet> &value, size_t max)
+{
+    std::shared_ptr<Entry> &entry = entries[key];
+    if (entry)
+        lru.remove(entry);
+    entry = std::make_shared<Entry>(key, value);
+    lru.append(entry);
+    while (entries.size() > max)
+        remove(lru.first());
+}
+
+void DependencyGraph::ClosureCache::remove(const std::shared_ptr<Entry> &entry)
+{
+    // entry may be the reference held by entries
+    const std::shared_ptr<Entry> e = entry;
+    lru.remove(e);
+    entries.remove(e->key);
+}
+
+void DependencyGraph::ClosureCache::copy(const ClosureCache &other)
+{
+    for (std::shared_ptr<Entry> e = other.lru.first(); e; e = e->next) {
+        const std::shared_ptr<Entry> entry = std::make_shared<Entry>(e->key, e->value);
+        entries[e->key] = entry;
+        lru.append(entry);
+    }
+}
+
+void DependencyGraph::ClosureCache::clear()
+{
+    // the list links its entries both ways
+    while (!lru.isEmpty())
+        lru.takeFirst();
+    entries.clear();
+}
+
+std::shared_ptr<const FileIdSet> DependencyGraph::closure(uint32_t fileId, Direction direction) const
+{
+    const uint64_t key = (static_cast<uint64_t>(fileId) << 1) | direction;
+    {
+        std::lock_guard<std::mutex> lock(mClosureCache.mutex);
+        std::shared_ptr<const FileIdSet> cached = mClosureCache.find(key);
+        if (cached)
+            return cached;
+    }
+
+    std::shared_ptr<FileIdSet> ret = std::make_shared<FileIdSet>();
+    List<uint32_t> pending;
+    pending.append(fileId);
+    while (!pending.isEmpty()) {
+        const uint32_t node = pending.back();
+        pending.pop_back();
+        for (uint32_t next : (direction == Includes ? includes(node) : dependents(node))) {
+            if (ret->insert(next))
+                pending.append(next);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mClosureCache.mutex);
+    mClosureCache.insert(key, ret, MaxClosures);
+    return ret;
+}
+
+void DependencyGraph::invalidateClosures(uint32_t a, uint32_t b)
+{
+    std::lock_guard<std::mutex> lock(mClosureCache.mutex);
+    std::shared_ptr<ClosureCache::Entry> e = mClosureCache.lru.first();
+    while (e) {
+        const std::shared_ptr<ClosureCache::Entry> next = e->next;
+        const uint32_t fileId = static_cast<uint32_t>(e->key >> 1);
+        if (fileId == a || fileId == b || e->value->contains(a) || e->value->contains(b))
+            mClosureCache.remove(e);
+        e = next;
+    }
+}
+
+bool DependencyGraph::map(const Path &path, String *error)
+{
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1) {
+        if (error)
+            *error = "Can't open " + path + ": " + Rct::strerror();
+        return false;
+    }
+    struct stat st;
+    const void *pointer = MAP_FAILED;
+    if (!fstat(fd, &st) && static_cast<size_t>(st.st_size) >= sizeof(Header))
+        pointer = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int ret;
+    eintrwrap(ret, close(fd));
+    if (pointer == MAP_FAILED) {
+        if (error)
+            *error = "Can't map " + path + ": " + Rct::strerror();
+        return false;
+    }
+    mMapping = std::make_shared<const Mapping>(static_cast<const char*>(pointer), st.st_size);
+    mSize = st.st_size;
+
+    Header header;
+    memcpy(&header, mMapping->data(), sizeof(header));
+    const size_t expected = (sizeof(Header)
+                             + (sizeof(uint32_t) * (header.nodeCount + ((header.nodeCount + 1) * 2)))
+                             + (sizeof(uint32_t) * header.edgeCount * 2));
+    if (header.magic != Magic || header.version != Version || header.stamp != mStamp || expected != mSize) {
+        if (error)
+            *error = "Mismatched dependency file " + path;
+        unmap();
+        return false;
+    }
+    mNodeCount = header.nodeCount;
+    mNodes = reinterpret_cast<const uint32_t*>(mMapping->data() + sizeof(Header));
+    mIncludeOffsets = mNodes + mNodeCount;
+    mIncludes = mIncludeOffsets + mNodeCount + 1;
+    mDependentOffsets = mIncludes + header.edgeCount;
+    mDependents = mDependentOffsets + mNodeCount + 1;
+    return true;
+}
+
+bool DependencyGraph::load(const Path &path, String *error)
+{
+    unmap();
+    {
+        std::lock_guard<std::mutex> lock(mClosureCache.mutex);
+        mClosureCache.clear();
+    }
+    mPendingCompaction = false;
+    if (mStamp && !map(path, error)) {
+        // The project file may have been written after a compaction that
+        // didn't get to commitCompaction()
+        const Path pending = path + ".new";
+        if (!map(pending, 0))
+            return false;
+        if (rename(pending.constData(), path.constData()))
+            mPendingCompaction = true;
+        if (error)
+            error->clear();
+    }
+
+    mCount = mNodeCount;
+    for (const auto &row : mOverlay) {
+        if (mappedIndex(row.first) != -1) {
+            if (row.second.removed)
+                --mCount;
+        } else if (!row.second.removed) {
+            ++mCount;
+        }
+    }
+    return true;
+}
+
+bool DependencyGraph::needsCompaction() const
+{
+    return mOverlay.size() > std::max<size_t>(1024, mNodeCount / 8);
+}
+
+bool DependencyGraph::compact(const Path &path, String *error)
+{
+    const List<uint32_t> nodes = fileIds();
+    List<uint32_t> includeOffsets, includeEdges, dependentOffsets, dependentEdges;
+    includeOffsets.reserve(nodes.size() + 1);
+    dependentOffsets.reserve(nodes.size() + 1);
+    for (uint32_t fileId : nodes) {
+        includeOffsets.append(includeEdges.size());
+        for (uint32_t inc : includes(fileId))
+            includeEdges.append(inc);
+        dependentOffsets.append(dependentEdges.size());
+        for (uint32_t dep : dependents(fileId))
+            dependentEdges.append(dep);
+    }
+    includeOffsets.append(includeEdges.size());
+    dependentOffsets.append(dependentEdges.size());
+    assert(includeEdges.size() == dependentEdges.size());
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = Magic;
+    header.version = Version;
+    header.stamp = std::max<uint64_t>(mStamp + 1, Rct::currentTimeMs());
+    header.nodeCount = nodes.size();
+    header.edgeCount = includeEdges.size();
+
+    const Path pending = path + ".new";
+    const Path tmp = path + ".tmp";
+    FILE *f = fopen(tmp.constData(), "w");
+    if (!f) {
+        Path::mkdir(path.parentDir(), Path::Recursive);
+        f = fopen(tmp.constData(), "w");
+        if (!f) {
+            if (error)
+                *error = "Can't open " + tmp + " for writing: " + Rct::strerror();
+            return false;
+        }
+    }
+    auto writeList = [f](const List<uint32_t> &list) {
+        return list.isEmpty() || fwrite(list.data(), sizeof(uint32_t) * list.size(), 1, f) == 1;
+    };
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1
+               && writeList(nodes)
+               && writeList(includeOffsets)
+               && writeList(includeEdges)
+               && writeList(dependentOffsets)
+               && writeList(dependentEdges));
+    ok = !fclose(f) && ok;
+    if (!ok || rename(tmp.constData(), pending.constData())) {
+        if (error)
+            *error = "Can't write " + pending + ": " + Rct::strerror();
+        unlink(tmp.constData());
+        return false;
+    }
+
+    // Map the new file before dropping the old mapping so that a failure leaves
+    // the graph intact. The current file stays in place until the project file
+    // with the new stamp has been written.
+    DependencyGraph compacted;
+    compacted.mStamp = header.stamp;
+    if (!compacted.map(pending, error)) {
+        unlink(pending.constData());
+        return false;
+    }
+
+    unmap();
+    mOverlay.clear();
+    mMapping = compacted.mMapping;
+    mSize = compacted.mSize;
+    mNodeCount = compacted.mNodeCount;
+    mNodes = compacted.mNodes;
+    mIncludeOffsets = compacted.mIncludeOffsets;
+    mIncludes = compacted.mIncludes;
+    mDependentOffsets = compacted.mDependentOffsets;
+    mDependents = compacted.mDependents;
+    mStamp = compacted.mStamp;
+    assert(mCount == mNodeCount);
+    mPendingCompaction = true;
+    return true;
+}
+
+bool DependencyGraph::commitCompaction(const Path &path, String *error)
+{
+    if (!mPendingCompaction)
+        return true;
+    const Path pending = path + ".new";
+    if (rename(pending.constData(), path.constData())) {
+        if (error)
+            *error = "Can't rename " + pending + ": " + Rct::strerror();
+        return false;
+    }
+    mPendingCompaction = false;
+    return true;
+}
+
+size_t DependencyGraph::estimateMemory() const
+{
+    size_t ret = mOverlay.size() * (sizeof(uint32_t) + sizeof(Row));
+    for (const auto &row : mOverlay)
+        ret += (row.second.includes.capacity() + row.second.dependents.capacity()) * sizeof(uint32_t);
+    std::lock_guard<std::mutex> lock(mClosureCache.mutex);
+    for (const auto &closure : mClosureCache.entries)
+        ret += sizeof(FileIdSet) + closure.second->value->estimateMemory();
+    return ret;
+}
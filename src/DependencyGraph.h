@@ -0,0 +1,233 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef DependencyGraph_h
+#define DependencyGraph_h
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "FileIdSet.h"
+#include "rct/EmbeddedLinkedList.h"
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/Serializer.h"
+#include "rct/String.h"
+
+/*
+ * The include graph of a project. The compacted graph is stored as two CSR
+ * (compressed sparse row) tables, includes and dependents, in a file of its
+ * own that is mmapped read-only. Changes made since the last compaction live
+ * in a small overlay of fully materialized rows that shadow the mapped rows
+ * for the same file. The overlay is serialized with the project file (see
+ * operator<<) and folded back into the mapped file by compact().
+ *
+ * compact() writes the new table file next to the current one and the
+ * project file that refers to it by its stamp is written after that.
+ * commitCompaction() moves it into place once the project file is on disk.
+ * load() picks up a pending file whose stamp matches so a crash in between
+ * doesn't throw away the graph.
+ *
+ * Copies share the mapping so copying a graph only copies the overlay.
+ *
+ * Transitive closures are memoized as bitsets, up to MaxClosures of the most
+ * recently used ones. Changing the edges of a file drops the cached closures
+ * that contain it.
+ */
+class DependencyGraph
+{
+public:
+    DependencyGraph();
+    ~DependencyGraph();
+
+    class Edges
+    {
+    public:
+        Edges(const uint32_t *b = 0, const uint32_t *e = 0)
+            : mBegin(b), mEnd(e)
+        {}
+
+        const uint32_t *begin() const { return mBegin; }
+        const uint32_t *end() const { return mEnd; }
+        size_t size() const { return mEnd - mBegin; }
+        bool isEmpty() const { return mBegin == mEnd; }
+        bool contains(uint32_t fileId) const { return std::binary_search(mBegin, mEnd, fileId); }
+    private:
+        const uint32_t *mBegin, *mEnd;
+    };
+
+    bool contains(uint32_t fileId) const;
+    size_t size() const { return mCount; }
+    bool isEmpty() const { return !mCount; }
+    List<uint32_t> fileIds() const;
+
+    // The returned ranges are sorted and stay valid until the graph is modified
+    Edges includes(uint32_t fileId) const;
+    Edges dependents(uint32_t fileId) const;
+
+    // The files reachable from a file by following one or more edges. The
+    // file itself is only part of it if it's on a cycle.
+    enum Direction {
+        Includes,
+        Dependents
+    };
+    std::shared_ptr<const FileIdSet> closure(uint32_t fileId, Direction direction) const;
+
+    void insert(uint32_t fileId);
+    void include(uint32_t includer, uint32_t inclusiary);
+    void clearIncludes(uint32_t fileId);
+    bool remove(uint32_t fileId);
+    void clear();
+
+    bool load(const Path &path, String *error = 0);
+    bool compact(const Path &path, String *error = 0);
+    bool commitCompaction(const Path &path, String *error = 0);
+    bool needsCompaction() const;
+
+    uint64_t stamp() const { return mStamp; }
+    size_t overlaySize() const { return mOverlay.size(); }
+    size_t mappedSize() const { return mSize; }
+    size_t estimateMemory() const;
+
+    enum { Version = 1 };
+private:
+    struct Row {
+        Row()
+            : removed(false)
+        {}
+        List<uint32_t> includes, dependents;
+        bool removed;
+    };
+
+    int mappedIndex(uint32_t fileId) const;
+    Row &materialize(uint32_t fileId);
+    void invalidateClosures(uint32_t a, uint32_t b);
+    void invalidateClosures(uint32_t fileId) { invalidateClosures(fileId, fileId); }
+    const Row *overlayRow(uint32_t fileId) const;
+    void unmap();
+    bool map(const Path &path, String *error);
+
+    // One mmapped table file. Graphs share it, the mapping itself is never
+    // copied.
+    class Mapping
+    {
+    public:
+        Mapping(const char *pointer, size_t size)
+            : mPointer(pointer), mSize(size)
+        {}
+        ~Mapping();
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+
+        const char *data() const { return mPointer; }
+        size_t size() const { return mSize; }
+    private:
+        const char *mPointer;
+        size_t mSize;
+    };
+
+    std::shared_ptr<const Mapping> mMapping;
+    bool mPendingCompaction;
+    size_t mSize;
+    uint32_t mNodeCount;
+    const uint32_t *mNodes, *mIncludeOffsets, *mIncludes, *mDependentOffsets, *mDependents;
+    size_t mCount;
+    uint64_t mStamp;
+    Hash<uint32_t, Row> mOverlay;
+
+    // Published copies of a graph are read by several query threads at once.
+    // Entries are kept in LRU order like in FileMapCache. The members are
+    // only used with mutex held.
+    struct ClosureCache {
+        struct Entry {
+            Entry(uint64_t k, const std::shared_ptr<const FileIdSet> &v)
+                : key(k), value(v)
+            {}
+            const uint64_t key;
+            const std::shared_ptr<const FileIdSet> value;
+
+            std::shared_ptr<Entry> next, prev;
+        };
+
+        ClosureCache() {}
+        ClosureCache(const ClosureCache &other)
+        {
+            std::lock_guard<std::mutex> lock(other.mutex);
+            copy(other);
+        }
+        ClosureCache &operator=(const ClosureCache &other)
+        {
+            if (this != &other) {
+                std::lock(mutex, other.mutex);
+                std::lock_guard<std::mutex> lock(mutex, std::adopt_lock);
+                std::lock_guard<std::mutex> otherLock(other.mutex, std::adopt_lock);
+                clear();
+                copy(other);
+            }
+            return *this;
+        }
+        ~ClosureCache() { clear(); }
+
+        std::shared_ptr<const FileIdSet> find(uint64_t key);
+        void insert(uint64_t key, const std::shared_ptr<const FileIdSet> &value, size_t max);
+        void remove(const std::shared_ptr<Entry> &entry);
+        void copy(const ClosureCache &other);
+        void clear();
+
+        mutable std::mutex mutex;
+        // key'ed on (fileId << 1) | direction
+        Hash<uint64_t, std::shared_ptr<Entry> > entries;
+        EmbeddedLinkedList<std::shared_ptr<Entry> > lru;
+    };
+    enum { MaxClosures = 1024 };
+    mutable ClosureCache mClosureCache;
+
+    friend Serializer &operator<<(Serializer &s, const DependencyGraph &graph);
+    friend Deserializer &operator>>(Deserializer &s, DependencyGraph &graph);
+    friend Serializer &operator<<(Serializer &s, const Row &row);
+    friend Deserializer &operator>>(Deserializer &s, Row &row);
+};
+
+inline Serializer &operator<<(Serializer &s, const DependencyGraph::Row &row)
+{
+    s << row.includes << row.dependents << row.removed;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, DependencyGraph::Row &row)
+{
+    s >> row.includes >> row.dependents >> row.removed;
+    return s;
+}
+
+// Only the stamp of the mapped file and the overlay are serialized. The mapped
+// part is restored with load() and checked against the stamp.
+inline Serializer &operator<<(Serializer &s, const DependencyGraph &graph)
+{
+    s << graph.mStamp << graph.mOverlay;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, DependencyGraph &graph)
+{
+    graph.clear();
+    s >> graph.mStamp >> graph.mOverlay;
+    return s;
+}
+
+#endif
@@ -0,0 +1,251 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "FileIdSet.h"
+
+#include <string.h>
+
+static inline uint32_t popCount(const uint64_t *words, int count)
+{
+    uint32_t ret = 0;
+    for (int i=0; i<count; ++i)
+        ret += __builtin_popcountll(words[i]);
+    return ret;
+}
+
+FileIdSet::FileIdSet(const Set<uint32_t> &fileIds)
+    : mCount(0)
+{
+    for (uint32_t fileId : fileIds)
+        insert(fileId);
+}
+
+size_t FileIdSet::lowerBound(uint32_t index) const
+{
+    size_t lo = 0, hi = mChunks.size();
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (mChunks.at(mid).index < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+const FileIdSet::Chunk *FileIdSet::findChunk(uint32_t fileId) const
+{
+    const uint32_t index = fileId / ChunkSize;
+    const size_t pos = lowerBound(index);
+    if (pos == mChunks.size() || mChunks.at(pos).index != index)
+        return 0;
+    return &mChunks.at(pos);
+}
+
+bool FileIdSet::contains(uint32_t fileId) const
+{
+    const Chunk *chunk = findChunk(fileId);
+    const uint32_t bit = fileId % ChunkSize;
+    return chunk && (chunk->words[bit / 64] & (1ull << (bit % 64)));
+}
+
+bool FileIdSet::insert(uint32_t fileId)
+{
+    const uint32_t index = fileId / ChunkSize;
+    // ids are mostly inserted in increasing order
+    size_t pos;
+    if (mChunks.isEmpty() || mChunks.last().index < index) {
+        pos = mChunks.size();
+    } else if (mChunks.last().index == index) {
+        pos = mChunks.size() - 1;
+    } else {
+        pos = lowerBound(index);
+    }
+    if (pos == mChunks.size() || mChunks.at(pos).index != index) {
+        Chunk chunk;
+        memset(&chunk, 0, sizeof(chunk));
+        chunk.index = index;
+        mChunks.insert(mChunks.begin() + pos, chunk);
+    }
+    Chunk &chunk = mChunks[pos];
+    const uint32_t bit = fileId % ChunkSize;
+    uint64_t &word = chunk.words[bit / 64];
+    const uint64_t mask = 1ull << (bit % 64);
+    if (word & mask)
+        return false;
+    word |= mask;
+    ++chunk.count;
+    ++mCount;
+    return true;
+}
+
+bool FileIdSet::remove(uint32_t fileId)
+{
+    const uint32_t index = fileId / ChunkSize;
+    const size_t pos = lowerBound(index);
+    if (pos == mChunks.size() || mChunks.at(pos).index != index)
+        return false;
+    Chunk &chunk = mChunks[pos];
+    const uint32_t bit = fileId % ChunkSize;
+    uint64_t &word = chunk.words[bit / 64];
+    const uint64_t mask = 1ull << (bit % 64);
+    if (!(word & mask))
+        return false;
+    word &= ~mask;
+    --mCount;
+    if (!--chunk.count)
+        mChunks.erase(mChunks.begin() + pos);
+    return true;
+}
+
+FileIdSet &FileIdSet::unite(const FileIdSet &other)
+{
+    if (other.isEmpty() || &other == this)
+        return *this;
+    if (isEmpty()) {
+        *this = other;
+        return *this;
+    }
+    List<Chunk> chunks;
+    chunks.reserve(mChunks.size() + other.mChunks.size());
+    size_t i = 0, j = 0;
+    mCount = 0;
+    while (i < mChunks.size() || j < other.mChunks.size()) {
+        if (j == other.mChunks.size() || (i < mChunks.size() && mChunks.at(i).index < other.mChunks.at(j).index)) {
+            chunks.append(mChunks.at(i++));
+        } else if (i == mChunks.size() || other.mChunks.at(j).index < mChunks.at(i).index) {
+            chunks.append(other.mChunks.at(j++));
+        } else {
+            Chunk chunk = mChunks.at(i++);
+            const Chunk &o = other.mChunks.at(j++);
+            for (int w=0; w<WordsPerChunk; ++w)
+                chunk.words[w] |= o.words[w];
+            chunk.count = popCount(chunk.words, WordsPerChunk);
+            chunks.append(chunk);
+        }
+        mCount += chunks.last().count;
+    }
+    mChunks = std::move(chunks);
+    return *this;
+}
+
+FileIdSet &FileIdSet::subtract(const FileIdSet &other)
+{
+    if (&other == this) {
+        clear();
+        return *this;
+    }
+    size_t i = 0, j = 0, out = 0;
+    mCount = 0;
+    while (i < mChunks.size()) {
+        while (j < other.mChunks.size() && other.mChunks.at(j).index < mChunks.at(i).index)
+            ++j;
+        Chunk &chunk = mChunks[i++];
+        if (j < other.mChunks.size() && other.mChunks.at(j).index == chunk.index) {
+            const Chunk &o = other.mChunks.at(j++);
+            for (int w=0; w<WordsPerChunk; ++w)
+                chunk.words[w] &= ~o.words[w];
+            chunk.count = popCount(chunk.words, WordsPerChunk);
+            if (!chunk.count)
+                continue;
+        }
+        mCount += chunk.count;
+        if (out != i - 1)
+            mChunks[out] = chunk;
+        ++out;
+    }
+    mChunks.resize(out);
+    return *this;
+}
+
+FileIdSet &FileIdSet::intersect(const FileIdSet &other)
+{
+    if (&other == this)
+        return *this;
+    size_t i = 0, j = 0, out = 0;
+    mCount = 0;
+    while (i < mChunks.size() && j < other.mChunks.size()) {
+        if (mChunks.at(i).index < other.mChunks.at(j).index) {
+            ++i;
+        } else if (other.mChunks.at(j).index < mChunks.at(i).index) {
+            ++j;
+        } else {
+            Chunk &chunk = mChunks[i++];
+            const Chunk &o = other.mChunks.at(j++);
+            for (int w=0; w<WordsPerChunk; ++w)
+                chunk.words[w] &= o.words[w];
+            chunk.count = popCount(chunk.words, WordsPerChunk);
+            if (chunk.count) {
+                mCount += chunk.count;
+                if (out != i - 1)
+                    mChunks[out] = chunk;
+                ++out;
+            }
+        }
+    }
+    mChunks.resize(out);
+    return *this;
+}
+
+bool FileIdSet::intersects(const FileIdSet &other) const
+{
+    size_t i = 0, j = 0;
+    while (i < mChunks.size() && j < other.mChunks.size()) {
+        if (mChunks.at(i).index < other.mChunks.at(j).index) {
+            ++i;
+        } else if (other.mChunks.at(j).index < mChunks.at(i).index) {
+            ++j;
+        } else {
+            const Chunk &a = mChunks.at(i++);
+            const Chunk &b = other.mChunks.at(j++);
+            for (int w=0; w<WordsPerChunk; ++w) {
+                if (a.words[w] & b.words[w])
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool FileIdSet::operator==(const FileIdSet &other) const
+{
+    if (mCount != other.mCount || mChunks.size() != other.mChunks.size())
+        return false;
+    for (size_t i=0; i<mChunks.size(); ++i) {
+        if (mChunks.at(i).index != other.mChunks.at(i).index
+            || memcmp(mChunks.at(i).words, other.mChunks.at(i).words, sizeof(Chunk::words))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+List<uint32_t> FileIdSet::toList() const
+{
+    List<uint32_t> ret;
+    ret.reserve(mCount);
+    for (uint32_t fileId : *this)
+        ret.append(fileId);
+    return ret;
+}
+
+Set<uint32_t> FileIdSet::toSet() const
+{
+    Set<uint32_t> ret;
+    for (uint32_t fileId : *this)
+        ret.insert(fileId);
+    return ret;
+}
@@ -0,0 +1,207 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FileIdSet_h
+#define FileIdSet_h
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+#include "rct/List.h"
+#include "rct/Log.h"
+#include "rct/Serializer.h"
+#include "rct/Set.h"
+
+/*
+ * A set of file ids stored as a bitmap. File ids are small and handed out
+ * densely so the id space is split into chunks of ChunkSize ids and only
+ * chunks that have ids in them are allocated, each as a fixed size bitmap.
+ * Chunks are kept sorted on their index so iteration is ordered like a
+ * Set<uint32_t> and unions, intersections and differences work a word at a
+ * time.
+ */
+class FileIdSet
+{
+public:
+    FileIdSet()
+        : mCount(0)
+    {}
+    FileIdSet(const Set<uint32_t> &fileIds);
+    FileIdSet(const FileIdSet &other) = default;
+    FileIdSet(FileIdSet &&other)
+        : mChunks(std::move(other.mChunks)), mCount(other.mCount)
+    {
+        other.clear();
+    }
+    FileIdSet &operator=(const FileIdSet &other) = default;
+    FileIdSet &operator=(FileIdSet &&other)
+    {
+        if (this != &other) {
+            mChunks = std::move(other.mChunks);
+            mCount = other.mCount;
+            other.clear();
+        }
+        return *this;
+    }
+
+    bool insert(uint32_t fileId);
+    bool remove(uint32_t fileId);
+    bool contains(uint32_t fileId) const;
+    size_t size() const { return mCount; }
+    bool isEmpty() const { return !mCount; }
+    void clear()
+    {
+        mChunks.clear();
+        mCount = 0;
+    }
+
+    FileIdSet &unite(const FileIdSet &other);
+    FileIdSet &subtract(const FileIdSet &other);
+    FileIdSet &intersect(const FileIdSet &other);
+    bool intersects(const FileIdSet &other) const;
+
+    FileIdSet &operator+=(const FileIdSet &other) { return unite(other); }
+    FileIdSet &operator+=(uint32_t fileId)
+    {
+        insert(fileId);
+        return *this;
+    }
+    FileIdSet &operator-=(const FileIdSet &other) { return subtract(other); }
+    FileIdSet &operator&=(const FileIdSet &other) { return intersect(other); }
+    FileIdSet operator&(const FileIdSet &other) const
+    {
+        FileIdSet ret = *this;
+        ret.intersect(other);
+        return ret;
+    }
+    bool operator==(const FileIdSet &other) const;
+    bool operator!=(const FileIdSet &other) const { return !operator==(other); }
+
+    List<uint32_t> toList() const;
+    Set<uint32_t> toSet() const;
+    size_t estimateMemory() const { return mChunks.capacity() * sizeof(Chunk); }
+
+    enum { ChunkSize = 1024 };
+private:
+    enum { WordsPerChunk = ChunkSize / 64 };
+    struct Chunk {
+        uint32_t index, count;
+        uint64_t words[WordsPerChunk];
+    };
+    // Returns the position of the chunk for index or where it would go
+    size_t lowerBound(uint32_t index) const;
+    const Chunk *findChunk(uint32_t fileId) const;
+
+    List<Chunk> mChunks;
+    size_t mCount;
+public:
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef uint32_t value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const uint32_t *pointer;
+        typedef uint32_t reference;
+
+        const_iterator()
+            : mChunks(0), mChunk(0), mWord(0), mBits(0), mValue(0)
+        {}
+
+        uint32_t operator*() const { return mValue; }
+        const_iterator &operator++()
+        {
+            mBits &= mBits - 1;
+            settle();
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            const_iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const const_iterator &other) const
+        {
+            return mChunk == other.mChunk && mWord == other.mWord && mBits == other.mBits;
+        }
+        bool operator!=(const const_iterator &other) const { return !operator==(other); }
+    private:
+        const_iterator(const List<Chunk> *chunks, size_t chunk)
+            : mChunks(chunks), mChunk(chunk), mWord(0), mBits(chunk < chunks->size() ? chunks->at(chunk).words[0] : 0), mValue(0)
+        {
+            settle();
+        }
+
+        // moves to the next set bit, or to end()
+        void settle()
+        {
+            while (!mBits) {
+                if (mChunk >= mChunks->size())
+                    return;
+                if (++mWord == WordsPerChunk) {
+                    mWord = 0;
+                    if (++mChunk == mChunks->size())
+                        return;
+                }
+                mBits = mChunks->at(mChunk).words[mWord];
+            }
+            mValue = (mChunks->at(mChunk).index * ChunkSize) + (mWord * 64) + __builtin_ctzll(mBits);
+        }
+
+        const List<Chunk> *mChunks;
+        size_t mChunk;
+        int mWord;
+        uint64_t mBits;
+        uint32_t mValue;
+
+        friend class FileIdSet;
+    };
+    typedef const_iterator iterator;
+
+    const_iterator begin() const { return const_iterator(&mChunks, 0); }
+    const_iterator end() const { return const_iterator(&mChunks, mChunks.size()); }
+};
+
+inline Serializer &operator<<(Serializer &s, const FileIdSet &set)
+{
+    s << static_cast<uint32_t>(set.size());
+    for (uint32_t fileId : set)
+        s << fileId;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, FileIdSet &set)
+{
+    set.clear();
+    uint32_t size;
+    s >> size;
+    for (uint32_t i=0; i<size; ++i) {
+        uint32_t fileId;
+        s >> fileId;
+        set.insert(fileId);
+    }
+    return s;
+}
+
+inline Log operator<<(Log log, const FileIdSet &set)
+{
+    log << set.toList();
+    return log;
+}
+
+#endif
@@ -21,11 +21,14 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <functional>
 #include <limits>
 
 #include "Location.h"
+#include "rct/List.h"
 #include "rct/Serializer.h"
+#include "rct/SHA256.h"
 
 template <typename T> inline static int compare(const T &l, const T &r)
 {
@@ -46,6 +49,8 @@ template <> inline int compare(const Location &l, const Location &r)
     return l.compare(r);
 }
 
+template <typename Key, typename Value> class FileMapWriter;
+
 template <typename Key, typename Value>
 class FileMap
 {
@@ -76,7 +81,9 @@ public:
 
     enum Options {
         None = 0x0,
-        NoLock = 0x1
+        NoLock = 0x1,
+        Sync = 0x2,
+        Staged = 0x4 // FileMapWriter, see commit()
     };
     bool load(const Path &path, uint32_t options, String *error = 0)
     {
@@ -144,6 +151,7 @@ public:
     }
 
     uint32_t count() const { return mCount; }
+    size_t mappedSize() const { return mSize; }
 
     Key keyAt(uint32_t index) const
     {
@@ -189,83 +197,20 @@ public:
         return lower;
     }
 
-    static String encode(const Map<Key, Value> &map)
-    {
-        String out;
-        Serializer serializer(out);
-        serializer << static_cast<uint32_t>(map.size());
-        uint32_t valuesOffset;
-        if (uint32_t size = FixedSize<Key>::value) {
-            valuesOffset = ((static_cast<uint32_t>(map.size()) * size) + (sizeof(uint32_t) * 2));
-            serializer << valuesOffset;
-            for (const std::pair<Key, Value> &pair : map) {
-                out.append(reinterpret_cast<const char*>(&pair.first), size);
-            }
-        } else {
-            serializer << static_cast<uint32_t>(0); // values offset
-            uint32_t offset = sizeof(uint32_t) * 2 + (map.size() * sizeof(uint32_t));
-            String keyData;
-            Serializer keySerializer(keyData);
-            for (const std::pair<Key, Value> &pair : map) {
-                const uint32_t pos = offset + keyData.size();
-                out.append(reinterpret_cast<const char*>(&pos), sizeof(pos));
-                keySerializer << pair.first;
-            }
-            out.append(keyData);
-            valuesOffset = out.size();
-            memcpy(out.data() + sizeof(uint32_t), &valuesOffset, sizeof(valuesOffset));
-        }
-        assert(valuesOffset == static_cast<uint32_t>(out.size()));
-
-        if (uint32_t size = FixedSize<Value>::value) {
-            for (const std::pair<Key, Value> &pair : map) {
-                out.append(reinterpret_cast<const char*>(&pair.second), size);
-            }
-        } else {
-            const uint32_t encodedValuesOffset = valuesOffset + (sizeof(uint32_t) * map.size());
-            String valueData;
-            Serializer valueSerializer(valueData);
-            for (const std::pair<Key, Value> &pair : map) {
-                const uint32_t pos = encodedValuesOffset + valueData.size();
-                out.append(reinterpret_cast<const char*>(&pos), sizeof(pos));
-                valueSerializer << pair.second;
-            }
-            out.append(valueData);
-
-        }
-        return out;
-    }
-    static bool write(const Path &path, const Map<Key, Value> &map, uint32_t options)
+    // The map is written to a temporary file that is renamed into place.
+    // Readers that have the old file mapped keep seeing a complete map and a
+    // crash can't leave a truncated file behind. With Sync the data is
+    // fsync'ed before the rename. See FileMapWriter for digest.
+    static bool write(const Path &path, const Map<Key, Value> &map, uint32_t options, SHA256 *digest = 0)
     {
-        int fd = open(path.constData(), O_RDWR|O_CREAT, 0644);
-        if (fd == -1) {
-            if (!Path::mkdir(path.parentDir(), Path::Recursive))
-                return false;
-            fd = open(path.constData(), O_RDWR|O_CREAT, 0644);
-            if (fd == -1)
-                return false;
-        }
-        if (!(options & NoLock) && !lock(fd, Write)) {
-            ::close(fd);
+        FileMapWriter<Key, Value> writer(path, map.size(), options, digest);
+        if (!writer.open())
             return false;
-        }
-        const String data = encode(map);
-        bool ret = ::ftruncate(fd, data.size()) != -1;
-        if (!ret) {
-            if (!(options & NoLock))
-                lock(fd, Unlock);
-            ::close(fd);
-            return false;
-        }
-
-        ret = ::write(fd, data.constData(), data.size()) == static_cast<ssize_t>(data.size());
-        if (!(options & NoLock))
-            ret = lock(fd, Unlock) && ret;
-
-        ::close(fd);
-        if (!ret)
-            unlink(path.constData());
-        return ret;
+        for (const std::pair<Key, Value> &pair : map)
+            writer.addKey(pair.first);
+        for (const std::pair<Key, Value> &pair : map)
+            writer.addValue(pair.second);
+        return writer.finish();
     }
 private:
     enum Mode {
@@ -311,4 +256,222 @@ private:
     uint32_t mOptions;
 };
 
+/*
+ * Streams a map in the format FileMap reads to disk. Call addKey() for
+ * every key in sorted order and then addValue() for every value in the
+ * same order. Variable sized keys and values are preceded by a table of
+ * their offsets, those tables are skipped while streaming and filled in
+ * by finish() so only a small buffer and the offsets are kept in memory.
+ *
+ * If digest is set everything that is written is added to it as well.
+ * With an empty path nothing is written at all, the map is only encoded
+ * into the digest.
+ *
+ * With the Staged option finish() leaves the map in the temporary file.
+ * commit() renames it into place and discard() removes it, e.g. once the
+ * digest shows the map is the same as the one on disk.
+ */
+template <typename Key, typename Value>
+class FileMapWriter
+{
+public:
+    FileMapWriter(const Path &path, uint32_t count, uint32_t options, SHA256 *digest = 0)
+        : mPath(path), mFD(-1), mCount(count), mOptions(options), mPos(0),
+          mKeys(0), mValues(0), mValuesOffset(0), mDigest(digest), mOk(true)
+    {}
+
+    ~FileMapWriter()
+    {
+        if (mFD != -1) { // finish() wasn't called or failed
+            int ret;
+            eintrwrap(ret, close(mFD));
+            unlink(mTmp.constData());
+        }
+    }
+
+    bool open()
+    {
+        assert(mFD == -1);
+        if (mPath.isEmpty()) {
+            assert(mDigest);
+            return start();
+        }
+        mTmp = tmpPath(mPath);
+        eintrwrap(mFD, ::open(mTmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644));
+        if (mFD == -1) {
+            if (!Path::mkdir(mPath.parentDir(), Path::Recursive))
+                return false;
+            eintrwrap(mFD, ::open(mTmp.constData(), O_WRONLY|O_CREAT|O_TRUNC, 0644));
+            if (mFD == -1)
+                return false;
+        }
+        return start();
+    }
+
+    void addKey(const Key &key)
+    {
+        assert(mKeys < mCount);
+        ++mKeys;
+        add(key);
+    }
+
+    void addValue(const Value &value)
+    {
+        assert(mKeys == mCount);
+        assert(mValues < mCount);
+        if (!mValues++)
+            startValues();
+        add(value);
+    }
+
+    bool finish()
+    {
+        assert(mKeys == mCount);
+        if (!mCount)
+            startValues();
+        assert(mValues == mCount);
+        if (mPath.isEmpty())
+            return mOk;
+        assert(mFD != -1);
+        if (!FixedSize<Value>::value)
+            writeOffsets(mValuesOffset);
+        flush();
+        writeAt(sizeof(uint32_t), &mValuesOffset, sizeof(mValuesOffset));
+        if (mOk && mOptions & FileMap<Key, Value>::Sync)
+            mOk = !::fsync(mFD);
+
+        int ret;
+        eintrwrap(ret, close(mFD));
+        mFD = -1;
+        if (!mOk) {
+            unlink(mTmp.constData());
+            return false;
+        }
+        return mOptions & FileMap<Key, Value>::Staged || commit(mPath);
+    }
+
+    static Path tmpPath(const Path &path)
+    {
+        return String::format<1024>("%s.%d.tmp", path.constData(), getpid());
+    }
+
+    static bool commit(const Path &path)
+    {
+        const Path tmp = tmpPath(path);
+        if (::rename(tmp.constData(), path.constData())) {
+            unlink(tmp.constData());
+            return false;
+        }
+        return true;
+    }
+
+    static void discard(const Path &path)
+    {
+        unlink(tmpPath(path).constData());
+    }
+private:
+    bool start()
+    {
+        append(reinterpret_cast<const char*>(&mCount), sizeof(mCount));
+        append(reinterpret_cast<const char*>(&mValuesOffset), sizeof(mValuesOffset)); // patched in finish()
+        if (!FixedSize<Key>::value)
+            skipOffsets();
+        return mOk;
+    }
+
+    template <typename T>
+    void add(const T &t)
+    {
+        if (const uint32_t size = FixedSize<T>::value) {
+            append(reinterpret_cast<const char*>(&t), size);
+        } else {
+            if (mDigest)
+                mDigest->update(reinterpret_cast<const char*>(&mPos), sizeof(mPos));
+            mOffsets.append(mPos);
+            mScratch.clear();
+            Serializer serializer(mScratch);
+            serializer << t;
+            append(mScratch.constData(), mScratch.size());
+        }
+    }
+
+    void startValues()
+    {
+        if (!FixedSize<Key>::value)
+            writeOffsets(sizeof(uint32_t) * 2);
+        mValuesOffset = mPos;
+        if (!FixedSize<Value>::value)
+            skipOffsets();
+    }
+
+    // leaves room for the offsets of the coming keys or values
+    void skipOffsets()
+    {
+        flush();
+        mOffsets.clear();
+        mOffsets.reserve(mCount);
+        mPos += sizeof(uint32_t) * mCount;
+        if (mOk && mFD != -1 && lseek(mFD, mPos, SEEK_SET) == -1)
+            mOk = false;
+    }
+
+    void writeOffsets(uint32_t offset)
+    {
+        assert(mOffsets.size() == mCount);
+        flush();
+        if (mCount && mFD != -1)
+            writeAt(offset, mOffsets.data(), sizeof(uint32_t) * mCount);
+    }
+
+    void append(const char *data, size_t size)
+    {
+        if (mDigest)
+            mDigest->update(data, size);
+        mPos += size;
+        if (!mPath.isEmpty()) {
+            mBuffer.append(data, size);
+            if (mBuffer.size() >= BufferSize)
+                flush();
+        }
+    }
+
+    void flush()
+    {
+        const char *data = mBuffer.constData();
+        size_t left = mBuffer.size();
+        while (mOk && left) {
+            ssize_t written;
+            eintrwrap(written, ::write(mFD, data, left));
+            if (written <= 0) {
+                mOk = false;
+            } else {
+                data += written;
+                left -= written;
+            }
+        }
+        mBuffer.clear();
+    }
+
+    void writeAt(uint32_t offset, const void *data, size_t size)
+    {
+        ssize_t written;
+        if (mOk) {
+            eintrwrap(written, ::pwrite(mFD, data, size, offset));
+            mOk = written == static_cast<ssize_t>(size);
+        }
+    }
+
+    enum { BufferSize = 64 * 1024 };
+
+    const Path mPath;
+    Path mTmp;
+    int mFD;
+    const uint32_t mCount, mOptions;
+    uint32_t mPos, mKeys, mValues, mValuesOffset;
+    SHA256 *mDigest;
+    List<uint32_t> mOffsets;
+    String mBuffer, mScratch;
+    bool mOk;
+};
+
 #endif
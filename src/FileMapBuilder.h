@@ -0,0 +1,102 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FileMapBuilder_h
+#define FileMapBuilder_h
+
+#include <algorithm>
+#include <utility>
+
+#include "FileMap.h"
+#include "rct/List.h"
+
+/*
+ * Collects the entries of a FileMap in a flat list instead of a
+ * Map<Key, Value>. Entries can be appended in any order, sort() orders them
+ * by key once and write() streams them to disk with FileMapWriter. If a key
+ * is appended more than once the last value wins, like assigning to a Map.
+ */
+template <typename Key, typename Value>
+class FileMapBuilder
+{
+public:
+    typedef std::pair<Key, Value> Entry;
+
+    FileMapBuilder()
+        : mSorted(true)
+    {}
+
+    void reserve(size_t size) { mEntries.reserve(size); }
+    size_t size() const { return mEntries.size(); }
+    bool isEmpty() const { return mEntries.isEmpty(); }
+
+    void append(const Key &key, const Value &value)
+    {
+        checkOrder(key);
+        mEntries.push_back(Entry(key, value));
+    }
+
+    void append(Key &&key, Value &&value)
+    {
+        checkOrder(key);
+        mEntries.push_back(Entry(std::move(key), std::move(value)));
+    }
+
+    void sort()
+    {
+        if (mSorted)
+            return;
+        mSorted = true;
+        // stable so the last of several values for a key can be found
+        std::stable_sort(mEntries.begin(), mEntries.end(), [](const Entry &l, const Entry &r) { return l.first < r.first; });
+
+        // keep the last entry of each run of equal keys
+        const size_t count = mEntries.size();
+        size_t out = 0;
+        for (size_t i=0; i<count; ++i) {
+            if (i + 1 < count && !(mEntries.at(i).first < mEntries.at(i + 1).first))
+                continue;
+            if (out != i)
+                mEntries[out] = std::move(mEntries[i]);
+            ++out;
+        }
+        mEntries.resize(out);
+    }
+
+    // See FileMapWriter for digest
+    bool write(const Path &path, uint32_t options, SHA256 *digest = 0)
+    {
+        sort();
+        FileMapWriter<Key, Value> writer(path, mEntries.size(), options, digest);
+        if (!writer.open())
+            return false;
+        for (const Entry &entry : mEntries)
+            writer.addKey(entry.first);
+        for (const Entry &entry : mEntries)
+            writer.addValue(entry.second);
+        return writer.finish();
+    }
+private:
+    void checkOrder(const Key &key)
+    {
+        if (mSorted && !mEntries.isEmpty() && !(mEntries.back().first < key))
+            mSorted = false;
+    }
+
+    List<Entry> mEntries;
+    bool mSorted;
+};
+
+#endif
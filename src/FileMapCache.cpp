@@ -0,0 +1,138 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "FileMapCache.h"
+
+#include <algorithm>
+
+std::atomic<size_t> FileMapCache::sOpenFiles(0);
+std::atomic<size_t> FileMapCache::sMaxOpenFiles(1024);
+std::atomic<size_t> FileMapCache::sCaches(0);
+
+FileMapCache::FileMapCache(size_t maxFiles, size_t maxBytes)
+    : mMaxFiles(std::max<size_t>(1, maxFiles / ShardCount)), mMaxBytes(maxBytes / ShardCount)
+{
+    ++sCaches;
+}
+
+FileMapCache::~FileMapCache()
+{
+    clear();
+    --sCaches;
+}
+
+size_t FileMapCache::maxFiles() const
+{
+    const size_t share = sMaxOpenFiles / (std::max<size_t>(1, sCaches) * ShardCount);
+    return std::max<size_t>(1, std::min(mMaxFiles, share));
+}
+
+std::shared_ptr<void> FileMapCache::findEntry(int type, uint32_t fileId, uint64_t *generation)
+{
+    Shard &s = shard(fileId);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    const std::shared_ptr<Entry> entry = s.entries.value(key(type, fileId));
+    if (!entry) {
+        ++s.misses;
+        if (generation)
+            *generation = s.generation;
+        return std::shared_ptr<void>();
+    }
+    ++s.hits;
+    s.lru.remove(entry);
+    s.lru.append(entry);
+    return entry->value;
+}
+
+std::shared_ptr<void> FileMapCache::insertEntry(int type, uint32_t fileId, uint64_t generation,
+                                                const std::shared_ptr<void> &value, size_t size)
+{
+    // declared before the lock so the maps are unmapped after it's released
+    List<std::shared_ptr<Entry> > evicted;
+    Shard &s = shard(fileId);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (generation != s.generation)
+        return value;
+
+    std::shared_ptr<Entry> &entry = s.entries[key(type, fileId)];
+    if (entry) {
+        s.lru.remove(entry);
+        s.lru.append(entry);
+        return entry->value;
+    }
+    entry.reset(new Entry(key(type, fileId), value, size));
+    s.lru.append(entry);
+    s.bytes += size;
+    ++sOpenFiles;
+
+    const size_t max = maxFiles();
+    while (!s.lru.isEmpty()
+           && ((s.entries.size() > 1 && (s.entries.size() > max || s.bytes > mMaxBytes))
+               || sOpenFiles > sMaxOpenFiles)) {
+        const std::shared_ptr<Entry> e = s.lru.takeFirst();
+        assert(e);
+        s.entries.remove(e->key);
+        s.bytes -= e->size;
+        --sOpenFiles;
+        ++s.evictions;
+        evicted.append(e);
+    }
+    return value;
+}
+
+void FileMapCache::invalidate(uint32_t fileId)
+{
+    List<std::shared_ptr<Entry> > removed;
+    Shard &s = shard(fileId);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    ++s.generation;
+    for (int type=0; type<MaxTypes; ++type) {
+        const std::shared_ptr<Entry> e = s.entries.take(key(type, fileId));
+        if (e) {
+            s.lru.remove(e);
+            s.bytes -= e->size;
+            --sOpenFiles;
+            removed.append(e);
+        }
+    }
+}
+
+void FileMapCache::clear()
+{
+    for (Shard &s : mShards) {
+        List<std::shared_ptr<Entry> > removed;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        ++s.generation;
+        while (!s.lru.isEmpty())
+            removed.append(s.lru.takeFirst());
+        sOpenFiles -= s.entries.size();
+        s.entries.clear();
+        s.bytes = 0;
+    }
+}
+
+FileMapCache::Stats FileMapCache::stats() const
+{
+    Stats ret;
+    for (const Shard &s : mShards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        ret.files += s.entries.size();
+        ret.bytes += s.bytes;
+        ret.hits += s.hits;
+        ret.misses += s.misses;
+        ret.evictions += s.evictions;
+    }
+    return ret;
+}
@@ -0,0 +1,127 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FileMapCache_h
+#define FileMapCache_h
+
+#include <assert.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/EmbeddedLinkedList.h"
+#include "rct/Hash.h"
+#include "rct/List.h"
+
+/*
+ * Cache of the file maps a project has opened, shared by all threads running
+ * queries for the project. Entries are keyed on file id and map type and split
+ * over a number of shards with their own lock and LRU list. A shard evicts
+ * its least recently used maps when it holds more than its share of the
+ * maximum number of files (each map keeps its file descriptor open) or mapped
+ * bytes. Evicted maps stay valid for as long as someone holds a reference.
+ *
+ * All caches together keep at most setMaxOpenFiles() maps open. Each cache
+ * gets an even share of that when it's less than its own file limit. A
+ * shard that still finds the total over the limit evicts its own maps, down
+ * to not caching the one it was asked to insert.
+ *
+ * A lookup that misses returns the generation of the shard. Maps loaded
+ * after that are only inserted if the file id wasn't invalidated in the
+ * meantime so a map read just before the file was rewritten can't end up in
+ * the cache.
+ */
+class FileMapCache
+{
+public:
+    FileMapCache(size_t maxFiles, size_t maxBytes);
+    ~FileMapCache();
+
+    enum { MaxTypes = 8 };
+
+    template <typename T>
+    std::shared_ptr<T> find(int type, uint32_t fileId, uint64_t *generation = 0)
+    {
+        return std::static_pointer_cast<T>(findEntry(type, fileId, generation));
+    }
+
+    // Returns the cached value if another thread inserted one first
+    template <typename T>
+    std::shared_ptr<T> insert(int type, uint32_t fileId, uint64_t generation, const std::shared_ptr<T> &value, size_t size)
+    {
+        return std::static_pointer_cast<T>(insertEntry(type, fileId, generation, value, size));
+    }
+
+    void invalidate(uint32_t fileId);
+    void clear();
+
+    // The most maps all caches together keep open
+    static void setMaxOpenFiles(size_t maxOpenFiles) { sMaxOpenFiles = maxOpenFiles; }
+    static size_t openFiles() { return sOpenFiles; }
+
+    struct Stats {
+        Stats()
+            : files(0), bytes(0), hits(0), misses(0), evictions(0)
+        {}
+        size_t files, bytes, hits, misses, evictions;
+    };
+    Stats stats() const;
+private:
+    static uint64_t key(int type, uint32_t fileId)
+    {
+        assert(type >= 0 && type < MaxTypes);
+        return (static_cast<uint64_t>(fileId) << 8) | type;
+    }
+    std::shared_ptr<void> findEntry(int type, uint32_t fileId, uint64_t *generation);
+    std::shared_ptr<void> insertEntry(int type, uint32_t fileId, uint64_t generation,
+                                      const std::shared_ptr<void> &value, size_t size);
+
+    struct Entry {
+        Entry(uint64_t k, const std::shared_ptr<void> &v, size_t s)
+            : key(k), value(v), size(s)
+        {}
+        const uint64_t key;
+        const std::shared_ptr<void> value;
+        const size_t size;
+
+        std::shared_ptr<Entry> next, prev;
+    };
+
+    struct Shard {
+        Shard()
+            : generation(0), bytes(0), hits(0), misses(0), evictions(0)
+        {}
+        mutable std::mutex mutex;
+        Hash<uint64_t, std::shared_ptr<Entry> > entries;
+        EmbeddedLinkedList<std::shared_ptr<Entry> > lru;
+        uint64_t generation;
+        size_t bytes, hits, misses, evictions;
+    };
+
+    enum { ShardCount = 16 };
+    Shard &shard(uint32_t fileId) { return mShards[fileId % ShardCount]; }
+
+    Shard mShards[ShardCount];
+    const size_t mMaxFiles, mMaxBytes;
+
+    size_t maxFiles() const;
+
+    static std::atomic<size_t> sOpenFiles;
+    static std::atomic<size_t> sMaxOpenFiles;
+    static std::atomic<size_t> sCaches;
+};
+
+#endif
@@ -52,7 +52,10 @@ int FindSymbolsJob::execute()
                     symbols.insert(sym);
             }
         };
-        proj->findSymbols(string, inserter, queryFlags(), fileFilter());
+        std::function<bool(uint32_t)> acceptFile;
+        if (hasFilter())
+            acceptFile = [this](uint32_t fileId) { return filterFile(fileId); };
+        proj->findSymbols(string, inserter, queryFlags(), fileFilter(), cancellation(), acceptFile);
         if (!symbols.isEmpty()) {
             const List<RTags::SortedSymbol> sorted = proj->sort(symbols, queryFlags());
             const Flags<WriteFlag> writeFlags = fileFilter() ? Unfiltered : NoWriteFlags;
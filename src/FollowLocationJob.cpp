@@ -53,13 +53,13 @@ int FollowLocationJob::execute()
     if (queryFlags() & QueryMessage::AllTargets) {
         const Set<String> usrs = project()->findTargetUsrs(location);
         for (const String &usr : usrs) {
-            for (const Symbol &s : project()->findByUsr(usr, location.fileId(), Project::ArgDependsOn, location)) {
+            for (const Symbol &s : project()->findByUsr(usr, location.fileId(), Project::ArgDependsOn, location, cancellation())) {
                 write(s.toString());
             }
         }
     }
 
-    const auto target = project()->findTarget(symbol);
+    const auto target = project()->findTarget(symbol, cancellation());
     if (target.location.isNull())
         return 1;
 
@@ -69,7 +69,7 @@ int FollowLocationJob::execute()
     }
 
     if (queryFlags() & QueryMessage::DeclarationOnly ? target.isDefinition() : !target.isDefinition()) {
-        const auto other = project()->findTarget(target);
+        const auto other = project()->findTarget(target, cancellation());
         if (!other.isNull() && other.usr == target.usr) {
             write(other.location);
             return 0;
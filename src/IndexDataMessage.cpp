@@ -0,0 +1,188 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "IndexDataMessage.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rct/Log.h"
+#include "rct/Path.h"
+#include "rct/Rct.h"
+
+// Segments are named SHARED_PAYLOAD_PREFIX<pid of rp>-<job id>
+#define SHARED_PAYLOAD_PREFIX "rtags-indexdata-"
+
+IndexDataMessage::~IndexDataMessage()
+{
+    unmapSharedPayload();
+}
+
+void IndexDataMessage::encode(Serializer &serializer) const
+{
+    serializer << mProject << mParseTime << mKey << mId << mIndexerJobFlags << mMessage
+               << mFlags << mSharedPayload;
+    if (!mSharedPayload.isEmpty())
+        return;
+    if (!mEncodedPayload.isEmpty()) {
+        serializer.write(mEncodedPayload.constData(), mEncodedPayload.size());
+    } else {
+        encodePayload(serializer);
+    }
+}
+
+void IndexDataMessage::decode(Deserializer &deserializer)
+{
+    deserializer >> mProject >> mParseTime >> mKey >> mId >> mIndexerJobFlags >> mMessage
+                 >> mFlags >> mSharedPayload;
+    if (mSharedPayload.isEmpty())
+        decodePayload(deserializer);
+}
+
+void IndexDataMessage::encodePayload(Serializer &serializer) const
+{
+    serializer << mFixIts << mIncludes << mDiagnostics << mFiles;
+}
+
+void IndexDataMessage::decodePayload(Deserializer &deserializer)
+{
+    deserializer >> mFixIts >> mIncludes >> mDiagnostics >> mFiles;
+}
+
+bool IndexDataMessage::sharePayload()
+{
+    assert(mSharedPayload.isEmpty());
+    String payload;
+    {
+        Serializer serializer(payload);
+        encodePayload(serializer);
+    }
+    if (payload.size() < SharedPayloadThreshold) {
+        mEncodedPayload = std::move(payload);
+        return false;
+    }
+
+    // rct's Connection can't pass file descriptors so the segment is
+    // opened by name. The job id keeps the names of a session apart.
+    const String name = String::format<64>("/" SHARED_PAYLOAD_PREFIX "%d-%llu", getpid(),
+                                           static_cast<unsigned long long>(mId));
+    int fd;
+    eintrwrap(fd, shm_open(name.constData(), O_RDWR|O_CREAT|O_EXCL, 0600));
+    if (fd == -1 && errno == EEXIST) { // left behind by an rp that had the same pid
+        shm_unlink(name.constData());
+        eintrwrap(fd, shm_open(name.constData(), O_RDWR|O_CREAT|O_EXCL, 0600));
+    }
+    if (fd == -1) {
+        error() << "Failed to create shared memory" << name << Rct::strerror();
+        return false;
+    }
+    void *data = MAP_FAILED;
+    if (!ftruncate(fd, payload.size()))
+        data = mmap(0, payload.size(), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    int ret;
+    eintrwrap(ret, close(fd));
+    if (data == MAP_FAILED) {
+        error() << "Failed to map shared memory" << name << Rct::strerror();
+        shm_unlink(name.constData());
+        return false;
+    }
+    memcpy(data, payload.constData(), payload.size());
+    munmap(data, payload.size());
+    mSharedPayload = name;
+    return true;
+}
+
+void IndexDataMessage::unlinkSharedPayload()
+{
+    if (!mSharedPayload.isEmpty())
+        shm_unlink(mSharedPayload.constData());
+}
+
+void IndexDataMessage::removeStaleSharedPayloads()
+{
+#ifdef OS_Linux
+    // rdm unlinks a segment as soon as it maps it and rp waits for that, so
+    // a segment whose rp has exited was left behind, e.g. because rdm
+    // crashed before handling it. Other systems can't list them.
+    const size_t prefixLength = strlen(SHARED_PAYLOAD_PREFIX);
+    Path("/dev/shm/").visit([prefixLength](const Path &path) {
+            const char *fileName = path.fileName();
+            if (!strncmp(fileName, SHARED_PAYLOAD_PREFIX, prefixLength)) {
+                const pid_t pid = atoi(fileName + prefixLength);
+                if (pid > 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+                    warning() << "Removing stale shared memory" << fileName;
+                    shm_unlink(String::format<128>("/%s", fileName).constData());
+                }
+            }
+            return Path::Continue;
+        });
+#endif
+}
+
+bool IndexDataMessage::mapSharedPayload()
+{
+    assert(!mSharedPayload.isEmpty());
+    assert(!mSharedData);
+    int fd;
+    eintrwrap(fd, shm_open(mSharedPayload.constData(), O_RDONLY, 0));
+    if (fd == -1) {
+        error() << "Failed to open shared memory" << mSharedPayload << Rct::strerror();
+        return false;
+    }
+    shm_unlink(mSharedPayload.constData());
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            mSharedData = data;
+            mSharedSize = st.st_size;
+        }
+    }
+    int ret;
+    eintrwrap(ret, close(fd));
+    if (!mSharedData) {
+        error() << "Failed to map shared memory" << mSharedPayload << Rct::strerror();
+        return false;
+    }
+    return true;
+}
+
+bool IndexDataMessage::decodeSharedPayload()
+{
+    if (!mSharedData)
+        return false;
+    {
+        Deserializer deserializer(static_cast<const char*>(mSharedData), mSharedSize);
+        decodePayload(deserializer);
+    }
+    unmapSharedPayload();
+    return true;
+}
+
+void IndexDataMessage::unmapSharedPayload()
+{
+    if (mSharedData) {
+        munmap(mSharedData, mSharedSize);
+        mSharedData = 0;
+        mSharedSize = 0;
+    }
+}
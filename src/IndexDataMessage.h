@@ -17,6 +17,7 @@
 #define IndexDataMessage_h
 
 #include "Diagnostic.h"
+#include "FileIdSet.h"
 #include "IndexerJob.h"
 #include "rct/Flags.h"
 #include "rct/Serializer.h"
@@ -30,16 +31,39 @@ public:
 
     IndexDataMessage(const std::shared_ptr<IndexerJob> &job)
         : RTagsMessage(MessageId), mParseTime(0), mKey(job->source.key()), mId(0),
-          mIndexerJobFlags(job->flags)
+          mIndexerJobFlags(job->flags), mSharedData(0), mSharedSize(0)
     {}
 
     IndexDataMessage()
-        : RTagsMessage(MessageId), mParseTime(0), mKey(0), mId(0)
+        : RTagsMessage(MessageId), mParseTime(0), mKey(0), mId(0), mSharedData(0), mSharedSize(0)
     {}
+    ~IndexDataMessage();
+    // owns the mapping of the shared payload
+    IndexDataMessage(const IndexDataMessage &) = delete;
+    IndexDataMessage &operator=(const IndexDataMessage &) = delete;
 
     void encode(Serializer &serializer) const;
     void decode(Deserializer &deserializer);
 
+    // Fix-its, includes, diagnostics and files that encode to more than
+    // this are passed in a shared memory segment and only its name goes
+    // through the connection. rdm maps the segment and decodes it off the
+    // main thread.
+    enum { SharedPayloadThreshold = 64 * 1024 };
+    // rp, returns true if the payload was moved to a segment. A smaller
+    // payload is kept encoded for encode().
+    bool sharePayload();
+    void unlinkSharedPayload();
+    // rdm, at startup. Removes the segments of rps that are gone, they
+    // were never mapped.
+    static void removeStaleSharedPayloads();
+    // rdm, mapSharedPayload() opens and unlinks the segment and has to be
+    // called before the connection is finished. decodeSharedPayload() can
+    // run on any thread.
+    bool hasSharedPayload() const { return !mSharedPayload.isEmpty(); }
+    bool mapSharedPayload();
+    bool decodeSharedPayload();
+
     enum Flag {
         None = 0x0,
         ParseFailure = 0x1,
@@ -50,9 +74,9 @@ public:
     void setFlags(Flags<Flag> flags) { mFlags = flags; }
     void setFlag(Flag flag, bool on = true) { mFlags.set(flag, on); }
 
-    Set<uint32_t> visitedFiles() const
+    FileIdSet visitedFiles() const
     {
-        Set<uint32_t> ret;
+        FileIdSet ret;
         for (const auto &it : mFiles) {
             if (it.second & Visited)
                 ret.insert(it.first);
@@ -60,9 +84,9 @@ public:
         return ret;
     }
 
-    Set<uint32_t> blockedFiles() const
+    FileIdSet blockedFiles() const
     {
-        Set<uint32_t> ret;
+        FileIdSet ret;
         for (const auto &it : mFiles) {
             if (!(it.second & Visited))
                 ret.insert(it.first);
@@ -101,7 +125,8 @@ public:
     enum FileFlag {
         NoFileFlag = 0x0,
         Visited = 0x1,
-        HeaderError = 0x2
+        HeaderError = 0x2,
+        Unchanged = 0x4 // visited but the maps were the same as before and weren't rewritten
     };
     Hash<uint32_t, Flags<FileFlag> > &files() { return mFiles; }
     const Hash<uint32_t, Flags<FileFlag> > &files() const { return mFiles; }
@@ -115,21 +140,18 @@ private:
     Includes mIncludes;
     Hash<uint32_t, Flags<FileFlag> > mFiles;
     Flags<Flag> mFlags;
+
+    void encodePayload(Serializer &serializer) const;
+    void decodePayload(Deserializer &deserializer);
+    void unmapSharedPayload();
+
+    String mEncodedPayload; // set by sharePayload() if it was too small to share
+    String mSharedPayload; // name of the segment
+    void *mSharedData;
+    size_t mSharedSize;
 };
 
 RCT_FLAGS(IndexDataMessage::Flag);
 RCT_FLAGS(IndexDataMessage::FileFlag);
 
-inline void IndexDataMessage::encode(Serializer &serializer) const
-{
-    serializer << mProject << mParseTime << mKey << mId << mIndexerJobFlags << mMessage
-               << mFixIts << mIncludes << mDiagnostics << mFiles << mFlags;
-}
-
-inline void IndexDataMessage::decode(Deserializer &deserializer)
-{
-    deserializer >> mProject >> mParseTime >> mKey >> mId >> mIndexerJobFlags >> mMessage
-                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags;
-}
-
 #endif
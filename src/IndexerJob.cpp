@@ -39,20 +39,21 @@ IndexerJob::IndexerJob(const Source &s,
     assert(server);
     if (server->isActiveBuffer(source.fileId)) {
         priority += 8;
-    } else if (DependencyNode *node = p->dependencyNode(source.fileId)) {
-        Set<DependencyNode*> seen;
-        seen.insert(node);
-        std::function<bool(const DependencyNode *node)> func = [&](const DependencyNode *node) {
-            for (const auto &inc : node->includes) {
-                if (seen.insert(inc.second)
-                    && !Location::path(node->fileId).isSystem()
-                    && (server->isActiveBuffer(node->fileId) || func(inc.second))) {
+    } else if (p->dependencies().contains(source.fileId)) {
+        const DependencyGraph &deps = p->dependencies();
+        Set<uint32_t> seen;
+        seen.insert(source.fileId);
+        std::function<bool(uint32_t node)> func = [&](uint32_t node) {
+            for (uint32_t inc : deps.includes(node)) {
+                if (seen.insert(inc)
+                    && !Location::path(node).isSystem()
+                    && (server->isActiveBuffer(node) || func(inc))) {
                     return true;
                 }
             }
             return false;
         };
-        if (func(node))
+        if (func(source.fileId))
             priority += 2;
     }
     visited.insert(s.fileId);
@@ -141,6 +142,7 @@ String IndexerJob::encode() const
                    << static_cast<uint32_t>(options.rpConnectTimeout)
                    << static_cast<uint32_t>(options.rpConnectAttempts)
                    << static_cast<int32_t>(options.rpNiceValue)
+                   << static_cast<uint32_t>(options.rpWriteThreads)
                    << options.options
                    << unsavedFiles
                    << options.dataDir
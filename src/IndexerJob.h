@@ -16,6 +16,7 @@
 #ifndef IndexerJob_h
 #define IndexerJob_h
 
+#include "FileIdSet.h"
 #include "rct/Flags.h"
 #include "rct/SignalSlot.h"
 #include "RTags.h"
@@ -54,7 +55,7 @@ public:
     int priority;
     enum { HeaderError = -1 };
     UnsavedFiles unsavedFiles;
-    Set<uint32_t> visited;
+    FileIdSet visited;
     int crashCount;
     Signal<std::function<void(IndexerJob *)> > destroyed;
 private:
@@ -26,7 +26,9 @@ enum { MaxPriority = 10 };
 // we set the priority to be this when a job has been requested and we couldn't load it
 JobScheduler::JobScheduler()
     : mProcrastination(0)
-{}
+{
+    mIdleSessionTimer.timeout().connect(std::bind(&JobScheduler::onIdleSessionTimeout, this, std::placeholders::_1));
+}
 
 JobScheduler::~JobScheduler()
 {
@@ -36,6 +38,8 @@ JobScheduler::~JobScheduler()
             job.first->kill();
         }
     }
+    for (Process *process : mIdleProcesses)
+        process->kill();
 }
 
 void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
@@ -61,30 +65,13 @@ void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
         startJobs();
 }
 
-uint32_t JobScheduler::hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const
-{
-    assert(node);
-    for (auto dep : node->includes) {
-        if (!seen.insert(dep.first))
-            continue;
-
-        if (mHeaderErrors.contains(dep.first)) {
-            return dep.first;
-        }
-        if (uint32_t fileId = hasHeaderError(dep.second, seen)) {
-            return fileId;
-        }
-    }
-    return 0;
-}
-
 uint32_t JobScheduler::hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const
 {
-    DependencyNode *node = project->dependencies().value(file);
-    if (!node)
-        return false;
-    Set<uint32_t> seen;
-    return hasHeaderError(node, seen);
+    const DependencyGraph &deps = project->dependencies();
+    if (mHeaderErrors.isEmpty() || !deps.contains(file))
+        return 0;
+    const FileIdSet errors = *deps.closure(file, DependencyGraph::Includes) & mHeaderErrors;
+    return errors.isEmpty() ? 0 : *errors.begin();
 }
 
 void JobScheduler::startJobs()
@@ -123,30 +110,34 @@ void JobScheduler::startJobs()
         }
 
         const uint64_t jobId = node->job->id;
-        Process *process = new Process;
-        debug() << "Starting process for" << jobId << node->job->source.key() << node->job.get();
-        List<String> arguments;
-        arguments << "--priority" << String::number(node->job->priority);
-
-        for (int i=logLevel().toInt(); i>0; --i)
-            arguments << "-v";
-
-        process->readyReadStdOut().connect([this](Process *proc) {
-                std::shared_ptr<Node> node = mActiveByProcess[proc];
-                assert(node);
-                node->stdOut.append(proc->readAllStdOut());
-
-                std::regex rx("@CRASH@([^@]*)@CRASH@");
-                std::smatch match;
-                while (std::regex_search(node->stdOut.ref(), match, rx)) {
-                    error() << match[1].str();
-                    node->stdOut.remove(match.position(), match.length());
+        // Only new sources are indexed in a session. A file that is
+        // reindexed may have had its function bodies parsed by the session
+        // before and they'd be skipped this time around.
+        const bool session = (options.rpSessionJobs > 1
+                              && !(node->job->flags & (IndexerJob::Dirty|IndexerJob::Reindex))
+                              && node->job->unsavedFiles.isEmpty());
+        Process *process = 0;
+        if (session) {
+            for (size_t i=mIdleProcesses.size(); i>0; --i) {
+                if (mSessions.value(mIdleProcesses.at(i - 1)).project == node->job->project) {
+                    process = mIdleProcesses.at(i - 1);
+                    mIdleProcesses.remove(process);
+                    break;
                 }
-            });
-
-        if (!process->start(options.rp, arguments)) {
-            error() << "Couldn't start rp" << options.rp << process->errorString();
-            delete process;
+            }
+        }
+        if (process) {
+            debug() << "Reusing process for" << jobId << node->job->source.key() << node->job.get();
+        } else {
+            if (!mIdleProcesses.isEmpty() && mActiveByProcess.size() + mIdleProcesses.size() >= options.jobCount) {
+                // make room for the new one
+                Process *idle = mIdleProcesses.first();
+                mIdleProcesses.remove(idle);
+                idle->kill();
+            }
+            process = startProcess(node->job, session);
+        }
+        if (!process) {
             node->job->flags |= IndexerJob::Crashed;
             debug() << "job crashed (didn't start)" << jobId << node->job->source.key() << node->job.get();
             std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(node->job));
@@ -155,41 +146,16 @@ void JobScheduler::startJobs()
             cont();
             continue;
         }
+        if (session) {
+            Session &s = mSessions[process];
+            s.project = node->job->project;
+            ++s.jobs;
+        }
         if (headerError) {
             node->job->priority = IndexerJob::HeaderError;
             warning() << "Letting" << node->job->sourceFile << "go even with a headerheader error from" << Location::path(headerError);
             mHeaderErrorJobIds.insert(jobId);
         }
-        process->finished().connect([this, jobId](Process *proc) {
-                EventLoop::deleteLater(proc);
-                auto node = mActiveByProcess.take(proc);
-                assert(!node || node->process == proc);
-                const String stdErr = proc->readAllStdErr();
-                if ((node && !node->stdOut.isEmpty()) || !stdErr.isEmpty()) {
-                    error() << (node ? ("Output from " + node->job->sourceFile + ":") : String("Orphaned process:"))
-                            << '\n' << stdErr << (node ? node->stdOut : String());
-                }
-
-                if (node) {
-                    assert(node->process == proc);
-                    node->process = 0;
-                    assert(!(node->job->flags & IndexerJob::Aborted));
-                    if (!(node->job->flags & IndexerJob::Complete) && proc->returnCode() != 0) {
-                        auto nodeById = mActiveById.take(jobId);
-                        assert(nodeById);
-                        assert(nodeById == node);
-                        // job failed, probably no IndexDataMessage coming
-                        node->job->flags |= IndexerJob::Crashed;
-                        debug() << "job crashed" << jobId << node->job->source.key() << node->job.get();
-                        std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(node->job));
-                        msg->setFlag(IndexDataMessage::ParseFailure);
-                        jobFinished(node->job, msg);
-                    }
-                }
-                mHeaderErrorJobIds.remove(jobId);
-                startJobs();
-            });
-
 
         node->process = process;
         assert(!(node->job->flags & ~IndexerJob::Type_Mask));
@@ -203,6 +169,78 @@ void JobScheduler::startJobs()
     }
 }
 
+Process *JobScheduler::startProcess(const std::shared_ptr<IndexerJob> &job, bool session)
+{
+    const auto &options = Server::instance()->options();
+    Process *process = new Process;
+    debug() << "Starting process for" << job->id << job->source.key() << job.get();
+    List<String> arguments;
+    arguments << "--priority" << String::number(job->priority);
+    if (session)
+        arguments << "--session" << String::number(options.rpSessionJobs);
+
+    for (int i=logLevel().toInt(); i>0; --i)
+        arguments << "-v";
+
+    process->readyReadStdOut().connect([this](Process *proc) {
+            std::shared_ptr<Node> node = mActiveByProcess.value(proc);
+            if (!node) { // an idle session
+                const String out = proc->readAllStdOut();
+                if (!out.isEmpty())
+                    error() << "Output from idle rp:" << '\n' << out;
+                return;
+            }
+            node->stdOut.append(proc->readAllStdOut());
+
+            std::regex rx("@CRASH@([^@]*)@CRASH@");
+            std::smatch match;
+            while (std::regex_search(node->stdOut.ref(), match, rx)) {
+                error() << match[1].str();
+                node->stdOut.remove(match.position(), match.length());
+            }
+        });
+
+    if (!process->start(options.rp, arguments)) {
+        error() << "Couldn't start rp" << options.rp << process->errorString();
+        delete process;
+        return 0;
+    }
+
+    process->finished().connect([this](Process *proc) {
+            EventLoop::deleteLater(proc);
+            mIdleProcesses.remove(proc);
+            mSessions.remove(proc);
+            auto node = mActiveByProcess.take(proc);
+            assert(!node || node->process == proc);
+            const String stdErr = proc->readAllStdErr();
+            if ((node && !node->stdOut.isEmpty()) || !stdErr.isEmpty()) {
+                error() << (node ? ("Output from " + node->job->sourceFile + ":") : String("Orphaned process:"))
+                        << '\n' << stdErr << (node ? node->stdOut : String());
+            }
+
+            if (node) {
+                const uint64_t jobId = node->job->id;
+                assert(node->process == proc);
+                node->process = 0;
+                assert(!(node->job->flags & IndexerJob::Aborted));
+                if (!(node->job->flags & IndexerJob::Complete) && proc->returnCode() != 0) {
+                    auto nodeById = mActiveById.take(jobId);
+                    assert(nodeById);
+                    assert(nodeById == node);
+                    // job failed, probably no IndexDataMessage coming
+                    node->job->flags |= IndexerJob::Crashed;
+                    debug() << "job crashed" << jobId << node->job->source.key() << node->job.get();
+                    std::shared_ptr<IndexDataMessage> msg(new IndexDataMessage(node->job));
+                    msg->setFlag(IndexDataMessage::ParseFailure);
+                    jobFinished(node->job, msg);
+                }
+                mHeaderErrorJobIds.remove(jobId);
+            }
+            startJobs();
+        });
+    return process;
+}
+
 void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage> &message)
 {
     auto node = mActiveById.take(message->id());
@@ -211,7 +249,34 @@ void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage
         return;
     }
     debug() << "job got index data message" << node->job->id << node->job->source.key() << node->job.get();
+    Process *process = node->process;
+    const bool idle = (process && mSessions.contains(process)
+                       && mSessions.value(process).jobs < Server::instance()->options().rpSessionJobs);
+    if (idle) {
+        // the session waits for its next job
+        mActiveByProcess.remove(process);
+        node->process = 0;
+        if (!node->stdOut.isEmpty())
+            error() << ("Output from " + node->job->sourceFile + ":") << '\n' << node->stdOut;
+        mIdleProcesses.append(process);
+        mIdleSessionTimer.restart(IdleSessionTimeout, Timer::SingleShot);
+        mHeaderErrorJobIds.remove(node->job->id);
+    }
     jobFinished(node->job, message);
+    if (idle)
+        startJobs();
+}
+
+void JobScheduler::onIdleSessionTimeout(Timer *)
+{
+    // The timer is restarted whenever a session goes idle so all of these
+    // have waited for at least IdleSessionTimeout
+    if (!mIdleProcesses.isEmpty())
+        debug() << "Killing" << mIdleProcesses.size() << "idle rp sessions";
+    const List<Process *> idle = std::move(mIdleProcesses);
+    mIdleProcesses.clear();
+    for (Process *process : idle)
+        process->kill();
 }
 
 void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message)
@@ -310,6 +375,7 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
         debug() << "Killing process" << node->process;
         node->process->kill();
         mActiveByProcess.remove(node->process);
+        mHeaderErrorJobIds.remove(job->id);
     }
 }
 
@@ -18,17 +18,20 @@
 
 #include <memory>
 
+#include "FileIdSet.h"
 #include "rct/EmbeddedLinkedList.h"
 #include "rct/Set.h"
 #include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Path.h"
 #include "rct/String.h"
+#include "rct/Timer.h"
 
 class Connection;
 class IndexDataMessage;
 class IndexerJob;
 class Process;
 class Project;
-struct DependencyNode;
 class JobScheduler : public std::enable_shared_from_this<JobScheduler>
 {
 public:
@@ -58,26 +61,40 @@ public:
     void dump(const std::shared_ptr<Connection> &conn);
     void abort(const std::shared_ptr<IndexerJob> &job);
     void clearHeaderError(uint32_t file);
-    Set<uint32_t> headerErrors() const { return mHeaderErrors; }
+    FileIdSet headerErrors() const { return mHeaderErrors; }
     bool increasePriority(uint32_t fileId);
 private:
-    enum { HighPriority = 5 };
+    enum { HighPriority = 5, IdleSessionTimeout = 10000 };
     void jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message);
     void startJobs();
+    void onIdleSessionTimeout(Timer *);
+    Process *startProcess(const std::shared_ptr<IndexerJob> &job, bool session);
     struct Node {
         std::shared_ptr<IndexerJob> job;
         Process *process;
         std::shared_ptr<Node> next, prev;
         String stdOut;
     };
-    uint32_t hasHeaderError(DependencyNode *node, Set<uint32_t> &seen) const;
     uint32_t hasHeaderError(uint32_t file, const std::shared_ptr<Project> &project) const;
 
     int mProcrastination;
-    Set<uint32_t> mHeaderErrors;
+    FileIdSet mHeaderErrors;
     Set<uint64_t> mHeaderErrorJobIds;
     EmbeddedLinkedList<std::shared_ptr<Node> > mPendingJobs;
     Hash<Process *, std::shared_ptr<Node> > mActiveByProcess;
+    // With Server::Options::rpSessionJobs an rp that is done with a job
+    // waits here for the next one from the same project, since the session
+    // skips the bodies in headers it has seen before. It exits on its own
+    // after rpSessionJobs jobs and is killed once it has been idle for
+    // IdleSessionTimeout ms so it doesn't hold on to its ASTs.
+    struct Session {
+        Session() : jobs(0) {}
+        Path project;
+        int jobs;
+    };
+    List<Process *> mIdleProcesses;
+    Hash<Process *, Session> mSessions;
+    Timer mIdleSessionTimer;
     Hash<uint64_t, std::shared_ptr<Node> > mActiveById, mInactiveById;
 };
 
@@ -27,7 +27,7 @@ const Flags<QueryJob::JobFlag> elispFlags = (defaultFlags | QueryJob::QuoteOutpu
 
 ListSymbolsJob::ListSymbolsJob(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Project> &proj)
     : QueryJob(query, proj, query->flags() & QueryMessage::Elisp ? elispFlags : defaultFlags),
-      string(query->query())
+      string(query->query()), unsorted(query->flags() & QueryMessage::Unsorted)
 {
 }
 
@@ -35,6 +35,9 @@ int ListSymbolsJob::execute()
 {
     Set<String> out;
     std::shared_ptr<Project> proj = project();
+    const bool elisp = queryFlags() & QueryMessage::Elisp;
+    if (unsorted && elisp)
+        write("(list", IgnoreMax | DontQuote);
     if (proj) {
         if (queryFlags() & QueryMessage::WildcardSymbolNames
             && (string.contains('*') || string.contains('?')) && !string.endsWith('*')) {
@@ -55,13 +58,17 @@ int ListSymbolsJob::execute()
             }
         }
         if (!paths.isEmpty()) {
-            out = listSymbolsWithPathFilter(proj, paths);
+            listSymbolsWithPathFilter(proj, paths, out);
         } else {
-            out = listSymbols(proj);
+            listSymbols(proj, out);
         }
     }
 
-    if (queryFlags() & QueryMessage::Elisp) {
+    if (unsorted) {
+        // already written by addSymbol
+        if (elisp)
+            write(")", IgnoreMax | DontQuote);
+    } else if (elisp) {
         write("(list", IgnoreMax | DontQuote);
         for (Set<String>::const_iterator it = out.begin(); it != out.end(); ++it) {
             write(*it);
@@ -82,15 +89,49 @@ int ListSymbolsJob::execute()
     return out.isEmpty() ? 1 : 0;
 }
 
-Set<String> ListSymbolsJob::listSymbolsWithPathFilter(const std::shared_ptr<Project> &project, const List<Path> &paths) const
+FileIdSet ListSymbolsJob::cacheFiles() const
+{
+    // only the files themselves are looked at when all filters are files,
+    // see execute()
+    FileIdSet ret;
+    for (const auto &filter : pathFilters()) {
+        if (filter.mode != QueryMessage::PathFilter::Self || !Path(filter.pattern).isFile())
+            return FileIdSet();
+        const uint32_t fileId = Location::fileId(filter.pattern);
+        if (!fileId)
+            return FileIdSet();
+        ret.insert(fileId);
+    }
+    return ret;
+}
+
+bool ListSymbolsJob::addSymbol(Set<String> &out, const String &symbolName)
+{
+    if (!unsorted) {
+        out.insert(symbolName);
+        return true;
+    }
+    if (maxReached())
+        return false;
+    if (out.insert(symbolName)) {
+        write(symbolName);
+        if (maxReached()) {
+            // stops Project::findSymbols as well
+            abort();
+            return false;
+        }
+    }
+    return true;
+}
+
+void ListSymbolsJob::listSymbolsWithPathFilter(const std::shared_ptr<Project> &project, const List<Path> &paths, Set<String> &out)
 {
-    Set<String> out;
     const bool imenu = queryFlags() & QueryMessage::IMenu;
     const bool wildcard = queryFlags() & QueryMessage::WildcardSymbolNames && (string.contains('*') || string.contains('?'));
     const bool stripParentheses = queryFlags() & QueryMessage::StripParentheses;
     const bool caseInsensitive = queryFlags() & QueryMessage::MatchCaseInsensitive;
     const String::CaseSensitivity cs = caseInsensitive ? String::CaseInsensitive : String::CaseSensitive;
-    for (size_t i=0; i<paths.size(); ++i) {
+    for (size_t i=0; i<paths.size() && !isAborted(); ++i) {
         const Path file = paths.at(i);
         const uint32_t fileId = Location::fileId(file);
         if (!fileId)
@@ -115,27 +156,26 @@ Set<String> ListSymbolsJob::listSymbolsWithPathFilter(const std::shared_ptr<Proj
             }
 
             const int paren = string.indexOf('(');
+            bool more;
             if (paren == -1) {
-                out.insert(string);
+                more = addSymbol(out, string);
             } else {
-                if (!RTags::isFunctionVariable(string))
-                    out.insert(string.left(paren));
-                if (!stripParentheses)
-                    out.insert(string);
+                more = RTags::isFunctionVariable(string) || addSymbol(out, string.left(paren));
+                if (more && !stripParentheses)
+                    more = addSymbol(out, string);
             }
-            out.insert(symbolName);
+            if (!more || !addSymbol(out, symbolName))
+                return;
         }
     }
-    return out;
 }
 
-Set<String> ListSymbolsJob::listSymbols(const std::shared_ptr<Project> &project) const
+void ListSymbolsJob::listSymbols(const std::shared_ptr<Project> &project, Set<String> &out)
 {
     const bool hasFilter = QueryJob::hasFilter();
     const bool stripParentheses = queryFlags() & QueryMessage::StripParentheses;
     const bool imenu = queryFlags() & QueryMessage::IMenu;
 
-    Set<String> out;
     auto inserter = [this, &project, hasFilter, stripParentheses, imenu, &out](Project::SymbolMatchType,
                                                                                const String &string,
                                                                                const Set<Location> &locations) {
@@ -157,15 +197,14 @@ Set<String> ListSymbolsJob::listSymbols(const std::shared_ptr<Project> &project)
         }
         const int paren = string.indexOf('(');
         if (paren == -1) {
-            out.insert(string);
-        } else {
-            if (!RTags::isFunctionVariable(string))
-                out.insert(string.left(paren));
-            if (!stripParentheses)
-                out.insert(string);
+            addSymbol(out, string);
+        } else if ((RTags::isFunctionVariable(string) || addSymbol(out, string.left(paren))) && !stripParentheses) {
+            addSymbol(out, string);
         }
     };
 
-    project->findSymbols(string, inserter, queryFlags());
-    return out;
+    std::function<bool(uint32_t)> acceptFile;
+    if (hasFilter)
+        acceptFile = [this](uint32_t fileId) { return filter(Location::path(fileId)); };
+    project->findSymbols(string, inserter, queryFlags(), 0, cancellation(), acceptFile);
 }
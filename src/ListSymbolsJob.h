@@ -26,10 +26,13 @@ class ListSymbolsJob : public QueryJob
 {
 public:
     ListSymbolsJob(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Project> &proj);
+    virtual FileIdSet cacheFiles() const override;
 protected:
     virtual int execute() override;
-    Set<String> listSymbolsWithPathFilter(const std::shared_ptr<Project> &project, const List<Path> &paths) const;
-    Set<String> listSymbols(const std::shared_ptr<Project> &project) const;
+    void listSymbolsWithPathFilter(const std::shared_ptr<Project> &project, const List<Path> &paths, Set<String> &out);
+    void listSymbols(const std::shared_ptr<Project> &project, Set<String> &out);
+    // Returns false once we don't need any more symbols
+    bool addSymbol(Set<String> &out, const String &symbolName);
     static bool isImenuSymbol(const Symbol &symbol)
     {
         if (!symbol.isReference()) {
@@ -53,6 +56,7 @@ protected:
     }
 private:
     String string;
+    const bool unsorted;
 };
 
 #endif
@@ -92,7 +92,9 @@ public:
         return sIdsToPaths.size();
     }
 
-    static inline uint32_t insertFile(const Path &path)
+    // Callers that insert many files at once can pass false and save the
+    // file ids themselves afterwards
+    static inline uint32_t insertFile(const Path &path, bool saveIds = true)
     {
         bool save = false;
         (void)save;
@@ -111,8 +113,10 @@ public:
             ret = id;
         }
 #ifndef RTAGS_SINGLE_THREAD
-        if (save)
+        if (save && saveIds)
             saveFileIds();
+#else
+        (void)saveIds;
 #endif
         return ret;
     }
@@ -265,6 +269,18 @@ public:
         }
     }
 
+    // Unlike init() this leaves the last id alone so the removed ids aren't
+    // handed out again
+    static void remove(const List<uint32_t> &fileIds)
+    {
+        LOCK();
+        for (uint32_t fileId : fileIds) {
+            const Path path = sIdsToPaths.take(fileId);
+            if (!path.isEmpty())
+                sPathsToIds.remove(path);
+        }
+    }
+
     static void set(const Path &path, uint32_t fileId)
     {
         LOCK();
@@ -0,0 +1,107 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef LocationIndex_h
+#define LocationIndex_h
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+#include "FileMap.h"
+#include "Location.h"
+#include "rct/List.h"
+#include "rct/Set.h"
+#include "rct/String.h"
+
+/*
+ * Append-only String -> Location multimap. rp inserts usrs and symbol names
+ * for every cursor but never looks them up, so instead of a tree node per
+ * key and per location an insert is a push_back and the entries are sorted
+ * and deduplicated once, when the unit is written. Everything is released
+ * in one go with the list.
+ */
+class LocationIndex
+{
+public:
+    typedef std::pair<String, Location> Entry;
+
+    LocationIndex()
+        : mSorted(true)
+    {}
+
+    void insert(const String &key, Location location)
+    {
+        if (mSorted && !mEntries.isEmpty() && !(mEntries.back() < Entry(key, location)))
+            mSorted = false;
+        mEntries.push_back(std::make_pair(key, location));
+    }
+
+    bool isEmpty() const { return mEntries.isEmpty(); }
+    size_t size() const { return mEntries.size(); }
+
+    // Sorts by key and location and drops duplicates
+    void sort()
+    {
+        if (!mSorted) {
+            std::sort(mEntries.begin(), mEntries.end());
+            mEntries.erase(std::unique(mEntries.begin(), mEntries.end()), mEntries.end());
+            mSorted = true;
+        }
+    }
+
+    // Number of distinct keys, only valid after sort()
+    size_t keyCount() const
+    {
+        assert(mSorted);
+        size_t count = 0;
+        for (size_t i=0; i<mEntries.size(); ++i) {
+            if (!i || mEntries.at(i).first != mEntries.at(i - 1).first)
+                ++count;
+        }
+        return count;
+    }
+
+    const List<Entry> &entries() const { return mEntries; }
+
+    // Writes the String -> Set<Location> FileMap. Sorts first, the entries
+    // of a key are then next to each other so only one Set is built at a
+    // time. See FileMapWriter for digest.
+    bool write(const Path &path, uint32_t options, SHA256 *digest = 0)
+    {
+        sort();
+        FileMapWriter<String, Set<Location> > writer(path, keyCount(), options, digest);
+        if (!writer.open())
+            return false;
+        for (size_t i=0; i<mEntries.size(); ++i) {
+            if (!i || mEntries.at(i).first != mEntries.at(i - 1).first)
+                writer.addKey(mEntries.at(i).first);
+        }
+        Set<Location> locations;
+        for (size_t i=0; i<mEntries.size(); ++i) {
+            locations.insert(mEntries.at(i).second);
+            if (i + 1 == mEntries.size() || mEntries.at(i + 1).first != mEntries.at(i).first) {
+                writer.addValue(locations);
+                locations.clear();
+            }
+        }
+        return writer.finish();
+    }
+private:
+    List<Entry> mEntries;
+    bool mSorted;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ParallelScan.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "rct/ThreadPool.h"
+#include "Server.h"
+
+namespace {
+// Shared with the pool jobs. A job that only starts after the scan has
+// returned finds no shards left and never touches scan.
+struct State
+{
+    State(size_t count, const std::function<void(size_t)> &func)
+        : shards(count), next(0), scan(func)
+    {
+        done.resize(count, false);
+    }
+
+    // Returns false when there are no shards left to start
+    bool scanNext()
+    {
+        const size_t shard = next++;
+        if (shard >= shards)
+            return false;
+        scan(shard);
+        std::lock_guard<std::mutex> lock(mutex);
+        done[shard] = true;
+        condition.notify_one();
+        return true;
+    }
+
+    const size_t shards;
+    std::atomic<size_t> next;
+    const std::function<void(size_t)> &scan;
+    std::mutex mutex;
+    std::condition_variable condition;
+    List<bool> done;
+};
+
+class ShardJob : public ThreadPool::Job
+{
+public:
+    ShardJob(const std::shared_ptr<State> &state)
+        : mState(state)
+    {}
+protected:
+    virtual void run() override
+    {
+        while (mState->scanNext()) {}
+    }
+private:
+    const std::shared_ptr<State> mState;
+};
+}
+
+void ParallelScan::run(size_t shards,
+                       const std::function<void(size_t)> &scan,
+                       const std::function<void(size_t)> &merge)
+{
+    Server *server = Server::instance();
+    ThreadPool *pool = server ? server->scanThreadPool() : 0;
+    if (!pool || shards <= 1) {
+        for (size_t shard=0; shard<shards; ++shard) {
+            scan(shard);
+            merge(shard);
+        }
+        return;
+    }
+
+    auto state = std::make_shared<State>(shards, scan);
+    const size_t helpers = std::min<size_t>(shards - 1, server->options().scanThreadCount);
+    for (size_t i=0; i<helpers; ++i)
+        pool->start(std::make_shared<ShardJob>(state));
+
+    size_t merged = 0;
+    while (merged < shards) {
+        const bool scanned = state->scanNext();
+        size_t ready = merged;
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            if (!scanned) {
+                // everything has been started, wait for the next shard in line
+                while (!state->done[merged])
+                    state->condition.wait(lock);
+            }
+            while (ready < shards && state->done[ready])
+                ++ready;
+        }
+        while (merged < ready)
+            merge(merged++);
+    }
+}
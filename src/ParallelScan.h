@@ -0,0 +1,70 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ParallelScan_h
+#define ParallelScan_h
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+
+#include "CancellationToken.h"
+#include "rct/List.h"
+
+/*
+ * Lookups that have to open the maps of every file in a project split the
+ * files into shards of ShardSize files and scan them on the server's scan
+ * thread pool. Threads keep taking the next shard nobody has started on
+ * until there are none left, the calling thread included, so a scan never
+ * waits for a busy pool. Every shard collects its results separately and
+ * the calling thread merges them in shard order as soon as all earlier
+ * shards are done so the output is the same as that of a serial scan.
+ */
+namespace ParallelScan {
+enum { ShardSize = 32 };
+
+// Calls scan for every shard on any thread and merge for every shard, in
+// order, on the calling thread. Runs serially when the server has no scan
+// threads.
+void run(size_t shards,
+         const std::function<void(size_t)> &scan,
+         const std::function<void(size_t)> &merge);
+
+template <typename T>
+void scan(const List<uint32_t> &files,
+          const CancellationToken *cancel,
+          const std::function<void(uint32_t, T &)> &scanFile,
+          const std::function<void(T &)> &merge)
+{
+    List<T> results;
+    results.resize((files.size() + ShardSize - 1) / ShardSize);
+    run(results.size(), [&](size_t shard) {
+            T &result = results[shard];
+            const size_t end = std::min<size_t>(files.size(), (shard + 1) * ShardSize);
+            for (size_t i=shard * ShardSize; i<end; ++i) {
+                if (CancellationToken::isCancelled(cancel))
+                    return;
+                scanFile(files.at(i), result);
+            }
+        }, [&](size_t shard) {
+            // merge may cancel, e.g. when a job has written enough
+            if (!CancellationToken::isCancelled(cancel))
+                merge(results[shard]);
+            results[shard] = T();
+        });
+}
+}
+
+#endif
@@ -0,0 +1,70 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "PrefetchThread.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef OS_Linux
+#include <sys/syscall.h>
+#endif
+
+#include "rct/Log.h"
+#include "rct/Rct.h"
+
+PrefetchThread::PrefetchThread(List<Path> &&paths, size_t budget, const std::shared_ptr<std::atomic<bool> > &cancelled)
+    : Thread(), mPaths(std::move(paths)), mBudget(budget), mCancelled(cancelled)
+{
+}
+
+void PrefetchThread::run()
+{
+#ifdef OS_Linux
+    // On Linux the nice value is per thread
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+    size_t remaining = mBudget;
+    int files = 0;
+    for (const Path &path : mPaths) {
+        if (!remaining || *mCancelled)
+            break;
+        int fd;
+        eintrwrap(fd, open(path.constData(), O_RDONLY));
+        if (fd == -1)
+            continue;
+        struct stat st;
+        if (!fstat(fd, &st) && st.st_size > 0) {
+            const size_t size = std::min<size_t>(st.st_size, remaining);
+#ifdef OS_Linux
+            readahead(fd, 0, size);
+#else
+            void *pointer = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (pointer != MAP_FAILED) {
+                madvise(pointer, size, MADV_WILLNEED);
+                munmap(pointer, size);
+            }
+#endif
+            remaining -= size;
+            ++files;
+        }
+        int ret;
+        eintrwrap(ret, close(fd));
+    }
+    debug() << "Prefetched" << files << "files" << (mBudget - remaining) << "bytes";
+}
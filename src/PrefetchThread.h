@@ -0,0 +1,42 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PrefetchThread_h
+#define PrefetchThread_h
+
+#include <atomic>
+#include <memory>
+
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/Thread.h"
+
+/*
+ * Pulls the given files into the page cache, in order, until the byte budget
+ * is used up or the shared cancel flag is set. It runs at the lowest
+ * scheduling priority and nothing waits for it to finish.
+ */
+class PrefetchThread : public Thread
+{
+public:
+    PrefetchThread(List<Path> &&paths, size_t budget, const std::shared_ptr<std::atomic<bool> > &cancelled);
+    virtual void run() override;
+private:
+    const List<Path> mPaths;
+    const size_t mBudget;
+    const std::shared_ptr<std::atomic<bool> > mCancelled;
+};
+
+#endif
@@ -25,12 +25,14 @@
 #include "IndexDataMessage.h"
 #include "JobScheduler.h"
 #include "LogOutputMessage.h"
+#include "ParallelScan.h"
+#include "PrefetchThread.h"
 #include "rct/DataFile.h"
+#include "rct/EventLoop.h"
 #include "rct/Log.h"
 #include "rct/MemoryMonitor.h"
 #include "rct/Path.h"
 #include "rct/Rct.h"
-#include "rct/ReadLocker.h"
 #include "rct/Thread.h"
 #include "rct/Value.h"
 #include "RTags.h"
@@ -43,22 +45,22 @@ class Dirty
 {
 public:
     virtual ~Dirty() {}
-    virtual Set<uint32_t> dirtied() const = 0;
+    virtual FileIdSet dirtied() const = 0;
     virtual bool isDirty(const Source &source) = 0;
 };
 
 class SimpleDirty : public Dirty
 {
 public:
-    void init(const Set<uint32_t> &dirty, const std::shared_ptr<Project> &project)
+    void init(const FileIdSet &dirty, const std::shared_ptr<Project> &project)
     {
         for (auto fileId : dirty) {
-            mDirty.insert(fileId);
-            mDirty += project->dependencies(fileId, Project::DependsOnArg);
+            if (!mDirty.contains(fileId))
+                mDirty += project->dependencies(fileId, Project::DependsOnArg);
         }
     }
 
-    virtual Set<uint32_t> dirtied() const override
+    virtual FileIdSet dirtied() const override
     {
         return mDirty;
     }
@@ -68,13 +70,13 @@ public:
         return mDirty.contains(source.fileId);
     }
 
-    Set<uint32_t> mDirty;
+    FileIdSet mDirty;
 };
 
 class ComplexDirty : public Dirty
 {
 public:
-    virtual Set<uint32_t> dirtied() const override
+    virtual FileIdSet dirtied() const override
     {
         return mDirty;
     }
@@ -92,7 +94,7 @@ public:
     }
 
     Hash<uint32_t, uint64_t> mLastModified;
-    Set<uint32_t> mDirty;
+    FileIdSet mDirty;
 };
 
 class SuspendedDirty : public ComplexDirty
@@ -141,7 +143,7 @@ public:
 class WatcherDirty : public ComplexDirty
 {
 public:
-    WatcherDirty(const std::shared_ptr<Project> &project, const Set<uint32_t> &modified)
+    WatcherDirty(const std::shared_ptr<Project> &project, const FileIdSet &modified)
     {
         for (auto it : modified) {
             mModified[it] = project->dependencies(it, Project::DependsOnArg);
@@ -169,62 +171,17 @@ public:
         return ret;
     }
 
-    Hash<uint32_t, Set<uint32_t> > mModified;
+    Hash<uint32_t, FileIdSet> mModified;
 };
 
-static bool loadDependencies(DataFile &file, Dependencies &dependencies)
-{
-    int size;
-    file >> size;
-    for (int i=0; i<size; ++i) {
-        uint32_t fileId;
-        file >> fileId;
-        dependencies[fileId] = new DependencyNode(fileId);
-    }
-    for (int i=0; i<size; ++i) {
-        int links;
-        file >> links;
-        if (links) {
-            uint32_t dependee;
-            file >> dependee;
-            DependencyNode *ee = dependencies[dependee];
-            if (!ee) {
-                return false;
-            }
-            for (int i=0; i<links; ++i) {
-                uint32_t dependent;
-                file >> dependent;
-                DependencyNode *ent = dependencies[dependent];
-                if (!ent) {
-                    return false;
-                }
-                ent->include(ee);
-            }
-        }
-    }
-    return true;
-}
-
-static void saveDependencies(DataFile &file, const Dependencies &dependencies)
-{
-    file << static_cast<int>(dependencies.size());
-    for (const auto &it : dependencies) {
-        file << it.first;
-    }
-    for (const auto &it : dependencies) {
-        file << static_cast<int>(it.second->dependents.size());
-        if (!it.second->dependents.isEmpty()) {
-            file << it.first;
-            for (const auto &dep : it.second->dependents) {
-                file << dep.first;
-            }
-        }
-    }
-}
-
 Project::Project(const Path &path)
-    : mPath(path), mSourceFilePathBase(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path)),
-      mJobCounter(0), mJobsStarted(0)
+    : mFileMapCache(Server::instance()->options().maxFileMapCacheSize,
+                    static_cast<size_t>(Server::instance()->options().maxFileMapCacheMemory) * 1024 * 1024),
+      mQueryCache(Server::instance()->options().queryCacheSize),
+      mPath(path), mSourceFilePathBase(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path)),
+      mJobCounter(0), mJobsStarted(0), mUnsyncedJobs(0),
+      mPublishedDependencies(std::make_shared<DependencyGraph>()), mPublishedSources(std::make_shared<Sources>()),
+      mUnpublished(0), mFileMapHitsChanged(false)
 {
     Path srcPath = mPath;
     RTags::encodePath(srcPath);
@@ -232,6 +189,8 @@ Project::Project(const Path &path)
     const Path tmp = options.dataDir + srcPath;
     mProjectFilePath = tmp + "/project";
     mSourcesFilePath = tmp + "/sources";
+    mDependenciesFilePath = tmp + "/dependencies";
+    mHotFilesPath = tmp + "/hotmaps";
 }
 
 Project::~Project()
@@ -240,30 +199,30 @@ Project::~Project()
         assert(job.second);
         Server::instance()->jobScheduler()->abort(job.second);
     }
-    mDependencies.deleteAll();
 
     assert(EventLoop::isMainThread());
     mDirtyTimer.stop();
+    cancelPrefetch();
 }
 
-static bool hasSourceDependency(const DependencyNode *node, const std::shared_ptr<Project> &project, Set<uint32_t> &seen)
+static bool hasSourceDependency(uint32_t fileId, const std::shared_ptr<Project> &project, Set<uint32_t> &seen)
 {
-    const Path path = Location::path(node->fileId);
+    const Path path = Location::path(fileId);
     // error("%s %d %d", path.constData(), path.isFile(), path.isSource());
-    if (path.isFile() && path.isSource() && project->hasSource(node->fileId)) {
+    if (path.isFile() && path.isSource() && project->hasSource(fileId)) {
         return true;
     }
-    for (auto it : node->dependents) {
-        if (seen.insert(it.first) && hasSourceDependency(it.second, project, seen))
+    for (uint32_t dependent : project->dependencies().dependents(fileId)) {
+        if (seen.insert(dependent) && hasSourceDependency(dependent, project, seen))
             return true;
     }
     return false;
 }
 
-static inline bool hasSourceDependency(const DependencyNode *node, const std::shared_ptr<Project> &project)
+static inline bool hasSourceDependency(uint32_t fileId, const std::shared_ptr<Project> &project)
 {
     Set<uint32_t> seen;
-    return hasSourceDependency(node, project, seen);
+    return hasSourceDependency(fileId, project, seen);
 }
 
 bool Project::readSources(const Path &path, Sources &sources, Hash<Path, CompilationDataBaseInfo> *info, String *err)
@@ -317,6 +276,7 @@ bool Project::init()
     }
 
     mDirtyTimer.timeout().connect(std::bind(&Project::onDirtyTimeout, this, std::placeholders::_1));
+    publishLater(PublishDependencies|PublishSources);
 
     String err;
     if (!Project::readSources(mSourcesFilePath, mSources, &mCompilationDatabaseInfos, &err)) {
@@ -326,6 +286,14 @@ bool Project::init()
         return false;
     }
 
+    {
+        DataFile file(mHotFilesPath, RTags::DatabaseVersion);
+        if (file.open(DataFile::Read)) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            file >> mFileMapHits;
+        }
+    }
+
     auto reindex = [this]() {
         if (mCompilationDatabaseInfos.isEmpty()) {
             mProjectFilePath.visit([](const Path &path) {
@@ -366,17 +334,22 @@ bool Project::init()
     for (const auto &info : mCompilationDatabaseInfos)
         watch(info.first, Watch_CompilationDatabase);
 
-    if (!loadDependencies(file, mDependencies)) {
-        mDependencies.deleteAll();
-        mVisitedFiles.clear();
-        mDiagnostics.clear();
-        error("Restore error %s: Failed load dependencies.", mPath.constData());
-        reindex();
-        return true;
+    file >> mDependencies;
+    {
+        String err;
+        if (!mDependencies.load(mDependenciesFilePath, &err)) {
+            mDependencies.clear();
+            mVisitedFiles.clear();
+            mDiagnostics.clear();
+            error("Restore error %s: Failed load dependencies. %s", mPath.constData(), err.constData());
+            reindex();
+            return true;
+        }
     }
 
-    for (const auto &dep : mDependencies) {
-        watchFile(dep.first);
+    const List<uint32_t> fileIds = mDependencies.fileIds();
+    for (uint32_t fileId : fileIds) {
+        watchFile(fileId);
     }
 
     bool needsSave = false;
@@ -398,21 +371,21 @@ bool Project::init()
             outputDirty = true;
         }
         const std::shared_ptr<Project> project = shared_from_this();
-        for (auto it : mDependencies) {
-            const Path path = Location::path(it.first);
+        for (uint32_t fileId : fileIds) {
+            const Path path = Location::path(fileId);
             if (!path.isFile()) {
                 warning() << path << "seems to have disappeared";
-                dirty.get()->insertDirtyFile(it.first);
+                dirty.get()->insertDirtyFile(fileId);
 
-                const Set<uint32_t> dependents = dependencies(it.first, DependsOnArg);
+                const FileIdSet dependents = dependencies(fileId, DependsOnArg);
                 for (auto dependent : dependents) {
                     dirty.get()->insertDirtyFile(dependent);
                 }
-                removed << it.first;
+                removed << fileId;
                 needsSave = true;
             } else {
                 String err;
-                if (!validate(it.first,  options.options & Server::ValidateFileMaps ? Validate : StatOnly, &err)) {
+                if (!validate(fileId,  options.options & Server::ValidateFileMaps ? Validate : StatOnly, &err)) {
                     if (!err.isEmpty()) {
                         if (outputDirty) {
                             outputDirty = false;
@@ -420,10 +393,10 @@ bool Project::init()
                         }
                         error() << err;
                     }
-                    if (hasSource(it.first) || hasSourceDependency(it.second, project)) {
-                        missingFileMaps.insert(it.first);
+                    if (hasSource(fileId) || hasSourceDependency(fileId, project)) {
+                        missingFileMaps.insert(fileId);
                     } else {
-                        removed << it.first;
+                        removed << fileId;
                         needsSave = true;
                     }
                 }
@@ -611,6 +584,19 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
 {
     std::shared_ptr<IndexerJob> restart;
     const uint32_t fileId = msg->fileId();
+    // rp has rewritten the file maps of the files it visited, unless they
+    // came out the same as before. Cached query results still have to go
+    // since their context lines come from the source, and an edit to a
+    // comment or whitespace leaves the maps as they were.
+    FileIdSet visited;
+    for (const auto &file : msg->files()) {
+        if (file.second & IndexDataMessage::Visited) {
+            visited.insert(file.first);
+            if (!(file.second & IndexDataMessage::Unchanged))
+                mFileMapCache.invalidate(file.first);
+        }
+    }
+    mQueryCache.invalidate(visited);
     auto j = mActiveJobs.take(msg->key());
     if (!j) {
         error() << "Couldn't find JobData for" << Location::path(fileId) << msg->key() << job->id << job.get();
@@ -674,11 +660,11 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
             });
     }
 
-    Set<uint32_t> visited = msg->visitedFiles();
     updateFixIts(visited, msg->fixIts());
     updateDependencies(msg);
     if (success) {
         src->second.parsed = msg->parseTime();
+        publishLater(PublishSources);
         error("[%3d%%] %d/%d %s %s. (%s)",
               static_cast<int>(round((double(idx) / double(mJobCounter)) * 100.0)), idx, mJobCounter,
               String::formatTime(time(0), String::Time).constData(),
@@ -695,6 +681,10 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     }
 
     save();
+    if (options.fileMapSyncBatchSize && (++mUnsyncedJobs >= options.fileMapSyncBatchSize || mActiveJobs.isEmpty())) {
+        mUnsyncedJobs = 0;
+        Server::instance()->syncFileSystem(mSourceFilePathBase);
+    }
     if (mActiveJobs.isEmpty()) {
         double timerElapsed = (mTimer.elapsed() / 1000.0);
         const double averageJobTime = timerElapsed / mJobsStarted;
@@ -776,16 +766,193 @@ bool Project::save()
             }
         }
         file << mDiagnostics;
-        saveDependencies(file, mDependencies);
+        if (mDependencies.needsCompaction()) {
+            // published copies keep the old mapping alive
+            String err;
+            if (!mDependencies.compact(mDependenciesFilePath, &err))
+                error("Save error %s: %s", mPath.constData(), err.constData());
+        }
+        file << mDependencies;
         if (!file.flush()) {
             error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
             return false;
         }
     }
 
+    {
+        // only now that the project file carries the new stamp
+        String err;
+        if (!mDependencies.commitCompaction(mDependenciesFilePath, &err))
+            error("Save error %s: %s", mPath.constData(), err.constData());
+    }
+
     return true;
 }
 
+void Project::saveHotFiles()
+{
+    enum { MaxHotMaps = 4096 };
+    Hash<uint64_t, uint32_t> hits;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mFileMapHitsChanged)
+            return;
+        mFileMapHitsChanged = false;
+        if (mFileMapHits.size() > MaxHotMaps) {
+            List<std::pair<uint32_t, uint64_t> > sorted;
+            sorted.reserve(mFileMapHits.size());
+            for (const auto &hit : mFileMapHits)
+                sorted.append(std::make_pair(hit.second, hit.first));
+            std::nth_element(sorted.begin(), sorted.begin() + MaxHotMaps, sorted.end(),
+                             std::greater<std::pair<uint32_t, uint64_t> >());
+            sorted.resize(MaxHotMaps);
+            mFileMapHits.clear();
+            for (const auto &hit : sorted)
+                mFileMapHits[hit.second] = hit.first;
+        }
+        hits = mFileMapHits;
+    }
+    if (hits.isEmpty())
+        return;
+    DataFile file(mHotFilesPath, RTags::DatabaseVersion);
+    if (!file.open(DataFile::Write)) {
+        error("Save error %s: %s", mHotFilesPath.constData(), file.error().constData());
+        return;
+    }
+    file << hits;
+    if (!file.flush())
+        error("Save error %s: %s", mHotFilesPath.constData(), file.error().constData());
+}
+
+void Project::prefetch()
+{
+    cancelPrefetch();
+    const size_t budget = static_cast<size_t>(Server::instance()->options().prefetchBudget) * 1024 * 1024;
+    if (!budget)
+        return;
+
+    List<std::pair<uint32_t, uint64_t> > hot;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        hot.reserve(mFileMapHits.size());
+        for (const auto &hit : mFileMapHits)
+            hot.append(std::make_pair(hit.second, hit.first));
+    }
+    std::sort(hot.begin(), hot.end(), std::greater<std::pair<uint32_t, uint64_t> >());
+
+    // Only the maps that were queried, e.g. tokens only if someone ran rc
+    // --tokens. Maps that don't exist are skipped by the thread without
+    // using any of the budget.
+    List<Path> paths;
+    for (const auto &map : hot) {
+        const uint32_t fileId = map.second >> 32;
+        if (!mDependencies.contains(fileId))
+            continue;
+        paths.append(sourceFilePath(fileId, fileMapName(static_cast<FileMapType>(map.second & 0xffffffff))));
+    }
+    if (paths.isEmpty())
+        return;
+
+    mPrefetchCancelled.reset(new std::atomic<bool>(false));
+    PrefetchThread *thread = new PrefetchThread(std::move(paths), budget, mPrefetchCancelled);
+    thread->setAutoDelete(true);
+    thread->start();
+}
+
+static uint64_t directorySize(const Path &dir)
+{
+    uint64_t ret = 0;
+    dir.visit([&ret](const Path &path) {
+            if (path.isDir())
+                return Path::Recurse;
+            ret += path.fileSize();
+            return Path::Continue;
+        });
+    return ret;
+}
+
+void Project::collectGarbage(FileIdSet &referenced, int &removedDirectories, int &removedFiles, uint64_t &removedBytes)
+{
+    assert(!isIndexing());
+    auto removeTemporaryFiles = [&removedFiles, &removedBytes](const Path &dir) {
+        for (const Path &file : dir.files(Path::File)) {
+            if (!file.endsWith(".tmp"))
+                continue;
+            const uint64_t size = file.fileSize();
+            if (Path::rm(file)) {
+                ++removedFiles;
+                removedBytes += size;
+            }
+        }
+    };
+
+    FileIdSet fileIds;
+    for (uint32_t fileId : mDependencies.fileIds())
+        fileIds.insert(fileId);
+    for (const auto &source : mSources) {
+        fileIds.insert(source.second.fileId);
+        referenced.insert(source.second.compilerId);
+        referenced.insert(source.second.buildRootId);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const auto &visited : mVisitedFiles)
+            referenced.insert(visited.first);
+    }
+    referenced.unite(fileIds);
+    referenced.unite(mSuspendedFiles);
+    referenced.unite(mPendingDirtyFiles);
+
+    removeTemporaryFiles(mSourceFilePathBase);
+    for (const Path &dir : mSourceFilePathBase.files(Path::Directory)) {
+        String name = dir.mid(mSourceFilePathBase.size());
+        if (name.endsWith('/'))
+            name.chop(1);
+        bool ok;
+        const uint32_t fileId = name.toULong(&ok);
+        if (!ok || !fileId)
+            continue;
+        if (fileIds.contains(fileId)) {
+            removeTemporaryFiles(dir);
+            continue;
+        }
+        // only what gets removed is measured
+        const uint64_t size = directorySize(dir);
+        if (Rct::removeDirectory(dir)) {
+            mFileMapCache.invalidate(fileId);
+            mQueryCache.invalidate(fileId);
+            warning() << "Removed orphaned" << dir << Location::path(fileId);
+            ++removedDirectories;
+            removedBytes += size;
+        }
+    }
+}
+
+bool Project::restoreSnapshot(Sources &&sources, Hash<Path, CompilationDataBaseInfo> &&infos,
+                              Diagnostics &&diagnostics, const Hash<uint32_t, List<uint32_t> > &includes)
+{
+    mSources = std::move(sources);
+    mCompilationDatabaseInfos = std::move(infos);
+    mDiagnostics = std::move(diagnostics);
+    mFileMapCache.clear();
+    mQueryCache.clear();
+    mTokenCache.clear();
+    mDependencies.clear();
+    for (const auto &node : includes) {
+        mDependencies.insert(node.first);
+        for (uint32_t inc : node.second)
+            mDependencies.include(node.first, inc);
+    }
+    publishLater(PublishDependencies|PublishSources);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mVisitedFiles.clear();
+        for (uint32_t fileId : mDependencies.fileIds())
+            mVisitedFiles[fileId] = Location::path(fileId);
+    }
+    return save();
+}
+
 static inline void markActive(Sources::iterator start, uint32_t buildId, const Sources::iterator end)
 {
     const uint32_t fileId = start->second.fileId;
@@ -819,6 +986,7 @@ void Project::index(const std::shared_ptr<IndexerJob> &job)
     if (Server::instance()->suspended() && mSources.contains(key) && (job->flags & IndexerJob::Compile)) {
         return;
     }
+    publishLater(PublishSources);
 
     if (job->flags & IndexerJob::Compile) {
         const auto &options = Server::instance()->options();
@@ -936,6 +1104,7 @@ void Project::onFileRemoved(const Path &file)
     if (!fileId)
         return;
     Rct::removeDirectory(Project::sourceFilePath(fileId));
+    mQueryCache.invalidate(fileId);
 
     const uint64_t key = Source::key(fileId, 0);
     for (auto it = mSources.lower_bound(key); it != mSources.end(); ++it) {
@@ -964,7 +1133,7 @@ void Project::onFileRemoved(const Path &file)
 
 void Project::onDirtyTimeout(Timer *)
 {
-    Set<uint32_t> dirtyFiles = std::move(mPendingDirtyFiles);
+    FileIdSet dirtyFiles = std::move(mPendingDirtyFiles);
     WatcherDirty dirty(shared_from_this(), dirtyFiles);
     const int dirtied = startDirtyJobs(&dirty, IndexerJob::Dirty);
     debug() << "onDirtyTimeout" << dirtyFiles << dirtied;
@@ -974,8 +1143,9 @@ List<Source> Project::sources(uint32_t fileId) const
 {
     List<Source> ret;
     if (fileId) {
-        auto it = mSources.lower_bound(Source::key(fileId, 0));
-        while (it != mSources.end()) {
+        const std::shared_ptr<const Sources> sources = sourcesView();
+        auto it = sources->lower_bound(Source::key(fileId, 0));
+        while (it != sources->end()) {
             uint32_t f, b;
             Source::decodeKey(it->first, f, b);
             if (f != fileId)
@@ -989,8 +1159,9 @@ List<Source> Project::sources(uint32_t fileId) const
 
 bool Project::hasSource(uint32_t fileId) const
 {
-    auto it = mSources.lower_bound(Source::key(fileId, 0));
-    while (it != mSources.end()) {
+    const std::shared_ptr<const Sources> sources = sourcesView();
+    auto it = sources->lower_bound(Source::key(fileId, 0));
+    while (it != sources->end()) {
         uint32_t f, b;
         Source::decodeKey(it->first, f, b);
         return f == fileId;
@@ -998,86 +1169,86 @@ bool Project::hasSource(uint32_t fileId) const
     return false;
 }
 
-Set<uint32_t> Project::dependencies(uint32_t fileId, DependencyMode mode) const
+FileIdSet Project::dependencies(uint32_t fileId, DependencyMode mode) const
 {
-    Set<uint32_t> ret;
+    const std::shared_ptr<const DependencyGraph> graph = dependencyView();
+    FileIdSet ret = *graph->closure(fileId, mode == ArgDependsOn ? DependencyGraph::Includes : DependencyGraph::Dependents);
     ret.insert(fileId);
-    std::function<void(uint32_t)> fill = [&](uint32_t fileId) {
-        if (DependencyNode *node = mDependencies.value(fileId)) {
-            const auto &nodes = (mode == ArgDependsOn ? node->includes : node->dependents);
-            for (const auto &it : nodes) {
-                if (ret.insert(it.first))
-                    fill(it.first);
-            }
-        }
-    };
-    fill(fileId);
     return ret;
 }
 
 bool Project::dependsOn(uint32_t source, uint32_t header) const
 {
-    Set<uint32_t> seen;
-    std::function<bool(DependencyNode *node)> dep = [&](DependencyNode *node) {
-        assert(node);
-        if (!seen.insert(node->fileId))
-            return false;
-        if (node->dependents.contains(source))
-            return true;
-        for (const std::pair<uint32_t, DependencyNode*> &n : node->dependents) {
-            if (dep(n.second))
-                return true;
-        }
-        return false;
-    };
-    DependencyNode *node = mDependencies.value(header);
-    return node && dep(node);
+    const std::shared_ptr<const DependencyGraph> graph = dependencyView();
+    return graph->contains(header) && graph->closure(header, DependencyGraph::Dependents)->contains(source);
+}
+
+List<uint32_t> Project::dependencyFileIds() const
+{
+    return dependencyView()->fileIds();
+}
+
+void Project::publishLater(unsigned int flags)
+{
+    assert(EventLoop::isMainThread());
+    if (!mUnpublished) {
+        std::weak_ptr<Project> weak = shared_from_this();
+        EventLoop::mainEventLoop()->callLater([weak]() {
+                if (std::shared_ptr<Project> project = weak.lock())
+                    project->publish();
+            });
+    }
+    mUnpublished |= flags;
+}
+
+void Project::publish()
+{
+    assert(EventLoop::isMainThread());
+    if (mUnpublished & PublishDependencies)
+        std::atomic_store(&mPublishedDependencies, std::shared_ptr<const DependencyGraph>(new DependencyGraph(mDependencies)));
+    if (mUnpublished & PublishSources)
+        std::atomic_store(&mPublishedSources, std::shared_ptr<const Sources>(new Sources(mSources)));
+    mUnpublished = 0;
+}
+
+std::shared_ptr<const DependencyGraph> Project::dependencyView() const
+{
+    if (EventLoop::isMainThread()) // doesn't own anything
+        return std::shared_ptr<const DependencyGraph>(std::shared_ptr<const DependencyGraph>(), &mDependencies);
+    return std::atomic_load(&mPublishedDependencies);
+}
+
+std::shared_ptr<const Sources> Project::sourcesView() const
+{
+    if (EventLoop::isMainThread())
+        return std::shared_ptr<const Sources>(std::shared_ptr<const Sources>(), &mSources);
+    return std::atomic_load(&mPublishedSources);
 }
 
 void Project::removeDependencies(uint32_t fileId)
 {
-    if (DependencyNode *node = mDependencies.take(fileId)) {
-        for (auto it : node->includes)
-            it.second->dependents.remove(fileId);
-        for (auto it : node->dependents)
-            it.second->includes.remove(fileId);
-        delete node;
+    if (mDependencies.remove(fileId)) {
+        mQueryCache.invalidate(fileId);
+        publishLater(PublishDependencies);
     }
 }
 
 void Project::updateDependencies(const std::shared_ptr<IndexDataMessage> &msg)
 {
     const bool prune = !(msg->flags() & (IndexDataMessage::InclusionError|IndexDataMessage::ParseFailure));
-    Set<uint32_t> files;
+    publishLater(PublishDependencies);
     for (auto pair : msg->files()) {
-        DependencyNode *&node = mDependencies[pair.first];
-        if (!node) {
-            node = new DependencyNode(pair.first);
-            if (pair.second & IndexDataMessage::Visited)
-                files.insert(pair.first);
+        if (!mDependencies.contains(pair.first)) {
+            mDependencies.insert(pair.first);
         } else if (pair.second & IndexDataMessage::Visited) {
-            files.insert(pair.first);
-            if (prune) {
-                for (auto it : node->includes)
-                    it.second->dependents.remove(pair.first);
-                node->includes.clear();
-            }
+            if (prune)
+                mDependencies.clearIncludes(pair.first);
         }
         watchFile(pair.first);
     }
 
-    // // ### this probably deletes and recreates the same nodes very very often
-    for (auto it : msg->includes()) {
-        DependencyNode *&includer = mDependencies[it.first];
-        DependencyNode *&inclusiary = mDependencies[it.second];
-        files.insert(it.first);
-        files.insert(it.second);
-        if (!includer)
-            includer = new DependencyNode(it.first);
-        if (!inclusiary)
-            inclusiary = new DependencyNode(it.second);
-        includer->include(inclusiary);
-    }
+    for (auto it : msg->includes())
+        mDependencies.include(it.first, it.second);
 }
 
 int Project::reindex(const Match &match,
@@ -1085,12 +1256,11 @@ int Project::reindex(const Match &match,
                      const std::shared_ptr<Connection> &wait)
 {
     if (query->type() == QueryMessage::Reindex) {
-        Set<uint32_t> dirtyFiles;
+        FileIdSet dirtyFiles;
 
-        const auto end = mDependencies.constEnd();
-        for (auto it = mDependencies.constBegin(); it != end; ++it) {
-            if (!dirtyFiles.contains(it->first) && (match.isEmpty() || match.match(Location::path(it->first)))) {
-                dirtyFiles.insert(it->first);
+        for (uint32_t fileId : mDependencies.fileIds()) {
+            if (!dirtyFiles.contains(fileId) && (match.isEmpty() || match.match(Location::path(fileId)))) {
+                dirtyFiles.insert(fileId);
             }
         }
         if (dirtyFiles.isEmpty())
@@ -1132,7 +1302,7 @@ int Project::startDirtyJobs(Dirty *dirty, IndexerJob::Flag flag,
             toIndex << source.second;
         }
     }
-    const Set<uint32_t> dirtyFiles = dirty->dirtied();
+    const FileIdSet dirtyFiles = dirty->dirtied();
 
     {
         std::lock_guard<std::mutex> lock(mMutex);
@@ -1165,15 +1335,7 @@ bool Project::isIndexed(uint32_t fileId) const
             return true;
     }
 
-    const uint64_t key = Source::key(fileId, 0);
-    auto it = mSources.lower_bound(key);
-    if (it != mSources.end()) {
-        uint32_t f, b;
-        Source::decodeKey(it->first, f, b);
-        if (f == fileId)
-            return true;
-    }
-    return false;
+    return hasSource(fileId);
 }
 
 const Set<uint32_t> &Project::suspendedFiles() const
@@ -1200,7 +1362,7 @@ bool Project::isSuspended(uint32_t file) const
     return mSuspendedFiles.contains(file);
 }
 
-void Project::updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts)
+void Project::updateFixIts(const FileIdSet &visited, FixIts &fixIts)
 {
     for (auto v : visited) {
         const auto fit = fixIts.find(v);
@@ -1258,10 +1420,26 @@ String Project::fixIts(uint32_t fileId) const
     return out;
 }
 
+// The files of a scan that acceptFile, if set, lets through
+static List<uint32_t> acceptedFiles(List<uint32_t> &&files, const std::function<bool(uint32_t)> &acceptFile)
+{
+    if (acceptFile) {
+        size_t out = 0;
+        for (size_t i=0; i<files.size(); ++i) {
+            if (acceptFile(files.at(i)))
+                files[out++] = files.at(i);
+        }
+        files.resize(out);
+    }
+    return std::move(files);
+}
+
 void Project::findSymbols(const String &string,
                           const std::function<void(SymbolMatchType, const String &, const Set<Location> &)> &inserter,
                           Flags<QueryMessage::Flag> queryFlags,
-                          uint32_t fileFilter)
+                          uint32_t fileFilter,
+                          const CancellationToken *cancel,
+                          const std::function<bool(uint32_t)> &acceptFile)
 {
     const bool wildcard = queryFlags & QueryMessage::WildcardSymbolNames && (string.contains('*') || string.contains('?'));
     const bool caseInsensitive = queryFlags & QueryMessage::MatchCaseInsensitive;
@@ -1281,7 +1459,12 @@ void Project::findSymbols(const String &string,
         lowerBound = string;
     }
 
-    auto processFile = [this, &lowerBound, &string, wildcard, cs, &inserter](uint32_t file) {
+    struct Match {
+        SymbolMatchType type;
+        String symbolName;
+        Set<Location> locations;
+    };
+    auto processFile = [this, &lowerBound, &string, wildcard, cs](uint32_t file, List<Match> &matches) {
         auto symNames = openSymbolNames(file);
         if (!symNames)
             return;
@@ -1319,17 +1502,21 @@ void Project::findSymbols(const String &string,
                     type = StartsWith;
                 }
             }
-            inserter(type, entry, symNames->valueAt(i));
+            matches.append(Match { type, entry, symNames->valueAt(i) });
         }
     };
+    auto merge = [&inserter](List<Match> &matches) {
+        for (const Match &match : matches)
+            inserter(match.type, match.symbolName, match.locations);
+    };
 
+    List<uint32_t> files;
     if (fileFilter) {
-        processFile(fileFilter);
+        files.append(fileFilter);
     } else {
-        for (const auto &dep : mDependencies) {
-            processFile(dep.first);
-        }
+        files = acceptedFiles(dependencyFileIds(), acceptFile);
     }
+    ParallelScan::scan<List<Match> >(files, cancel, processFile, merge);
 }
 
 List<RTags::SortedSymbol> Project::sort(const Set<Symbol> &symbols, Flags<QueryMessage::Flag> flags)
@@ -1480,7 +1667,7 @@ Symbol Project::findSymbol(Location location, int *index)
     return ret;
 }
 
-Set<Symbol> Project::findTargets(const Symbol &symbol)
+Set<Symbol> Project::findTargets(const Symbol &symbol, const CancellationToken *cancel)
 {
     Set<Symbol> ret;
     if (symbol.isNull() || symbol.flags & Symbol::ImplicitDestruction)
@@ -1507,7 +1694,7 @@ Set<Symbol> Project::findTargets(const Symbol &symbol)
     case CXCursor_VarDecl:
     case CXCursor_FunctionTemplate: {
         const Set<Symbol> symbols = findByUsr(symbol.usr, symbol.location.fileId(),
-                                              symbol.isDefinition() ? ArgDependsOn : DependsOnArg, symbol.location);
+                                              symbol.isDefinition() ? ArgDependsOn : DependsOnArg, symbol.location, cancel);
         for (const auto &c : symbols) {
             if (sameKind(c.kind) && symbol.isDefinition() != c.isDefinition()) {
                 ret.insert(c);
@@ -1520,7 +1707,7 @@ Set<Symbol> Project::findTargets(const Symbol &symbol)
         // fall through
     default:
         for (const String &usr : findTargetUsrs(symbol.location)) {
-            ret.unite(findByUsr(usr, symbol.location.fileId(), Project::ArgDependsOn));
+            ret.unite(findByUsr(usr, symbol.location.fileId(), Project::ArgDependsOn, Location(), cancel));
         }
         break;
     }
@@ -1528,11 +1715,14 @@ Set<Symbol> Project::findTargets(const Symbol &symbol)
     return ret;
 }
 
-Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMode mode, Location filtered)
+Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMode mode, Location filtered,
+                               const CancellationToken *cancel, const std::function<bool(uint32_t)> &acceptFile)
 {
     assert(fileId);
     Set<Symbol> ret;
     for (uint32_t file : dependencies(fileId, mode)) {
+        if (CancellationToken::isCancelled(cancel))
+            return ret;
         auto usrs = openUsrs(file);
         // error() << usrs << Location::path(file) << usr;
         if (usrs) {
@@ -1550,18 +1740,22 @@ Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMod
         }
     }
     if (ret.isEmpty() || (!filtered.isNull() && ret.size() == 1 && ret.begin()->location == filtered)) {
-        for (const auto &dep : mDependencies) {
-            auto usrs = openUsrs(dep.first);
-            if (usrs) {
-                // SBROOT
-                String tusr = Sandbox::encoded(usr);
-                for (Location loc : usrs->value(tusr)) {
-                    const Symbol c = findSymbol(loc);
-                    if (!c.isNull())
-                        ret.insert(c);
+        // SBROOT
+        const String tusr = Sandbox::encoded(usr);
+        ParallelScan::scan<Set<Symbol> >(acceptedFiles(dependencyFileIds(), acceptFile), cancel, [this, &tusr](uint32_t fileId, Set<Symbol> &found) {
+                auto usrs = openUsrs(fileId);
+                if (usrs) {
+                    for (Location loc : usrs->value(tusr)) {
+                        const Symbol c = findSymbol(loc);
+                        if (!c.isNull())
+                            found.insert(c);
+                    }
                 }
-            }
-        }
+            }, [&ret](Set<Symbol> &found) {
+                ret.unite(found);
+            });
+        if (CancellationToken::isCancelled(cancel))
+            return ret;
     }
 
     if (ret.isEmpty() && usr.startsWith("/")) { // for break statements and includes
@@ -1576,37 +1770,47 @@ Set<Symbol> Project::findByUsr(const String &usr, uint32_t fileId, DependencyMod
 
 static Set<Symbol> findReferences(const Set<Symbol> &inputs,
                                   const std::shared_ptr<Project> &project,
-                                  std::function<bool(const Symbol &, const Symbol &)> filter)
+                                  std::function<bool(const Symbol &, const Symbol &)> filter,
+                                  const CancellationToken *cancel,
+                                  const std::function<bool(uint32_t)> &acceptFile)
 {
     Set<Symbol> ret;
     // const bool isClazz = s.isClass();
     for (const Symbol &input : inputs) {
         //warning() << "Calling findReferences" << input.location;
-        auto process = [&](uint32_t dep) {
+        // SBROOT
+        const String tusr = Sandbox::encoded(input.usr);
+        auto process = [&](uint32_t dep, Set<Symbol> &found) {
             // error() << "Looking at file" << Location::path(dep) << "for input" << input.location;
             auto targets = project->openTargets(dep);
             if (targets) {
-                // SBROOT
-                String tusr = Sandbox::encoded(input.usr);
                 const Set<Location> locations = targets->value(tusr);
                 // error() << "Got locations for usr" << input.usr << locations;
                 for (const auto &loc : locations) {
                     auto sym = project->findSymbol(loc);
                     if (filter(input, sym))
-                        ret.insert(sym);
+                        found.insert(sym);
                 }
             }
         };
-        const Set<uint32_t> seen = project->dependencies(input.location.fileId(), Project::DependsOnArg);
-        for (auto dep : seen)
-            process(dep);
+        auto merge = [&ret](Set<Symbol> &found) {
+            ret.unite(found);
+        };
+        // the references are in the files whose targets are opened so
+        // those the query's path filters reject can be left out
+        const FileIdSet seen = project->dependencies(input.location.fileId(), Project::DependsOnArg);
+        ParallelScan::scan<Set<Symbol> >(acceptedFiles(seen.toList(), acceptFile), cancel, process, merge);
 
         if (ret.isEmpty()) {
-            for (auto dep : project->dependencies()) {
-                if (!seen.contains(dep.first))
-                    process(dep.first);
+            List<uint32_t> rest;
+            for (uint32_t dep : project->dependencyFileIds()) {
+                if (!seen.contains(dep))
+                    rest.append(dep);
             }
+            ParallelScan::scan<Set<Symbol> >(acceptedFiles(std::move(rest), acceptFile), cancel, process, merge);
         }
+        if (CancellationToken::isCancelled(cancel))
+            return ret;
     }
     return ret;
 }
@@ -1614,12 +1818,14 @@ static Set<Symbol> findReferences(const Set<Symbol> &inputs,
 static Set<Symbol> findReferences(const Symbol &in,
                                   const std::shared_ptr<Project> &project,
                                   std::function<bool(const Symbol &, const Symbol &)> filter,
+                                  const CancellationToken *cancel,
+                                  const std::function<bool(uint32_t)> &acceptFile,
                                   Set<Symbol> *inputsPtr = 0)
 {
     Set<Symbol> inputs;
     Symbol s;
     if (in.isReference()) {
-        const Symbol target = project->findTarget(in);
+        const Symbol target = project->findTarget(in, cancel);
         if (!target.isNull()) {
             s = target;
         } else {
@@ -1633,7 +1839,7 @@ static Set<Symbol> findReferences(const Symbol &in,
     switch (s.kind) {
     case CXCursor_CXXMethod:
         if (s.flags & Symbol::VirtualMethod) {
-            inputs = project->findVirtuals(s);
+            inputs = project->findVirtuals(s, cancel, acceptFile);
             break;
         }
         // fall through
@@ -1652,7 +1858,7 @@ static Set<Symbol> findReferences(const Symbol &in,
     case CXCursor_NamespaceAlias:
         inputs = project->findByUsr(s.usr, s.location.fileId(),
                                     s.isDefinition() ? Project::ArgDependsOn : Project::DependsOnArg,
-                                    in.location);
+                                    in.location, cancel, acceptFile);
         break;
     default:
         inputs.insert(s);
@@ -1662,10 +1868,11 @@ static Set<Symbol> findReferences(const Symbol &in,
     }
     if (inputsPtr)
         *inputsPtr = inputs;
-    return findReferences(inputs, project, filter);
+    return findReferences(inputs, project, filter, cancel, acceptFile);
 }
 
-Set<Symbol> Project::findCallers(const Symbol &symbol)
+Set<Symbol> Project::findCallers(const Symbol &symbol, const CancellationToken *cancel,
+                                 const std::function<bool(uint32_t)> &acceptFile)
 {
     const bool isClazz = symbol.isClass();
     return ::findReferences(symbol, shared_from_this(), [isClazz](const Symbol &input, const Symbol &ref) {
@@ -1679,36 +1886,40 @@ Set<Symbol> Project::findCallers(const Symbol &symbol)
                 return true;
             }
             return false;
-        });
+        }, cancel, acceptFile);
 }
 
-Set<Symbol> Project::findAllReferences(const Symbol &symbol)
+Set<Symbol> Project::findAllReferences(const Symbol &symbol, const CancellationToken *cancel,
+                                       const std::function<bool(uint32_t)> &acceptFile)
 {
     if (symbol.isNull())
         return Set<Symbol>();
 
     Set<Symbol> inputs;
     inputs.insert(symbol);
-    inputs.unite(findByUsr(symbol.usr, symbol.location.fileId(), DependsOnArg, symbol.location));
+    inputs.unite(findByUsr(symbol.usr, symbol.location.fileId(), DependsOnArg, symbol.location, cancel, acceptFile));
     Set<Symbol> ret = inputs;
     for (const auto &input : inputs) {
+        if (CancellationToken::isCancelled(cancel))
+            break;
         Set<Symbol> inputLocations;
         ret.unite(::findReferences(input, shared_from_this(), [](const Symbol &, const Symbol &) {
                     return true;
-                }, &inputLocations));
+                }, cancel, acceptFile, &inputLocations));
         ret.unite(inputLocations);
     }
     return ret;
 }
 
-Set<Symbol> Project::findVirtuals(const Symbol &symbol)
+Set<Symbol> Project::findVirtuals(const Symbol &symbol, const CancellationToken *cancel,
+                                  const std::function<bool(uint32_t)> &acceptFile)
 {
     if (symbol.kind != CXCursor_CXXMethod || !(symbol.flags & Symbol::VirtualMethod))
         return Set<Symbol>();
 
-    Symbol parent = [this](const Symbol &symbol) {
+    Symbol parent = [this, cancel](const Symbol &symbol) {
         for (const String &usr : findTargetUsrs(symbol.location)) {
-            const Set<Symbol> syms = findByUsr(usr, symbol.location.fileId(), ArgDependsOn);
+            const Set<Symbol> syms = findByUsr(usr, symbol.location.fileId(), ArgDependsOn, Location(), cancel);
             for (const Symbol &sym : syms) {
                 if (findTargetUsrs(sym.location).isEmpty()) {
                     return sym;
@@ -1720,7 +1931,7 @@ Set<Symbol> Project::findVirtuals(const Symbol &symbol)
 
     assert(!parent.isNull());
     if (parent.isDefinition()) {
-        const auto target = findTarget(parent);
+        const auto target = findTarget(parent, cancel);
         if (!target.isNull()) {
             parent = target;
         }
@@ -1734,9 +1945,9 @@ Set<Symbol> Project::findVirtuals(const Symbol &symbol)
                 return true;
             }
             return false;
-        });
+        }, cancel, acceptFile);
     ret.insert(parent);
-    const Symbol target = findTarget(parent);
+    const Symbol target = findTarget(parent, cancel);
     if (!target.isNull())
         ret.insert(target);
     return ret;
@@ -1759,11 +1970,13 @@ Set<String> Project::findTargetUsrs(Location loc)
     return usrs;
 }
 
-Set<Symbol> Project::findSubclasses(const Symbol &symbol)
+Set<Symbol> Project::findSubclasses(const Symbol &symbol, const CancellationToken *cancel)
 {
     assert(symbol.isClass() && symbol.isDefinition());
     Set<Symbol> ret;
     for (uint32_t dep : dependencies(symbol.location.fileId(), DependsOnArg)) {
+        if (CancellationToken::isCancelled(cancel))
+            break;
         auto symbols = openSymbols(dep);
         if (symbols) {
             const int count = symbols->count();
@@ -1777,26 +1990,14 @@ Set<Symbol> Project::findSubclasses(const Symbol &symbol)
     return ret;
 }
 
-void Project::beginScope()
-{
-    assert(!mFileMapScope);
-    mFileMapScope.reset(new FileMapScope(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize));
-}
-
-void Project::endScope()
-{
-    assert(mFileMapScope);
-    mFileMapScope.reset();
-}
-
-static String addDeps(const Dependencies &deps)
+static String addDeps(const DependencyGraph::Edges &deps)
 {
     if (deps.isEmpty())
         return "nil";
     String ret;
     ret << "(list";
-    for (const auto &dep : deps) {
-        ret << " \"" << Location::path(dep.first) << "\"";
+    for (uint32_t dep : deps) {
+        ret << " \"" << Location::path(dep) << "\"";
     }
     ret << ")";
     return ret;
@@ -1806,38 +2007,41 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
 {
     String ret;
 
-    auto dumpRaw = [&ret, flags](DependencyNode *n) {
+    auto dumpRaw = [this, &ret, flags](uint32_t n) {
+        const DependencyGraph::Edges includes = mDependencies.includes(n);
+        const DependencyGraph::Edges dependents = mDependencies.dependents(n);
         if (!(flags & QueryMessage::Elisp)) {
-            ret << Location::path(n->fileId) << "\n";
-            for (const auto &inc : n->includes) {
-                ret << "  " << Location::path(inc.second->fileId) << "\n";
+            ret << Location::path(n) << "\n";
+            for (uint32_t inc : includes) {
+                ret << "  " << Location::path(inc) << "\n";
             }
-            for (const auto &dep : n->dependents) {
-                ret << "    " << Location::path(dep.second->fileId) << "\n";
+            for (uint32_t dep : dependents) {
+                ret << "    " << Location::path(dep) << "\n";
             }
             return;
         }
 
-        ret << " (cons \"" << Location::path(n->fileId) << "\" (cons " << addDeps(n->includes) << ' ' << addDeps(n->dependents) << "))\n";
+        ret << " (cons \"" << Location::path(n) << "\" (cons " << addDeps(includes) << ' ' << addDeps(dependents) << "))\n";
     };
 
     if (fileId) {
-        DependencyNode *node = mDependencies.value(fileId);
-        if (!node)
+        if (!mDependencies.contains(fileId))
             return String::format<128>("Can't find node for %s", Location::path(fileId).constData());
 
-        if (!node->includes.isEmpty() && (args.isEmpty() || args.contains("includes"))) {
+        const DependencyGraph::Edges includes = mDependencies.includes(fileId);
+        const DependencyGraph::Edges dependents = mDependencies.dependents(fileId);
+        if (!includes.isEmpty() && (args.isEmpty() || args.contains("includes"))) {
             if (args.size() != 1)
                 ret += String::format<256>("  %s includes:\n", Location::path(fileId).constData());
-            for (const auto &include : node->includes) {
-                ret += String::format<256>("    %s\n", Location::path(include.first).constData());
+            for (uint32_t include : includes) {
+                ret += String::format<256>("    %s\n", Location::path(include).constData());
             }
         }
-        if (!node->dependents.isEmpty() && (args.isEmpty() || args.contains("included-by"))) {
+        if (!dependents.isEmpty() && (args.isEmpty() || args.contains("included-by"))) {
             if (args.size() != 1)
                 ret += String::format<256>("  %s is included by:\n", Location::path(fileId).constData());
-            for (const auto &include : node->dependents) {
-                ret += String::format<256>("    %s\n", Location::path(include.first).constData());
+            for (uint32_t include : dependents) {
+                ret += String::format<256>("    %s\n", Location::path(include).constData());
             }
         }
 
@@ -1868,44 +2072,41 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
         }
 
         if (args.isEmpty() || args.contains("tree-depends-on")) {
-            Set<DependencyNode*> seen;
-
-            DependencyNode *node = mDependencies.value(fileId);
-            if (node) {
-                int startDepth = 1;
-                if (args.size() != 1) {
-                    ++startDepth;
-                    ret += String::format<256>("  %s include tree:\n", Location::path(fileId).constData());
-                }
+            Set<uint32_t> seen;
 
-                std::function<void(DependencyNode *, int)> process = [&](DependencyNode *n, int depth) {
-                    ret += String::format<256>("%s%s", String(depth * 2, ' ').constData(), Location::path(n->fileId).constData());
+            int startDepth = 1;
+            if (args.size() != 1) {
+                ++startDepth;
+                ret += String::format<256>("  %s include tree:\n", Location::path(fileId).constData());
+            }
 
-                    if (seen.insert(n) && !n->includes.isEmpty()) {
-                        ret += " includes:\n";
-                        for (const auto &node : n->includes) {
-                            process(node.second, depth + 1);
-                        }
-                    } else {
-                        ret += '\n';
+            std::function<void(uint32_t, int)> process = [&](uint32_t n, int depth) {
+                ret += String::format<256>("%s%s", String(depth * 2, ' ').constData(), Location::path(n).constData());
+
+                const DependencyGraph::Edges includes = mDependencies.includes(n);
+                if (seen.insert(n) && !includes.isEmpty()) {
+                    ret += " includes:\n";
+                    for (uint32_t node : includes) {
+                        process(node, depth + 1);
                     }
-                };
-                process(node, startDepth);
-            }
+                } else {
+                    ret += '\n';
+                }
+            };
+            process(fileId, startDepth);
         }
         if (args.size() == 1 && args.contains("raw")) {
-            Set<DependencyNode*> all;
-            std::function<void(DependencyNode *node)> add = [&](DependencyNode *node) {
-                assert(node);
+            Set<uint32_t> all;
+            std::function<void(uint32_t node)> add = [&](uint32_t node) {
                 if (!all.insert(node))
                     return;
-                for (const std::pair<uint32_t, DependencyNode*> &n : node->includes) {
-                    add(n.second);
+                for (uint32_t n : mDependencies.includes(node)) {
+                    add(n);
                 }
             };
-            add(node);
+            add(fileId);
             ret << "(list\n";
-            for (DependencyNode *n : all) {
+            for (uint32_t n : all) {
                 dumpRaw(n);
             }
             ret.chop(1);
@@ -1913,8 +2114,8 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
         }
     } else {
         ret << "(list\n";
-        for (const auto &node : mDependencies) {
-            dumpRaw(node.second);
+        for (uint32_t node : mDependencies.fileIds()) {
+            dumpRaw(node);
         }
         ret.chop(1);
         ret << ")\n";
@@ -1926,7 +2127,7 @@ String Project::dumpDependencies(uint32_t fileId, const List<String> &args, Flag
 void Project::dirty(uint32_t fileId)
 {
     SimpleDirty dirty;
-    Set<uint32_t> dirtyFiles;
+    FileIdSet dirtyFiles;
     dirtyFiles.insert(fileId);
     dirty.init(dirtyFiles, shared_from_this());
     startDirtyJobs(&dirty, IndexerJob::Dirty);
@@ -1982,6 +2183,15 @@ bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
 
 void Project::loadFailed(uint32_t fileId)
 {
+    if (!EventLoop::isMainThread()) {
+        std::weak_ptr<Project> weak = shared_from_this();
+        EventLoop::mainEventLoop()->callLater([weak, fileId]() {
+                if (std::shared_ptr<Project> project = weak.lock())
+                    project->loadFailed(fileId);
+            });
+        return;
+    }
+
     const Path sourcePath = Location::path(fileId);
     if (sourcePath.isSource()) {
         if (Server::instance()->jobScheduler()->increasePriority(fileId))
@@ -2133,7 +2343,6 @@ static String formatTable(const String &name, const std::shared_ptr<FileMap<Key,
 
 void Project::dumpFileMaps(const std::shared_ptr<QueryMessage> &msg, const std::shared_ptr<Connection> &conn)
 {
-    beginScope();
     String err;
 
     Path path;
@@ -2177,28 +2386,25 @@ void Project::dumpFileMaps(const std::shared_ptr<QueryMessage> &msg, const std::
     }
 
     if (args.empty() || args.contains("tokens")) {
-        if (auto tbl = openTokens(fileId, &err)) {
+        if (!sourceFilePath(fileId, fileMapName(Tokens)).isFile()) {
+            conn->write("Tokens: not indexed (index-tokens is not set in .rtags-config)");
+        } else if (auto tbl = openTokens(fileId, &err)) {
             conn->write(formatTable("Tokens:", tbl, msg->terminalWidth()));
         } else {
             conn->write(err);
         }
     }
-
-
-    endScope();
 }
 
 void Project::prepare(uint32_t fileId)
 {
     if (fileId && isIndexed(fileId)) {
-        beginScope();
         String err;
         openSymbolNames(fileId, &err);
         openSymbols(fileId, &err);
         openTargets(fileId, &err);
         openUsrs(fileId, &err);
         debug() << "Prepared" << Location::path(fileId);
-        endScope();
     }
 }
 
@@ -2328,15 +2534,20 @@ String Project::estimateMemory() const
     add("Diagnostics", ::estimateMemory(mDiagnostics));
     add("Active jobs", ::estimateMemory(mActiveJobs));
     add("Fixits", ::estimateMemory(mFixIts));
-    add("Pending dirty files", ::estimateMemory(mPendingDirtyFiles));
+    add("Pending dirty files", sizeof(mPendingDirtyFiles) + mPendingDirtyFiles.estimateMemory());
     add("Sources", ::estimateMemory(mSources));
     add("Suspended files", ::estimateMemory(mSuspendedFiles));
-    size_t deps = ::estimateMemory(mDependencies);
-    for (const auto &dep : mDependencies) {
-        deps += ::estimateMemory(*dep.second);
-    }
-    add("Dependencies", deps);
+    add("Dependencies", mDependencies.estimateMemory());
     add("Total", total);
+    // mapped, not allocated
+    const FileMapCache::Stats cache = mFileMapCache.stats();
+    ret << String::format<256>("File map cache: %zu files %.2fmb (%zu hits, %zu misses, %zu evictions, %zu files open in all projects)",
+                               cache.files, cache.bytes / (1024.0 * 1024.0), cache.hits, cache.misses, cache.evictions,
+                               FileMapCache::openFiles());
+    const QueryCache::Stats queries = mQueryCache.stats();
+    ret << String::format<256>("Query cache: %zu results %.2fmb (%zu hits, %zu misses, %zu invalidations, %zu evictions)",
+                               queries.entries, queries.bytes / (1024.0 * 1024.0), queries.hits, queries.misses,
+                               queries.invalidations, queries.evictions);
     return String::join(ret, "\n");
 }
 
@@ -2393,6 +2604,7 @@ void Project::removeSource(Sources::iterator it)
     removeDependencies(fileId);
     Path::rmdir(sourceFilePath(fileId).constData());
     mSources.erase(it);
+    publishLater(PublishSources);
 }
 
 uint32_t Project::fileMapOptions() const
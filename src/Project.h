@@ -16,15 +16,21 @@
 #ifndef Project_h
 #define Project_h
 
+#include <atomic>
 #include <cstdint>
 #include <mutex>
 
+#include "CancellationToken.h"
+#include "DependencyGraph.h"
 #include "Diagnostic.h"
+#include "FileIdSet.h"
 #include "FileMap.h"
+#include "FileMapCache.h"
+#include "QueryCache.h"
+#include "TokenCache.h"
 #include "IndexerJob.h"
 #include "IndexMessage.h"
 #include "QueryMessage.h"
-#include "rct/EmbeddedLinkedList.h"
 #include "rct/FileSystemWatcher.h"
 #include "rct/Flags.h"
 #include "rct/Path.h"
@@ -93,29 +99,24 @@ public:
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openSymbolNames(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(SymbolNames, fileId, mFileMapScope->symbolNames, err);
+        return openFileMap<String, Set<Location> >(SymbolNames, fileId, err);
     }
     std::shared_ptr<FileMap<Location, Symbol> > openSymbols(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<Location, Symbol>(Symbols, fileId, mFileMapScope->symbols, err);
+        return openFileMap<Location, Symbol>(Symbols, fileId, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openTargets(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Targets, fileId, mFileMapScope->targets, err);
+        return openFileMap<String, Set<Location> >(Targets, fileId, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openUsrs(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Usrs, fileId, mFileMapScope->usrs, err);
+        return openFileMap<String, Set<Location> >(Usrs, fileId, err);
     }
 
     std::shared_ptr<FileMap<uint32_t, Token> > openTokens(uint32_t fileId, String *err = 0)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<uint32_t, Token>(Tokens, fileId, mFileMapScope->tokens, err);
+        return openFileMap<uint32_t, Token>(Tokens, fileId, err);
     }
 
 
@@ -124,13 +125,15 @@ public:
         ArgDependsOn
     };
 
-    Set<uint32_t> dependencies(uint32_t fileId, DependencyMode mode) const;
+    FileIdSet dependencies(uint32_t fileId, DependencyMode mode) const;
     bool dependsOn(uint32_t source, uint32_t header) const;
+    // Safe to call from query threads, unlike dependencies().fileIds()
+    List<uint32_t> dependencyFileIds() const;
     String dumpDependencies(uint32_t fileId,
                             const List<String> &args = List<String>(),
                             Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>()) const;
-    const Hash<uint32_t, DependencyNode*> &dependencies() const { return mDependencies; }
-    DependencyNode *dependencyNode(uint32_t fileId) const { return mDependencies.value(fileId); }
+    const DependencyGraph &dependencies() const { return mDependencies; }
+    const Diagnostics &diagnostics() const { return mDiagnostics; }
 
     static bool readSources(const Path &path, Sources &sources,
                             Hash<Path, CompilationDataBaseInfo> *compileCommands, String *error);
@@ -142,7 +145,10 @@ public:
     void findSymbols(const String &symbolName,
                      const std::function<void(SymbolMatchType, const String &, const Set<Location> &)> &func,
                      Flags<QueryMessage::Flag> queryFlags,
-                     uint32_t fileFilter = 0);
+                     uint32_t fileFilter = 0,
+                     const CancellationToken *cancel = 0,
+                     // files it returns false for aren't opened at all
+                     const std::function<bool(uint32_t)> &acceptFile = std::function<bool(uint32_t)>());
 
     static bool matchSymbolName(const String &pattern, const String &symbolName, String::CaseSensitivity cs)
     {
@@ -151,19 +157,30 @@ public:
 
     Symbol findSymbol(Location location, int *index = 0);
     Set<Symbol> findTargets(Location location) { return findTargets(findSymbol(location)); }
-    Set<Symbol> findTargets(const Symbol &symbol);
+    // The lookups below that may have to look at every file in the project
+    // stop early, with partial results, when cancel is cancelled
+    Set<Symbol> findTargets(const Symbol &symbol, const CancellationToken *cancel = 0);
     Symbol findTarget(Location location) { return RTags::bestTarget(findTargets(location)); }
-    Symbol findTarget(const Symbol &symbol) { return RTags::bestTarget(findTargets(symbol)); }
+    Symbol findTarget(const Symbol &symbol, const CancellationToken *cancel = 0) { return RTags::bestTarget(findTargets(symbol, cancel)); }
     Set<Symbol> findAllReferences(Location location) { return findAllReferences(findSymbol(location)); }
-    Set<Symbol> findAllReferences(const Symbol &symbol);
+    // acceptFile, like for findSymbols(), leaves the files whose references
+    // would be filtered out anyway unopened
+    Set<Symbol> findAllReferences(const Symbol &symbol, const CancellationToken *cancel = 0,
+                                  const std::function<bool(uint32_t)> &acceptFile = std::function<bool(uint32_t)>());
     Set<Symbol> findCallers(Location location) { return findCallers(findSymbol(location)); }
-    Set<Symbol> findCallers(const Symbol &symbol);
+    Set<Symbol> findCallers(const Symbol &symbol, const CancellationToken *cancel = 0,
+                            const std::function<bool(uint32_t)> &acceptFile = std::function<bool(uint32_t)>());
     Set<Symbol> findVirtuals(Location location) { return findVirtuals(findSymbol(location)); }
-    Set<Symbol> findVirtuals(const Symbol &symbol);
+    Set<Symbol> findVirtuals(const Symbol &symbol, const CancellationToken *cancel = 0,
+                             const std::function<bool(uint32_t)> &acceptFile = std::function<bool(uint32_t)>());
     Set<String> findTargetUsrs(Location loc);
-    Set<Symbol> findSubclasses(const Symbol &symbol);
+    Set<Symbol> findSubclasses(const Symbol &symbol, const CancellationToken *cancel = 0);
 
-    Set<Symbol> findByUsr(const String &usr, uint32_t fileId, DependencyMode mode, Location filtered = Location());
+    // acceptFile only applies to the scan of all files when the usr isn't
+    // found in the dependencies of fileId
+    Set<Symbol> findByUsr(const String &usr, uint32_t fileId, DependencyMode mode, Location filtered = Location(),
+                          const CancellationToken *cancel = 0,
+                          const std::function<bool(uint32_t)> &acceptFile = std::function<bool(uint32_t)>());
 
     Path sourceFilePath(uint32_t fileId, const char *path = "") const;
 
@@ -185,7 +202,7 @@ public:
     bool hasSource(uint32_t fileId) const;
     bool isActiveJob(uint64_t key) { return !key || mActiveJobs.contains(key); }
     inline bool visitFile(uint32_t fileId, const Path &path, uint64_t id);
-    inline void releaseFileIds(const Set<uint32_t> &fileIds);
+    inline void releaseFileIds(const FileIdSet &fileIds);
     String fixIts(uint32_t fileId) const;
     int reindex(const Match &match,
                 const std::shared_ptr<QueryMessage> &query,
@@ -222,12 +239,25 @@ public:
         serializer << mVisitedFiles;
     }
 
-    void beginScope();
-    void endScope();
     void dirty(uint32_t fileId);
     bool save();
+    // Asynchronously pulls the file maps that were queried the most into
+    // the page cache
+    void prefetch();
+    void cancelPrefetch() { if (mPrefetchCancelled) *mPrefetchCancelled = true; }
+    // Writes the query counts prefetch() goes by if they changed. Called
+    // periodically and on shutdown.
+    void saveHotFiles();
+    // Inserts the file ids still in use into referenced and removes per-file
+    // data and temporary files that nothing refers to. removedBytes is the
+    // size of what was removed.
+    void collectGarbage(FileIdSet &referenced, int &removedDirectories, int &removedFiles, uint64_t &removedBytes);
+    bool restoreSnapshot(Sources &&sources, Hash<Path, CompilationDataBaseInfo> &&infos,
+                         Diagnostics &&diagnostics, const Hash<uint32_t, List<uint32_t> > &includes);
     void prepare(uint32_t fileId);
     String estimateMemory() const;
+    QueryCache &queryCache() { return mQueryCache; }
+    TokenCache &tokenCache() { return mTokenCache; }
     void diagnose(uint32_t fileId);
     void diagnoseAll();
     uint32_t fileMapOptions() const;
@@ -246,7 +276,7 @@ private:
     void removeDependencies(uint32_t fileId);
     void updateDependencies(const std::shared_ptr<IndexDataMessage> &msg);
     void loadFailed(uint32_t fileId);
-    void updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts);
+    void updateFixIts(const FileIdSet &visited, FixIts &fixIts);
     Diagnostics updateDiagnostics(const Diagnostics &diagnostics);
     int startDirtyJobs(Dirty *dirty,
                        IndexerJob::Flag type,
@@ -254,123 +284,35 @@ private:
                        const std::shared_ptr<Connection> &wait = std::shared_ptr<Connection>());
     void onDirtyTimeout(Timer *);
 
-    struct FileMapScope {
-        FileMapScope(const std::shared_ptr<Project> &proj, int m)
-            : project(proj), openedFiles(0), totalOpened(0), max(m)
-        {}
-        ~FileMapScope()
-        {
-            warning() << "Query opened" << totalOpened << "files for project" << project->path();
-        }
-
-        struct LRUKey {
-            FileMapType type;
-            uint32_t fileId;
-            bool operator<(const LRUKey &other) const
-            {
-                return fileId < other.fileId || (fileId == other.fileId && type < other.type);
-            }
-        };
-        struct LRUEntry {
-            LRUEntry(FileMapType t, uint32_t f)
-                : key({ t, f })
-            {}
-            const LRUKey key;
-
-            std::shared_ptr<LRUEntry> next, prev;
-        };
-
-        void poke(FileMapType t, uint32_t f)
-        {
-            const LRUKey key = { t, f };
-            auto ptr = entryMap.value(key);
-            assert(ptr);
-            entryList.remove(ptr);
-            entryList.append(ptr);
-        }
-
-        template <typename Key, typename Value>
-        std::shared_ptr<FileMap<Key, Value> > openFileMap(FileMapType type, uint32_t fileId,
-                                                          Hash<uint32_t, std::shared_ptr<FileMap<Key, Value> > > &cache,
-                                                          String *errPtr)
-        {
-            auto it = cache.find(fileId);
-            if (it != cache.end()) {
-                poke(type, fileId);
-                return it->second;
-            }
-            const Path path = project->sourceFilePath(fileId, Project::fileMapName(type));
-            std::shared_ptr<FileMap<Key, Value> > fileMap(new FileMap<Key, Value>);
-            String err;
-            if (fileMap->load(path, project->fileMapOptions(), &err)) {
-                ++totalOpened;
-                cache[fileId] = fileMap;
-                std::shared_ptr<LRUEntry> entry(new LRUEntry(type, fileId));
-                entryList.append(entry);
-                entryMap[entry->key] = entry;
-                if (++openedFiles > max) {
-                    const std::shared_ptr<LRUEntry> e = entryList.takeFirst();
-                    assert(e);
-                    entryMap.remove(e->key);
-                    switch (e->key.type) {
-                    case SymbolNames:
-                        assert(symbolNames.contains(e->key.fileId));
-                        symbolNames.remove(e->key.fileId);
-                        break;
-                    case Symbols:
-                        assert(symbols.contains(e->key.fileId));
-                        symbols.remove(e->key.fileId);
-                        break;
-                    case Targets:
-                        assert(targets.contains(e->key.fileId));
-                        targets.remove(e->key.fileId);
-                        break;
-                    case Usrs:
-                        assert(usrs.contains(e->key.fileId));
-                        usrs.remove(e->key.fileId);
-                        break;
-                    case Tokens:
-                        assert(tokens.contains(e->key.fileId));
-                        tokens.remove(e->key.fileId);
-                        break;
-                    }
-                    --openedFiles;
-                }
-                assert(openedFiles <= max);
-            } else {
-                if (errPtr) {
-                    *errPtr = "Failed to open: " + path + " " + Location::path(fileId) + ": " + err;
-                } else {
-                    error() << "Failed to open" << path << Location::path(fileId) << err;
-                }
-                project->loadFailed(fileId);
-                fileMap.reset();
-            }
-            return fileMap;
-        }
-
-        Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > symbolNames;
-        Hash<uint32_t, std::shared_ptr<FileMap<Location, Symbol> > > symbols;
-        Hash<uint32_t, std::shared_ptr<FileMap<String, Set<Location> > > > targets, usrs;
-        Hash<uint32_t, std::shared_ptr<FileMap<uint32_t, Token> > > tokens;
-        std::shared_ptr<Project> project;
-        int openedFiles, totalOpened;
-        const int max;
-
-        EmbeddedLinkedList<std::shared_ptr<LRUEntry> > entryList;
-        Map<LRUKey, std::shared_ptr<LRUEntry> > entryMap;
+    enum PublishFlag {
+        PublishDependencies = 0x1,
+        PublishSources = 0x2
     };
-
-    std::shared_ptr<FileMapScope> mFileMapScope;
+    // Marks members as changed. The first change since the last publish()
+    // schedules one, so everything the event loop does in one go (e.g. a
+    // batch of finished jobs) is copied for the query threads once.
+    void publishLater(unsigned int flags);
+    void publish();
+    // The live members on the event loop thread, the last published copies
+    // on query threads
+    std::shared_ptr<const DependencyGraph> dependencyView() const;
+    std::shared_ptr<const Sources> sourcesView() const;
+
+    template <typename Key, typename Value>
+    std::shared_ptr<FileMap<Key, Value> > openFileMap(FileMapType type, uint32_t fileId, String *err);
+
+    FileMapCache mFileMapCache;
+    QueryCache mQueryCache;
+    TokenCache mTokenCache;
 
     const Path mPath, mSourceFilePathBase;
     Hash<Path, CompilationDataBaseInfo> mCompilationDatabaseInfos;
-    Path mProjectFilePath, mSourcesFilePath;
+    Path mProjectFilePath, mSourcesFilePath, mDependenciesFilePath, mHotFilesPath;
 
     Files mFiles;
 
     Hash<uint32_t, Path> mVisitedFiles;
-    int mJobCounter, mJobsStarted;
+    int mJobCounter, mJobsStarted, mUnsyncedJobs;
 
     Diagnostics mDiagnostics;
 
@@ -378,7 +320,7 @@ private:
     Hash<uint64_t, std::shared_ptr<IndexerJob> > mActiveJobs;
 
     Timer mDirtyTimer;
-    Set<uint32_t> mPendingDirtyFiles;
+    FileIdSet mPendingDirtyFiles;
 
     StopWatch mTimer;
     FileSystemWatcher mWatcher;
@@ -387,9 +329,20 @@ private:
     std::shared_ptr<FileManager> mFileManager;
     FixIts mFixIts;
 
-    Hash<uint32_t, DependencyNode*> mDependencies;
+    DependencyGraph mDependencies;
+    // Read-only copies of mDependencies and mSources for the query threads.
+    // Only the event loop thread modifies the originals and publishes them.
+    std::shared_ptr<const DependencyGraph> mPublishedDependencies;
+    std::shared_ptr<const Sources> mPublishedSources;
+    unsigned int mUnpublished;
     Set<uint32_t> mSuspendedFiles;
 
+    // number of times each file map was opened by queries, see fileMapHitKey()
+    Hash<uint64_t, uint32_t> mFileMapHits;
+    static uint64_t fileMapHitKey(uint32_t fileId, FileMapType type) { return (static_cast<uint64_t>(fileId) << 32) | type; }
+    bool mFileMapHitsChanged;
+    std::shared_ptr<std::atomic<bool> > mPrefetchCancelled;
+
     mutable std::mutex mMutex;
 };
 
@@ -413,7 +366,7 @@ inline bool Project::visitFile(uint32_t visitFileId, const Path &path, uint64_t
     return false;
 }
 
-inline void Project::releaseFileIds(const Set<uint32_t> &fileIds)
+inline void Project::releaseFileIds(const FileIdSet &fileIds)
 {
     if (!fileIds.isEmpty()) {
         std::lock_guard<std::mutex> lock(mMutex);
@@ -429,4 +382,33 @@ inline Path Project::sourceFilePath(uint32_t fileId, const char *type) const
     return String::format<1024>("%s%d/%s", mSourceFilePathBase.constData(), fileId, type);
 }
 
+template <typename Key, typename Value>
+inline std::shared_ptr<FileMap<Key, Value> > Project::openFileMap(FileMapType type, uint32_t fileId, String *errPtr)
+{
+    {
+        // counted before the cache so the files that always hit rank highest
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mFileMapHits[fileMapHitKey(fileId, type)];
+        mFileMapHitsChanged = true;
+    }
+    uint64_t generation;
+    std::shared_ptr<FileMap<Key, Value> > fileMap = mFileMapCache.find<FileMap<Key, Value> >(type, fileId, &generation);
+    if (fileMap)
+        return fileMap;
+
+    const Path path = sourceFilePath(fileId, fileMapName(type));
+    fileMap.reset(new FileMap<Key, Value>);
+    String err;
+    if (!fileMap->load(path, fileMapOptions(), &err)) {
+        if (errPtr) {
+            *errPtr = "Failed to open: " + path + " " + Location::path(fileId) + ": " + err;
+        } else {
+            error() << "Failed to open" << path << Location::path(fileId) << err;
+        }
+        loadFailed(fileId);
+        return std::shared_ptr<FileMap<Key, Value> >();
+    }
+    return mFileMapCache.insert(type, fileId, generation, fileMap, fileMap->mappedSize());
+}
+
 #endif
@@ -0,0 +1,118 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "QueryCache.h"
+
+QueryCache::QueryCache(size_t maxEntries)
+    : mGeneration(0), mMaxEntries(maxEntries)
+{
+}
+
+QueryCache::~QueryCache()
+{
+    clear();
+}
+
+bool QueryCache::find(const String &key, Result &result, uint64_t *generation)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const std::shared_ptr<Entry> entry = mEntries.value(key);
+    if (!entry) {
+        ++mStats.misses;
+        *generation = mGeneration;
+        return false;
+    }
+    ++mStats.hits;
+    mLRU.remove(entry);
+    mLRU.append(entry);
+    result = entry->result;
+    return true;
+}
+
+void QueryCache::insert(const String &key, uint64_t generation, const FileIdSet &files, Result &&result)
+{
+    size_t size = key.size();
+    for (const String &line : result.output)
+        size += line.size();
+    if (size > MaxResultSize)
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (generation != mGeneration || mEntries.contains(key))
+        return;
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->key = key;
+    entry->files = files;
+    entry->result = std::move(result);
+    entry->size = size;
+    mEntries[key] = entry;
+    mLRU.append(entry);
+    mStats.bytes += size;
+
+    while (mEntries.size() > mMaxEntries) {
+        remove(mLRU.first());
+        ++mStats.evictions;
+    }
+}
+
+void QueryCache::remove(const std::shared_ptr<Entry> &entry)
+{
+    mLRU.remove(entry);
+    mEntries.remove(entry->key);
+    mStats.bytes -= entry->size;
+}
+
+void QueryCache::invalidate(const FileIdSet &files)
+{
+    if (files.isEmpty())
+        return;
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mGeneration;
+    std::shared_ptr<Entry> entry = mLRU.first();
+    while (entry) {
+        const std::shared_ptr<Entry> next = entry->next;
+        if (entry->files.isEmpty() || entry->files.intersects(files)) {
+            remove(entry);
+            ++mStats.invalidations;
+        }
+        entry = next;
+    }
+}
+
+void QueryCache::invalidate(uint32_t fileId)
+{
+    FileIdSet files;
+    files.insert(fileId);
+    invalidate(files);
+}
+
+void QueryCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mGeneration;
+    mStats.invalidations += mEntries.size();
+    while (!mLRU.isEmpty())
+        mLRU.takeFirst();
+    mEntries.clear();
+    mStats.bytes = 0;
+}
+
+QueryCache::Stats QueryCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Stats ret = mStats;
+    ret.entries = mEntries.size();
+    return ret;
+}
@@ -0,0 +1,93 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef QueryCache_h
+#define QueryCache_h
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "FileIdSet.h"
+#include "rct/EmbeddedLinkedList.h"
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/String.h"
+
+/*
+ * Output of recent queries for a project, keyed on QueryMessage::cacheKey().
+ * Editors tend to ask the same things over and over between edits so a
+ * query whose key is in the cache is answered without running the job.
+ *
+ * Each result remembers the files it was computed from, or none if it may
+ * depend on any file in the project (e.g. references). When files are
+ * reindexed or removed the project bumps the generation and drops the
+ * results that depend on them. Like FileMapCache a lookup that misses
+ * returns the generation so a result computed while files were being
+ * rewritten isn't inserted.
+ */
+class QueryCache
+{
+public:
+    QueryCache(size_t maxEntries);
+    ~QueryCache();
+
+    struct Result {
+        Result()
+            : status(0)
+        {}
+        List<String> output;
+        int status;
+    };
+
+    bool isEnabled() const { return mMaxEntries; }
+    bool find(const String &key, Result &result, uint64_t *generation);
+    // files empty means the result depends on the whole project
+    void insert(const String &key, uint64_t generation, const FileIdSet &files, Result &&result);
+
+    void invalidate(const FileIdSet &files);
+    void invalidate(uint32_t fileId);
+    void clear();
+
+    // results bigger than this aren't worth keeping around
+    enum { MaxResultSize = 1024 * 1024 };
+
+    struct Stats {
+        Stats()
+            : entries(0), bytes(0), hits(0), misses(0), invalidations(0), evictions(0)
+        {}
+        size_t entries, bytes, hits, misses, invalidations, evictions;
+    };
+    Stats stats() const;
+private:
+    struct Entry {
+        String key;
+        FileIdSet files;
+        Result result;
+        size_t size;
+
+        std::shared_ptr<Entry> next, prev;
+    };
+    void remove(const std::shared_ptr<Entry> &entry);
+
+    mutable std::mutex mMutex;
+    Hash<String, std::shared_ptr<Entry> > mEntries;
+    EmbeddedLinkedList<std::shared_ptr<Entry> > mLRU;
+    uint64_t mGeneration;
+    const size_t mMaxEntries;
+    Stats mStats;
+};
+
+#endif
@@ -27,10 +27,9 @@
 QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
                    const std::shared_ptr<Project> &proj,
                    Flags<JobFlag> jobFlags)
-    : mAborted(false), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProject(proj), mFileFilter(0)
+    : mCancellationToken(std::make_shared<CancellationToken>(query->deadline())), mLinesWritten(0),
+      mQueryMessage(query), mJobFlags(jobFlags), mProject(proj), mFileFilter(0), mRecordOutput(false)
 {
-    if (mProject)
-        mProject->beginScope();
     assert(query);
     if (query->flags() & QueryMessage::SilentQuery)
         setJobFlag(QuietJob);
@@ -58,8 +57,6 @@ QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
 
 QueryJob::~QueryJob()
 {
-    if (mProject)
-        mProject->endScope();
 }
 
 bool QueryJob::write(const String &out, Flags<WriteFlag> flags)
@@ -96,7 +93,7 @@ bool QueryJob::write(const String &out, Flags<WriteFlag> flags)
 
 bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
 {
-    assert(mConnection);
+    assert(mConnection || mRecordOutput);
     if (!(flags & IgnoreMax) && mQueryMessage) {
         const int max = mQueryMessage->max();
         if (max != -1 && mLinesWritten == max) {
@@ -108,9 +105,15 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
 
     if (!(mJobFlags & QuietJob))
         warning("=> %s", out.constData());
+    if (mRecordOutput)
+        mRecordedOutput.append(out);
 
     if (mConnection) {
-        if (!mConnection->write(out)) {
+        if (!EventLoop::isMainThread()) {
+            mPendingOutput.append(out);
+            if (mPendingOutput.size() >= OutputBatchSize)
+                flush();
+        } else if (!mConnection->write(out)) {
             abort();
             return false;
         }
@@ -120,6 +123,29 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
     return true;
 }
 
+void QueryJob::flush()
+{
+    if (mPendingOutput.isEmpty())
+        return;
+    assert(mConnection);
+    std::weak_ptr<Connection> conn = mConnection;
+    std::shared_ptr<CancellationToken> token = mCancellationToken;
+    EventLoop::mainEventLoop()->callLaterMove(std::function<void(List<String> &&)>([conn, token](List<String> &&output) {
+                std::shared_ptr<Connection> c = conn.lock();
+                if (!c) {
+                    token->cancel();
+                    return;
+                }
+                for (const String &out : output) {
+                    if (!c->write(out)) {
+                        token->cancel();
+                        break;
+                    }
+                }
+            }), std::move(mPendingOutput));
+    mPendingOutput.clear();
+}
+
 bool QueryJob::locationToString(Location location,
                                 const std::function<void(LocationPiece, const String &)> &cb,
                                 Flags<WriteFlag> writeFlags)
@@ -511,16 +537,19 @@ bool QueryJob::filter(const String &value) const
 
 int QueryJob::run(const std::shared_ptr<Connection> &connection)
 {
-    assert(connection);
+    // without a connection the output is only recorded, see Server::batch()
+    assert(connection || mRecordOutput);
     mConnection = connection;
-    const int ret = execute();
+    // the query may have waited for a thread past its deadline
+    const int ret = isAborted() ? 1 : execute();
+    flush();
     mConnection = 0;
     return ret;
 }
 
 bool QueryJob::filterLocation(Location loc) const
 {
-    if (mFileFilter && loc.fileId() != mFileFilter)
+    if (!filterFile(loc.fileId()))
         return false;
     const int minLine = mQueryMessage ? mQueryMessage->minLine() : -1;
     if (minLine != -1) {
@@ -533,9 +562,17 @@ bool QueryJob::filterLocation(Location loc) const
             return false;
         }
     }
+    return true;
+}
+
+bool QueryJob::filterFile(uint32_t fileId) const
+{
+    if (mFileFilter && fileId != mFileFilter)
+        return false;
     if (!mFilters.isEmpty()) {
+        const Path path = Location::path(fileId);
         for (const std::shared_ptr<Filter> &filter : mFilters) {
-            if (filter->match(loc.fileId(), loc.path()))
+            if (filter->match(fileId, path))
                 return true;
         }
         return false;
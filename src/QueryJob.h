@@ -19,6 +19,7 @@
 #include <regex>
 #include <mutex>
 
+#include "CancellationToken.h"
 #include "Project.h"
 #include "QueryMessage.h"
 #include "rct/Flags.h"
@@ -65,6 +66,12 @@ public:
                Flags<Symbol::ToStringFlag> sourceFlags = Flags<Symbol::ToStringFlag>(),
                Flags<WriteFlag> writeFlags = Flags<WriteFlag>());
     bool write(Location location, Flags<WriteFlag> writeFlags = Flags<WriteFlag>());
+    // True once --max lines have been written
+    bool maxReached() const
+    {
+        const int max = mQueryMessage ? mQueryMessage->max() : -1;
+        return max != -1 && mLinesWritten >= max;
+    }
     enum LocationPiece {
         Piece_Location,
         Piece_Context,
@@ -91,12 +98,27 @@ public:
     Signal<std::function<void(const String &)> > &output() { return mOutput; }
     std::shared_ptr<Project> project() const { return mProject; }
     virtual int execute() = 0;
+    // May be called from a query thread in which case output is passed to the
+    // connection on the main thread in batches of OutputBatchSize lines
     int run(const std::shared_ptr<Connection> &connection = 0);
-    bool isAborted() const { std::lock_guard<std::mutex> lock(mMutex); return mAborted; }
-    void abort() { std::lock_guard<std::mutex> lock(mMutex); mAborted = true; }
+    // Aborted when the query's deadline has passed or someone cancelled it
+    bool isAborted() const { return mCancellationToken->isCancelled(); }
+    void abort() { mCancellationToken->cancel(); }
+    const CancellationToken *cancellation() const { return mCancellationToken.get(); }
+    const std::shared_ptr<CancellationToken> &cancellationToken() const { return mCancellationToken; }
+    void setCancellationToken(const std::shared_ptr<CancellationToken> &token) { assert(token); mCancellationToken = token; }
     std::mutex &mutex() const { return mMutex; }
     const std::shared_ptr<Connection> &connection() const { return mConnection; }
     bool filterLocation(Location loc) const;
+    // The part of filterLocation that only depends on the file
+    bool filterFile(uint32_t fileId) const;
+
+    // Keeps a copy of everything written for QueryCache
+    void setRecordOutput(bool on) { mRecordOutput = on; }
+    List<String> takeRecordedOutput() { return std::move(mRecordedOutput); }
+    // The files the output was computed from. Empty means it may depend on
+    // any file in the project.
+    virtual FileIdSet cacheFiles() const { return FileIdSet(); }
 private:
     class Filter
     {
@@ -133,9 +155,11 @@ private:
 
     bool filterKind(CXCursorKind kind) const;
     mutable std::mutex mMutex;
-    bool mAborted;
+    std::shared_ptr<CancellationToken> mCancellationToken;
     int mLinesWritten;
     bool writeRaw(const String &out, Flags<WriteFlag> flags);
+    void flush();
+    enum { OutputBatchSize = 128 };
     std::shared_ptr<QueryMessage> mQueryMessage;
     Flags<JobFlag> mJobFlags;
     Signal<std::function<void(const String &)> > mOutput;
@@ -144,6 +168,9 @@ private:
     List<std::shared_ptr<Filter> > mFilters;
     Set<String> mKindFilters;
     String mBuffer;
+    List<String> mPendingOutput;
+    bool mRecordOutput;
+    List<String> mRecordedOutput;
     std::shared_ptr<Connection> mConnection;
     Hash<Path, String> mContextCache;
 };
@@ -15,11 +15,13 @@
 
 #include "QueryMessage.h"
 
+#include "rct/Rct.h"
 #include "rct/Serializer.h"
 #include "RTags.h"
 
 QueryMessage::QueryMessage(Type type)
-    : RTagsMessage(MessageId), mType(type), mMax(-1), mMinLine(-1), mMaxLine(-1), mBuildIndex(0), mTerminalWidth(-1)
+    : RTagsMessage(MessageId), mType(type), mMax(-1), mMinLine(-1), mMaxLine(-1), mBuildIndex(0), mTerminalWidth(-1),
+      mTimeout(-1), mDeadline(0)
 {
 }
 
@@ -27,7 +29,7 @@ void QueryMessage::encode(Serializer &serializer) const
 {
     serializer << mRaw << mQuery << mType << mFlags << mMax
                << mMinLine << mMaxLine << mBuildIndex << mPathFilters << mKindFilters
-               << mCurrentFile << mUnsavedFiles << mTerminalWidth
+               << mCurrentFile << mUnsavedFiles << mTerminalWidth << mTimeout
 #ifdef RTAGS_HAS_LUA
                << mVisitASTScripts
 #endif
@@ -38,11 +40,23 @@ void QueryMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mRaw >> mQuery >> mType >> mFlags >> mMax
                  >> mMinLine >> mMaxLine >> mBuildIndex >> mPathFilters >> mKindFilters
-                 >> mCurrentFile >> mUnsavedFiles >> mTerminalWidth
+                 >> mCurrentFile >> mUnsavedFiles >> mTerminalWidth >> mTimeout
 #ifdef RTAGS_HAS_LUA
                  >> mVisitASTScripts
 #endif
         ;
+    mDeadline = mTimeout > 0 ? Rct::monoMs() + mTimeout : 0;
+}
+
+String QueryMessage::cacheKey() const
+{
+    Flags<Flag> flags = mFlags;
+    flags.set(SilentQuery, false);
+    String ret;
+    Serializer serializer(ret);
+    serializer << mQuery << mType << flags << mMax << mMinLine << mMaxLine << mBuildIndex
+               << mPathFilters << mKindFilters << mCurrentFile << mTerminalWidth;
+    return ret;
 }
 
 Flags<Location::ToStringFlag> QueryMessage::locationToStringFlags(Flags<Flag> queryFlags)
@@ -66,6 +80,32 @@ Match QueryMessage::match() const
     return Match(mQuery, flags);
 }
 
+String QueryMessage::encodeBatch(const List<BatchQuery> &queries)
+{
+    String ret;
+    Serializer serializer(ret);
+    serializer << queries;
+    return ret;
+}
+
+List<QueryMessage::BatchQuery> QueryMessage::batch() const
+{
+    assert(mType == Batch);
+    List<BatchQuery> ret;
+    Deserializer deserializer(mQuery);
+    deserializer >> ret;
+    return ret;
+}
+
+std::shared_ptr<QueryMessage> QueryMessage::batchQuery(const BatchQuery &query) const
+{
+    std::shared_ptr<QueryMessage> ret = std::make_shared<QueryMessage>(*this);
+    ret->mType = query.type;
+    ret->mQuery = query.query;
+    ret->mFlags |= query.flags;
+    return ret;
+}
+
 QueryMessage::Flag QueryMessage::flagFromString(const String &string)
 {
     if (string == "no-context") {
@@ -130,6 +170,8 @@ QueryMessage::Flag QueryMessage::flagFromString(const String &string)
         return NoColor;
     } else if (string == "all-targets") {
         return AllTargets;
+    } else if (string == "unsorted") {
+        return Unsorted;
     }
     return NoFlag;
 }
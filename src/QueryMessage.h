@@ -33,6 +33,7 @@ public:
     enum Type {
         Invalid,
         GenerateTest,
+        Batch,
         CheckReindex,
         ClassHierarchy,
         ClearProjects,
@@ -49,6 +50,7 @@ public:
         FindSymbols,
         FixIts,
         FollowLocation,
+        GarbageCollect,
         HasFileManager,
         IncludeFile,
         IsIndexed,
@@ -117,7 +119,8 @@ public:
         XMLCompletions = (1ull << 37),
         NoSpellChecking = (1ull << 38),
         CodeCompleteIncludes = (1ull << 39),
-        TokensIncludeSymbols = (1ull << 40)
+        TokensIncludeSymbols = (1ull << 40),
+        Unsorted = (1ull << 41)
     };
 
     QueryMessage(Type type = Invalid);
@@ -183,6 +186,12 @@ public:
     int max() const { return mMax; }
     void setMax(int max) { mMax = max; }
 
+    // Time in ms the client will wait for the query, -1 means no timeout
+    int timeout() const { return mTimeout; }
+    void setTimeout(int timeout) { mTimeout = timeout; }
+    // Rct::monoMs() time at which rdm gives up on the query, 0 means never
+    uint64_t deadline() const { return mDeadline; }
+
     Flags<Flag> flags() const { return mFlags; }
     void setFlags(Flags<Flag> flags)
     {
@@ -209,6 +218,27 @@ public:
     virtual void encode(Serializer &serializer) const override;
     virtual void decode(Deserializer &deserializer) override;
 
+    // The parts of the query that decide its output, for QueryCache. Leaves
+    // out the timeout and flags that only affect logging.
+    String cacheKey() const;
+
+    // A Batch query carries a list of queries in its query string. They're
+    // run one after the other with the flags, filters and deadline of the
+    // batch and the output of each is tagged with its id.
+    struct BatchQuery {
+        BatchQuery()
+            : id(0), type(Invalid)
+        {}
+        uint32_t id;
+        Type type;
+        String query;
+        Flags<Flag> flags;
+    };
+    static String encodeBatch(const List<BatchQuery> &queries);
+    List<BatchQuery> batch() const;
+    // A copy of this message for one of the queries in batch()
+    std::shared_ptr<QueryMessage> batchQuery(const BatchQuery &query) const;
+
     void setCurrentFile(const Path &currentFile) { mCurrentFile = currentFile; }
     Path currentFile() const { return mCurrentFile; }
 private:
@@ -220,7 +250,8 @@ private:
     Set<String> mKindFilters;
     Path mCurrentFile;
     UnsavedFiles mUnsavedFiles;
-    int mTerminalWidth;
+    int mTerminalWidth, mTimeout;
+    uint64_t mDeadline;
 #ifdef RTAGS_HAS_LUA
     List<String> mVisitASTScripts;
 #endif
@@ -242,6 +273,20 @@ inline Deserializer &operator>>(Deserializer &s, QueryMessage::PathFilter &filte
 
 RCT_FLAGS(QueryMessage::Flag);
 
+inline Serializer &operator<<(Serializer &s, const QueryMessage::BatchQuery &query)
+{
+    s << query.id << static_cast<uint32_t>(query.type) << query.query << query.flags;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, QueryMessage::BatchQuery &query)
+{
+    uint32_t type;
+    s >> query.id >> type >> query.query >> query.flags;
+    query.type = static_cast<QueryMessage::Type>(type);
+    return s;
+}
+
 DECLARE_NATIVE_TYPE(QueryMessage::Type);
 
 #endif // QUERYMESSAGE_H
@@ -60,6 +60,7 @@ struct Option opts[] = {
     { RClient::Project, "project", 'w', optional_argument, "With arg, select project matching that if unique, otherwise list all projects." },
     { RClient::DeleteProject, "delete-project", 'W', required_argument, "Delete all projects matching regex." },
     { RClient::JobCount, "job-count", 'j', optional_argument, "Set or query current job count. (Prefix with l to set low-priority-job-count)." },
+    { RClient::GarbageCollect, "gc", 0, optional_argument, "Remove index data that no project refers to anymore. Pass compact to also renumber file ids." },
 
     { RClient::None, 0, 0, 0, "" },
     { RClient::None, 0, 0, 0, "Indexing commands:" },
@@ -78,6 +79,7 @@ struct Option opts[] = {
     { RClient::ListSymbols, "list-symbols", 'S', optional_argument, "List symbol names matching arg." },
     { RClient::FindSymbols, "find-symbols", 'F', optional_argument, "Find symbols matching arg." },
     { RClient::SymbolInfo, "symbol-info", 'U', required_argument, "Get cursor info for this location." },
+    { RClient::Batch, "batch", 0, required_argument, "Run the queries in this file (- for stdin) in one go. One per line: a query option (e.g. -f or symbol-info), its argument and optionally query flags (e.g. --elisp). Quote arguments with spaces in them. The output of each is preceded by a line with its line number, exit status and number of output lines." },
     { RClient::Status, "status", 's', optional_argument, "Dump status of rdm. Arg can be symbols or symbolNames." },
     { RClient::Diagnose, "diagnose", 0, required_argument, "Resend diagnostics for file." },
     { RClient::IsIndexed, "is-indexed", 'T', required_argument, "Check if rtags knows about, and is ready to return information about, this source file." },
@@ -161,6 +163,7 @@ struct Option opts[] = {
     { RClient::SynchronousCompletions, "synchronous-completions", 0, no_argument, "Wait for completion results." },
     { RClient::XMLCompletions, "xml-completions", 0, no_argument, "Output completions in XML" },
     { RClient::NoSortReferencesByInput, "no-sort-references-by-input", 0, no_argument, "Don't sort references by input position." },
+    { RClient::Unsorted, "unsorted", 0, no_argument, "For --references and --list-symbols, write results as they are found. With --max the search stops once enough were found." },
     { RClient::ProjectRoot, "project-root", 0, required_argument, "Override project root for compile commands." },
     { RClient::RTagsConfig, "rtags-config", 0, required_argument, "Print out .rtags-config for argument." },
     { RClient::WildcardSymbolNames, "wildcard-symbol-names", 'a', no_argument, "Expand * like wildcards in --list-symbols and --find-symbols." },
@@ -285,6 +288,7 @@ public:
         msg.setUnsavedFiles(rc->unsavedFiles());
         msg.setFlags(extraQueryFlags | rc->queryFlags());
         msg.setMax(rc->max());
+        msg.setTimeout(rc->timeout());
         msg.setPathFilters(rc->pathFilters());
         msg.setKindFilters(rc->kindFilters());
         msg.setRangeFilter(rc->minOffset(), rc->maxOffset());
@@ -493,6 +497,136 @@ int RClient::exec()
     return ret;
 }
 
+bool RClient::parseBatch(const String &contents, List<QueryMessage::BatchQuery> &queries)
+{
+    struct Command {
+        const char *name;
+        const char *shortName;
+        QueryMessage::Type type;
+        enum { Location, Required, Optional } argument;
+    };
+    static const Command commands[] = {
+        { "follow-location", "f", QueryMessage::FollowLocation, Command::Location },
+        { "symbol-info", "U", QueryMessage::SymbolInfo, Command::Location },
+        { "references", "r", QueryMessage::ReferencesLocation, Command::Location },
+        { "class-hierarchy", 0, QueryMessage::ClassHierarchy, Command::Location },
+        { "references-name", "R", QueryMessage::ReferencesName, Command::Required },
+        { "find-symbols", "F", QueryMessage::FindSymbols, Command::Optional },
+        { "list-symbols", "S", QueryMessage::ListSymbols, Command::Optional }
+    };
+    auto stripDashes = [](const String &word) {
+        size_t i = 0;
+        while (i < word.size() && word.at(i) == '-')
+            ++i;
+        return word.mid(i);
+    };
+
+    // Words are separated by spaces or tabs. Quotes group words, e.g. for
+    // paths with spaces in them, and a backslash escapes the next character
+    // except inside single quotes.
+    auto splitWords = [](const String &line, List<String> &words) {
+        String word;
+        bool inWord = false;
+        char quote = '\0';
+        for (size_t i=0; i<line.size(); ++i) {
+            const char ch = line.at(i);
+            if (quote == '\'') {
+                if (ch == quote) {
+                    quote = '\0';
+                } else {
+                    word.append(ch);
+                }
+            } else if (ch == '\\' && i + 1 < line.size()) {
+                word.append(line.at(++i));
+                inWord = true;
+            } else if (quote) {
+                if (ch == quote) {
+                    quote = '\0';
+                } else {
+                    word.append(ch);
+                }
+            } else if (ch == '"' || ch == '\'') {
+                quote = ch;
+                inWord = true;
+            } else if (ch == ' ' || ch == '\t') {
+                if (inWord) {
+                    words.append(word);
+                    word.clear();
+                    inWord = false;
+                }
+            } else {
+                word.append(ch);
+                inWord = true;
+            }
+        }
+        if (quote)
+            return false;
+        if (inWord)
+            words.append(word);
+        return true;
+    };
+
+    const List<String> lines = contents.split('\n');
+    for (size_t i=0; i<lines.size(); ++i) {
+        const String &line = lines.at(i);
+        size_t start = 0;
+        while (start < line.size() && (line.at(start) == ' ' || line.at(start) == '\t'))
+            ++start;
+        if (start == line.size() || line.at(start) == '#')
+            continue;
+        List<String> words;
+        if (!splitWords(line, words)) {
+            fprintf(stderr, "Unterminated quote on line %zu\n", i + 1);
+            return false;
+        }
+
+        QueryMessage::BatchQuery query;
+        query.id = i + 1;
+        const String command = stripDashes(words.first());
+        size_t idx = 0;
+        while (idx < sizeof(commands) / sizeof(commands[0])
+               && command != commands[idx].name
+               && (!commands[idx].shortName || command != commands[idx].shortName)) {
+            ++idx;
+        }
+        if (idx == sizeof(commands) / sizeof(commands[0])) {
+            fprintf(stderr, "Unknown batch query on line %zu: %s\n", i + 1, words.first().constData());
+            return false;
+        }
+        query.type = commands[idx].type;
+        size_t word = 1;
+        if (word < words.size() && !words.at(word).startsWith("--")) {
+            query.query = words.at(word++);
+        } else if (commands[idx].argument != Command::Optional) {
+            fprintf(stderr, "Missing argument for batch query on line %zu\n", i + 1);
+            return false;
+        }
+        if (commands[idx].argument == Command::Location) {
+            query.query = Location::encode(query.query);
+            if (query.query.isEmpty()) {
+                fprintf(stderr, "Can't resolve argument %s on line %zu\n", words.at(1).constData(), i + 1);
+                return false;
+            }
+            query.flags |= QueryMessage::HasLocation;
+        }
+        while (word < words.size()) {
+            const QueryMessage::Flag flag = QueryMessage::flagFromString(stripDashes(words.at(word)));
+            if (flag == QueryMessage::NoFlag) {
+                fprintf(stderr, "Unknown query flag on line %zu: %s\n", i + 1, words.at(word).constData());
+                return false;
+            }
+            query.flags |= flag;
+            ++word;
+        }
+        queries.append(query);
+    }
+    if (queries.isEmpty()) {
+        fprintf(stderr, "No queries in batch\n");
+        return false;
+    }
+    return true;
+}
+
 RClient::ParseStatus RClient::parse(int &argc, char **argv)
 {
     Rct::findExecutablePath(*argv);
@@ -864,6 +998,19 @@ RClient::ParseStatus RClient::parse(int &argc, char **argv)
         case ReloadFileManager:
             addQuery(QueryMessage::ReloadFileManager);
             break;
+        case GarbageCollect: {
+            String arg;
+            if (optarg) {
+                arg = optarg;
+            } else if (optind < argc && argv[optind][0] != '-') {
+                arg = argv[optind++];
+            }
+            if (!arg.isEmpty() && arg != "compact") {
+                fprintf(stderr, "Invalid argument to --gc %s\n", arg.constData());
+                return Parse_Error;
+            }
+            addQuery(QueryMessage::GarbageCollect, arg);
+            break; }
         case DumpCompletions:
             addQuery(QueryMessage::DumpCompletions);
             break;
@@ -1200,6 +1347,26 @@ RClient::ParseStatus RClient::parse(int &argc, char **argv)
             s << p << args;
             addQuery(opt->option == DumpFileMaps ? QueryMessage::DumpFileMaps : QueryMessage::Dependencies, encoded);
             break; }
+        case Batch: {
+            String contents;
+            if (!strcmp(optarg, "-")) {
+                char buf[16384];
+                size_t r;
+                while ((r = fread(buf, 1, sizeof(buf), stdin)) > 0)
+                    contents.append(buf, r);
+            } else {
+                const Path p = Path::resolved(optarg);
+                if (!p.isFile()) {
+                    fprintf(stderr, "%s is not a file\n", optarg);
+                    return Parse_Error;
+                }
+                contents = p.readAll();
+            }
+            List<QueryMessage::BatchQuery> queries;
+            if (!parseBatch(contents, queries))
+                return Parse_Error;
+            addQuery(QueryMessage::Batch, QueryMessage::encodeBatch(queries));
+            break; }
         case Tokens: {
             char path[PATH_MAX];
             uint32_t from, to;
@@ -1232,6 +1399,9 @@ RClient::ParseStatus RClient::parse(int &argc, char **argv)
         case TokensIncludeSymbols:
             mQueryFlags |= QueryMessage::TokensIncludeSymbols;
             break;
+        case Unsorted:
+            mQueryFlags |= QueryMessage::Unsorted;
+            break;
         case PreprocessFile: {
             Path p = optarg;
             p.resolve(Path::MakeAbsolute);
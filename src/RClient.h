@@ -37,6 +37,7 @@ public:
         AllDependencies,
         AllTargets,
         Autotest,
+        Batch,
         BuildIndex,
         CheckIncludes,
         CheckReindex,
@@ -78,6 +79,7 @@ public:
         FindVirtuals,
         FixIts,
         FollowLocation,
+        GarbageCollect,
         GenerateTest,
         GuessFlags,
         HasFileManager,
@@ -135,6 +137,7 @@ public:
         Tokens,
         TokensIncludeSymbols,
         UnsavedFile,
+        Unsorted,
         Verbose,
         Version,
 #ifdef RTAGS_HAS_LUA
@@ -161,6 +164,8 @@ public:
         Parse_Error
     };
     ParseStatus parse(int &argc, char **argv);
+    // Parses the queries for --batch, one per line
+    static bool parseBatch(const String &contents, List<QueryMessage::BatchQuery> &queries);
 
     Flags<Flag> flags() const { return mFlags; }
 
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <sys/types.h>
+#include <unistd.h>
 #ifdef OS_FreeBSD
 #include <sys/sysctl.h>
 #endif
@@ -92,6 +93,36 @@ Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t fil
     return str;
 }
 
+bool syncDirectory(const Path &dir)
+{
+    int fd;
+    eintrwrap(fd, open(dir.constData(), O_RDONLY));
+    if (fd == -1)
+        return false;
+    const bool ret = !fsync(fd);
+    int r;
+    eintrwrap(r, close(fd));
+    return ret;
+}
+
+bool syncFileSystem(const Path &path)
+{
+#if defined(OS_Linux)
+    int fd;
+    eintrwrap(fd, open(path.constData(), O_RDONLY));
+    if (fd == -1)
+        return false;
+    const bool ret = !syncfs(fd);
+    int r;
+    eintrwrap(r, close(fd));
+    return ret;
+#else
+    (void)path;
+    sync();
+    return true;
+#endif
+}
+
 
 Path findAncestor(Path path, const char *fn, Flags<FindAncestorFlag> flags = Flags<FindAncestorFlag>())
 {
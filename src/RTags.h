@@ -55,7 +55,7 @@ namespace RTags {
 enum {
     MajorVersion = 2,
     MinorVersion = 0,
-    DatabaseVersion = 92,
+    DatabaseVersion = 93,
     SourcesFileVersion = 5
 };
 
@@ -431,6 +431,10 @@ struct SortedSymbol
 };
 
 Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t fileId = 0);
+// fsync a directory so that renames into it are durable
+bool syncDirectory(const Path &dir);
+// flush everything on the file system that contains path
+bool syncFileSystem(const Path &path);
 
 template <typename Container, typename Value>
 inline bool addTo(Container &container, const Value &value)
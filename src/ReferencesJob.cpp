@@ -58,13 +58,83 @@ int ReferencesJob::execute()
                 }
             }
         };
-        proj->findSymbols(symbolName, inserter, queryFlags());
+        proj->findSymbols(symbolName, inserter, queryFlags(), 0, cancellation());
     }
+    Flags<QueryJob::WriteFlag> writeFlags;
+    Flags<Location::ToStringFlag> kf = locationToStringFlags();
+    if (queryFlags() & QueryMessage::Elisp) {
+        write("(list ", IgnoreMax | DontQuote);
+        writeFlags |= QueryJob::NoContext;
+    } else if (queryFlags() & QueryMessage::NoContext) {
+        writeFlags |= QueryJob::NoContext;
+    }
+
+    // In elisp mode only the start of each reference counts towards --max so
+    // a reference and the list around them are never cut off
+    auto writeCons = [this](const String &car, const String &cdr) {
+        write("(cons ", IgnoreMax | DontQuote);
+        write(car, IgnoreMax | DontQuote);
+        write(cdr, IgnoreMax);
+        write(")", IgnoreMax | DontQuote);
+    };
+
+    auto writeLoc = [this, writeCons, writeFlags, kf](Location loc) {
+        if (queryFlags() & QueryMessage::Elisp) {
+            if (!filterLocation(loc))
+                return;
+            if (!write("(list ", DontQuote))
+                return;
+            locationToString(loc, [writeCons, this](LocationPiece piece, const String &string) {
+                    switch (piece) {
+                    case Piece_ContainingFunctionLocation:
+                        if (queryFlags() & QueryMessage::ContainingFunctionLocation)
+                            writeCons("'cfl", string);
+                        break;
+                    case Piece_ContainingFunctionName:
+                        if (queryFlags() & QueryMessage::ContainingFunction)
+                            writeCons("'cf", string);
+                        break;
+                    case Piece_Location:
+                        writeCons("'loc", string);
+                        break;
+                    case Piece_Context:
+                        if (!(queryFlags() & QueryMessage::NoContext))
+                            writeCons("'ctx", string);
+                        break;
+                    case Piece_SymbolName:
+                    case Piece_Kind:
+                        break;
+                    }
+                });
+            write(")", IgnoreMax | DontQuote);
+        } else {
+            write(loc, writeFlags);
+        }
+    };
+
+    // With --unsorted references are written as they are found rather than
+    // collected and sorted first and we stop looking once --max is reached.
+    const bool unsorted = !rename && queryFlags() & QueryMessage::Unsorted;
+    Set<Location> written;
+    auto addReference = [&](Location loc, bool def, CXCursorKind kind) {
+        if (!unsorted) {
+            references[loc] = std::make_pair(def, kind);
+        } else if (!maxReached() && written.insert(loc)) {
+            writeLoc(loc);
+            if (maxReached())
+                abort();
+        }
+    };
+
+    // files the path filters reject aren't opened
+    std::function<bool(uint32_t)> acceptFile;
+    if (hasFilter())
+        acceptFile = [this](uint32_t fileId) { return filterFile(fileId); };
     const bool declarationOnly = queryFlags() & QueryMessage::DeclarationOnly;
     const bool definitionOnly = queryFlags() & QueryMessage::DefinitionOnly;
     Location startLocation;
     bool first = true;
-    for (auto it = locations.begin(); it != locations.end(); ++it) {
+    for (auto it = locations.begin(); it != locations.end() && !isAborted(); ++it) {
         const Location pos = *it;
         Symbol sym = proj->findSymbol(pos);
         if (sym.isNull())
@@ -75,7 +145,7 @@ int ReferencesJob::execute()
         }
 
         if (sym.isReference()) {
-            const Symbol target = proj->findTarget(sym);
+            const Symbol target = proj->findTarget(sym, cancellation());
             if (!target.isNull())
                 sym = target;
         }
@@ -87,7 +157,7 @@ int ReferencesJob::execute()
             sym.clear();
             const Set<String> usrs = proj->findTargetUsrs(loc);
             for (const String &usr : usrs) {
-                for (const Symbol &s : proj->findByUsr(usr, loc.fileId(), Project::ArgDependsOn, loc)) {
+                for (const Symbol &s : proj->findByUsr(usr, loc.fileId(), Project::ArgDependsOn, loc, cancellation())) {
                     if (s.isClass()) {
                         sym = s;
                         if (s.isDefinition())
@@ -100,7 +170,7 @@ int ReferencesJob::execute()
                 continue;
         }
         if (queryFlags() & QueryMessage::AllReferences) {
-            const Set<Symbol> all = proj->findAllReferences(sym);
+            const Set<Symbol> all = proj->findAllReferences(sym, cancellation(), acceptFile);
             for (const auto &symbol : all) {
                 if (rename) {
                     if (symbol.kind == CXCursor_MacroExpansion && sym.kind != CXCursor_MacroDefinition)
@@ -117,10 +187,10 @@ int ReferencesJob::execute()
                 } else if (definitionOnly) {
                     continue;
                 }
-                references[symbol.location] = std::make_pair(def, symbol.kind);
+                addReference(symbol.location, def, symbol.kind);
             }
         } else if (queryFlags() & QueryMessage::FindVirtuals) {
-            const Set<Symbol> virtuals = proj->findVirtuals(sym);
+            const Set<Symbol> virtuals = proj->findVirtuals(sym, cancellation(), acceptFile);
             for (const auto &symbol : virtuals) {
                 const bool def = symbol.isDefinition();
                 if (def) {
@@ -129,10 +199,10 @@ int ReferencesJob::execute()
                 } else if (definitionOnly) {
                     continue;
                 }
-                references[symbol.location] = std::make_pair(def, symbol.kind);
+                addReference(symbol.location, def, symbol.kind);
             }
         } else {
-            const Set<Symbol> symbols = proj->findCallers(sym);
+            const Set<Symbol> symbols = proj->findCallers(sym, cancellation(), acceptFile);
             for (const auto &symbol : symbols) {
                 const bool def = symbol.isDefinition();
                 if (def) {
@@ -141,59 +211,10 @@ int ReferencesJob::execute()
                 } else if (definitionOnly) {
                     continue;
                 }
-                references[symbol.location] = std::make_pair(false, CXCursor_FirstInvalid);
+                addReference(symbol.location, false, CXCursor_FirstInvalid);
             }
         }
     }
-    Flags<QueryJob::WriteFlag> writeFlags;
-    Flags<Location::ToStringFlag> kf = locationToStringFlags();
-    if (queryFlags() & QueryMessage::Elisp) {
-        write("(list ", DontQuote);
-        writeFlags |= QueryJob::NoContext;
-    } else if (queryFlags() & QueryMessage::NoContext) {
-        writeFlags |= QueryJob::NoContext;
-    }
-
-    auto writeCons = [this](const String &car, const String &cdr) {
-        write("(cons ", DontQuote);
-        write(car, DontQuote);
-        write(cdr);
-        write(")", DontQuote);
-    };
-
-    auto writeLoc = [this, writeCons, writeFlags, kf](Location loc) {
-        if (queryFlags() & QueryMessage::Elisp) {
-            if (!filterLocation(loc))
-                return;
-            write("(list ", DontQuote);
-            locationToString(loc, [writeCons, this](LocationPiece piece, const String &string) {
-                    switch (piece) {
-                    case Piece_ContainingFunctionLocation:
-                        if (queryFlags() & QueryMessage::ContainingFunctionLocation)
-                            writeCons("'cfl", string);
-                        break;
-                    case Piece_ContainingFunctionName:
-                        if (queryFlags() & QueryMessage::ContainingFunction)
-                            writeCons("'cf", string);
-                        break;
-                    case Piece_Location:
-                        writeCons("'loc", string);
-                        break;
-                    case Piece_Context:
-                        if (!(queryFlags() & QueryMessage::NoContext))
-                            writeCons("'ctx", string);
-                        break;
-                    case Piece_SymbolName:
-                    case Piece_Kind:
-                        break;
-                    }
-                });
-            write(")", DontQuote);
-        } else {
-            write(loc, writeFlags);
-        }
-    };
-
     if (rename) {
         if (!references.isEmpty()) {
             if (queryFlags() & QueryMessage::ReverseSort) {
@@ -237,7 +258,7 @@ int ReferencesJob::execute()
         }
     }
     if (queryFlags() & QueryMessage::Elisp)
-        write(")", DontQuote);
+        write(")", IgnoreMax | DontQuote);
 
-    return references.isEmpty() ? 1 : 0;
+    return references.isEmpty() && written.isEmpty() ? 1 : 0;
 }
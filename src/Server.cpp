@@ -20,14 +20,17 @@
 #include <clang/Basic/Version.h>
 #include <clang-c/Index.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <limits>
 #include <regex>
 
+#include "CancellationToken.h"
 #include "ClassHierarchyJob.h"
 #include "CompletionThread.h"
 #include "DependenciesJob.h"
 #include "ClangThread.h"
 #include "FileManager.h"
+#include "FileMapCache.h"
 #include "Filter.h"
 #include "FindFileJob.h"
 #include "FindSymbolsJob.h"
@@ -54,13 +57,16 @@
 #include "rct/QuitMessage.h"
 #include "rct/Rct.h"
 #include "rct/SocketClient.h"
+#include "rct/ThreadPool.h"
 #include "rct/Value.h"
 #include "ReferencesJob.h"
 #include "RTags.h"
 #include "RTagsLogOutput.h"
+#include "Snapshot.h"
 #include "Source.h"
 #include "StatusJob.h"
 #include "SymbolInfoJob.h"
+#include "SyncThread.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
 
@@ -75,9 +81,68 @@ static const List<Path> sSystemIncludePaths = {
     "/usr/lib"        // fedora, arch
 };
 
+namespace {
+class QueryThreadJob : public ThreadPool::Job
+{
+public:
+    QueryThreadJob(std::function<int()> &&query, std::function<void(int)> &&finished)
+        : mQuery(std::move(query)), mFinished(std::move(finished))
+    {}
+protected:
+    virtual void run() override
+    {
+        const int ret = mQuery();
+        // The query holds references to the project and the connection so it
+        // has to be destroyed on the main thread
+        std::function<void(int)> finished = mFinished;
+        EventLoop::mainEventLoop()->callLaterMove(std::function<void(std::function<int()> &&)>([finished, ret](std::function<int()> &&) {
+                    finished(ret);
+                }), std::move(mQuery));
+    }
+private:
+    std::function<int()> mQuery;
+    std::function<void(int)> mFinished;
+};
+
+class DecodeIndexDataJob : public ThreadPool::Job
+{
+public:
+    DecodeIndexDataJob(const std::shared_ptr<IndexDataMessage> &message,
+                       std::function<void(const std::shared_ptr<IndexDataMessage> &)> &&decoded)
+        : mMessage(message), mDecoded(std::move(decoded))
+    {}
+protected:
+    virtual void run() override
+    {
+        if (!mMessage->decodeSharedPayload())
+            mMessage->setFlag(IndexDataMessage::ParseFailure);
+        std::shared_ptr<IndexDataMessage> message = mMessage;
+        std::function<void(const std::shared_ptr<IndexDataMessage> &)> decoded = mDecoded;
+        EventLoop::mainEventLoop()->callLater([message, decoded]() { decoded(message); });
+    }
+private:
+    const std::shared_ptr<IndexDataMessage> mMessage;
+    const std::function<void(const std::shared_ptr<IndexDataMessage> &)> mDecoded;
+};
+}
+
+static inline void writeQueryOutput(const std::shared_ptr<Connection> &conn, const String &out)
+{
+    if (EventLoop::isMainThread()) {
+        conn->write(out);
+    } else {
+        std::weak_ptr<Connection> weak = conn;
+        EventLoop::mainEventLoop()->callLater([weak, out]() {
+                if (std::shared_ptr<Connection> c = weak.lock())
+                    c->write(out);
+            });
+    }
+}
+
 Server *Server::sInstance = 0;
 Server::Server()
-    : mSuspended(false), mPathEnvironment(Rct::pathEnvironment()), mExitCode(0), mLastFileId(0), mCompletionThread(0)
+    : mSuspended(false), mPathEnvironment(Rct::pathEnvironment()), mExitCode(0), mLastFileId(0), mCompletionThread(0), mSyncThread(0),
+      mQueryThreadPool(0), mScanThreadPool(0), mDecodeThreadPool(0), mActiveQueries(0)
 {
     assert(!sInstance);
     sInstance = this;
@@ -91,8 +156,23 @@ Server::~Server()
         delete mCompletionThread;
         mCompletionThread = 0;
     }
+    if (mSyncThread) {
+        mSyncThread->stop();
+        mSyncThread->join();
+        delete mSyncThread;
+        mSyncThread = 0;
+    }
 
     stopServers();
+    // waits for running queries
+    delete mQueryThreadPool;
+    mQueryThreadPool = 0;
+    delete mScanThreadPool;
+    mScanThreadPool = 0;
+    delete mDecodeThreadPool;
+    mDecodeThreadPool = 0;
+    for (const auto &project : mProjects)
+        project.second->saveHotFiles();
     mProjects.clear(); // need to be destroyed before sInstance is set to 0
     assert(sInstance == this);
     sInstance = 0;
@@ -104,7 +184,8 @@ bool Server::init(const Options &options)
     RTags::initMessages();
 
     mOptions = options;
-    mSuspended = (options.options & StartSuspended);
+    // exporting doesn't need to check whether anything is dirty
+    mSuspended = (options.options & StartSuspended) || !options.exportSnapshot.isEmpty();
     if (!(options.options & NoUnlimitedErrors))
         mOptions.defaultArguments << "-ferror-limit=0";
     if (options.options & Wall)
@@ -171,10 +252,49 @@ bool Server::init(const Options &options)
         clearProjects();
     }
 
-    mJobScheduler.reset(new JobScheduler);
+    {
+        // leave the other half for connections, rp pipes and files being
+        // written
+        struct rlimit rlp;
+        if (!getrlimit(RLIMIT_NOFILE, &rlp) && rlp.rlim_cur != RLIM_INFINITY)
+            FileMapCache::setMaxOpenFiles(std::max<size_t>(rlp.rlim_cur / 2, 16));
+    }
 
+    mJobScheduler.reset(new JobScheduler);
+    if (mOptions.queryThreadCount > 0)
+        mQueryThreadPool = new ThreadPool(mOptions.queryThreadCount, Thread::Normal, mOptions.threadStackSize);
+    if (mOptions.scanThreadCount > 0)
+        mScanThreadPool = new ThreadPool(mOptions.scanThreadCount, Thread::Normal, mOptions.threadStackSize);
+    // at most one payload per running rp
+    mDecodeThreadPool = new ThreadPool(std::max<int>(1, std::min<int>(mOptions.jobCount, ThreadPool::idealThreadCount())),
+                                       Thread::Normal, mOptions.threadStackSize);
+    IndexDataMessage::removeStaleSharedPayloads();
+
+    // No rp is started before a snapshot has been imported or exported
+    JobScheduler::JobScope scope(mJobScheduler);
     if (!load())
         return false;
+    if (!mOptions.importSnapshot.isEmpty() && !importSnapshot(mOptions.importSnapshot))
+        return false;
+    if (mOptions.gcInterval > 0) {
+        mGarbageCollectTimer.timeout().connect([this](Timer *) {
+                String report;
+                if (collectGarbage(false, &report)) {
+                    warning() << report;
+                } else {
+                    debug() << "Skipped garbage collection:" << report;
+                }
+            });
+        mGarbageCollectTimer.restart(mOptions.gcInterval * 60 * 1000);
+    }
+    {
+        enum { SaveHotFilesInterval = 10 * 60 * 1000 };
+        mSaveHotFilesTimer.timeout().connect([this](Timer *) {
+                for (const auto &project : mProjects)
+                    project.second->saveHotFiles();
+            });
+        mSaveHotFilesTimer.restart(SaveHotFilesInterval);
+    }
     if (!(mOptions.options & NoStartupCurrentProject)) {
         Path current = Path(mOptions.dataDir + ".currentProject").readAll(1024);
         RTags::decodePath(current);
@@ -189,6 +309,12 @@ bool Server::init(const Options &options)
             }
         }
     }
+    if (!mOptions.exportSnapshot.isEmpty()) {
+        mExitCode = exportSnapshot(mOptions.exportSnapshot) ? 0 : 1;
+        // rdm exits right away, the projects abort whatever they queued
+        // before the scope lets the scheduler start it
+        mProjects.clear();
+    }
     return true;
 }
 
@@ -517,7 +643,7 @@ bool Server::index(const String &args,
             }
             if (indexed)
                 indexed->insert(source.key());
-            if (!mCurrentProject.lock())
+            if (!currentProject())
                 setCurrentProject(project);
             project->index(std::shared_ptr<IndexerJob>(new IndexerJob(source, IndexerJob::Compile, project)));
             if (projectPtr)
@@ -563,6 +689,25 @@ void Server::handleLogOutputMessage(const std::shared_ptr<LogOutputMessage> &mes
 
 void Server::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage> &message, const std::shared_ptr<Connection> &conn)
 {
+    if (message->hasSharedPayload()) {
+        // Thousands of diagnostics and includes take a while to decode so
+        // it's done on the decode threads, where it doesn't hold up
+        // scanning. rp may exit once the connection is finished, the
+        // segment has to be opened before that.
+        const bool mapped = message->mapSharedPayload();
+        conn->finish();
+        if (!mapped) {
+            message->setFlag(IndexDataMessage::ParseFailure);
+            mJobScheduler->handleIndexDataMessage(message);
+            mIndexDataMessageReceived();
+            return;
+        }
+        mDecodeThreadPool->start(std::make_shared<DecodeIndexDataJob>(message, [this](const std::shared_ptr<IndexDataMessage> &msg) {
+                    mJobScheduler->handleIndexDataMessage(msg);
+                    mIndexDataMessageReceived();
+                }));
+        return;
+    }
     mJobScheduler->handleIndexDataMessage(message);
     conn->finish();
     mIndexDataMessageReceived();
@@ -678,6 +823,9 @@ void Server::handleQueryMessage(const std::shared_ptr<QueryMessage> &message, co
     case QueryMessage::ReloadFileManager:
         reloadFileManager(message, conn);
         break;
+    case QueryMessage::GarbageCollect:
+        garbageCollect(message, conn);
+        break;
     case QueryMessage::SetBuffers:
         setBuffers(message, conn);
         break;
@@ -690,6 +838,9 @@ void Server::handleQueryMessage(const std::shared_ptr<QueryMessage> &message, co
     case QueryMessage::Tokens:
         tokens(message, conn);
         break;
+    case QueryMessage::Batch:
+        batch(message, conn);
+        break;
     }
 }
 
@@ -709,14 +860,6 @@ void Server::followLocation(const std::shared_ptr<QueryMessage> &query, const st
         return;
     }
 
-    {
-        FollowLocationJob job(loc, query, project);
-        if (!job.run(conn)) {
-            conn->finish(0);
-            return;
-        }
-    }
-
     /* We will try with another project under the following circumstances:
 
        - We didn't find anything with the current project
@@ -725,6 +868,7 @@ void Server::followLocation(const std::shared_ptr<QueryMessage> &query, const st
        - The file in question does start with another project's path
     */
 
+    List<std::shared_ptr<Project> > fallbacks;
     const Path path = loc.path();
     if (!path.startsWith(project->path())) {
         for (const auto &proj : mProjects) {
@@ -733,20 +877,34 @@ void Server::followLocation(const std::shared_ptr<QueryMessage> &query, const st
                 paths[1].resolve();
                 for (const Path &projectPath : paths) {
                     if (path.startsWith(projectPath)) {
-                        FollowLocationJob job(loc, query, proj.second);
-                        if (job.run(conn)) {
-                            conn->finish(0);
-                            return;
-                        }
+                        fallbacks.append(proj.second);
+                        break;
                     }
                 }
             }
         }
     }
-    if (!project->dependencies().contains(loc.fileId())) {
-        conn->write("Not indexed");
-    }
-    conn->finish(1);
+    const bool indexed = project->dependencies().contains(loc.fileId());
+    const std::shared_ptr<CancellationToken> cancel = std::make_shared<CancellationToken>(query->deadline());
+    startQuery(conn, cancel, [loc, query, project, fallbacks, indexed, cancel, conn]() -> int {
+            {
+                FollowLocationJob job(loc, query, project);
+                job.setCancellationToken(cancel);
+                if (!job.run(conn))
+                    return 0;
+            }
+            for (const auto &proj : fallbacks) {
+                if (cancel->isCancelled())
+                    break;
+                FollowLocationJob job(loc, query, proj);
+                job.setCancellationToken(cancel);
+                if (job.run(conn))
+                    return 0;
+            }
+            if (!indexed)
+                writeQueryOutput(conn, "Not indexed");
+            return 1;
+        });
 }
 
 void Server::isIndexing(const std::shared_ptr<QueryMessage> &, const std::shared_ptr<Connection> &conn)
@@ -907,7 +1065,6 @@ void Server::generateTest(const std::shared_ptr<QueryMessage> &query, const std:
         conn->finish();
         return;
     }
-    project->beginScope();
 
     const Source source = project->sources(fileId).value(query->buildIndex());
     if (!source.isNull()) {
@@ -927,8 +1084,8 @@ void Server::generateTest(const std::shared_ptr<QueryMessage> &query, const std:
 
         Value tests;
 
-        for (const auto &dep : project->dependencies()) {
-            auto symbols = project->openSymbols(dep.first);
+        for (uint32_t dep : project->dependencies().fileIds()) {
+            auto symbols = project->openSymbols(dep);
             if (!symbols)
                 continue;
             const int count = symbols->count();
@@ -957,7 +1114,6 @@ void Server::generateTest(const std::shared_ptr<QueryMessage> &query, const std:
         conn->write<256>("%s build: %d not found", query->query().constData(), query->buildIndex());
         conn->finish();
     }
-    project->endScope();
 }
 
 void Server::cursorInfo(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -975,9 +1131,8 @@ void Server::cursorInfo(const std::shared_ptr<QueryMessage> &query, const std::s
         return;
     }
 
-    SymbolInfoJob job(loc, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<SymbolInfoJob> job(new SymbolInfoJob(loc, query, project));
+    startCachedQuery(job, conn);
 }
 
 void Server::dependencies(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1053,9 +1208,8 @@ void Server::referencesForLocation(const std::shared_ptr<QueryMessage> &query, c
         return;
     }
 
-    ReferencesJob job(loc, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<ReferencesJob> job(new ReferencesJob(loc, query, project));
+    startCachedQuery(job, conn);
 }
 
 void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1072,9 +1226,8 @@ void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const
         return;
     }
 
-    ReferencesJob job(name, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<ReferencesJob> job(new ReferencesJob(name, query, project));
+    startCachedQuery(job, conn);
 }
 
 void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1085,15 +1238,14 @@ void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::
     if (!project)
         project = currentProject();
 
-    int ret = 0;
     if (!project) {
-        ret = 1;
         error("No project");
-    } else {
-        FindSymbolsJob job(query, project);
-        ret = job.run(conn);
+        conn->finish(1);
+        return;
     }
-    conn->finish(ret);
+
+    std::shared_ptr<FindSymbolsJob> job(new FindSymbolsJob(query, project));
+    startCachedQuery(job, conn);
 }
 
 void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1110,9 +1262,8 @@ void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::
         return;
     }
 
-    ListSymbolsJob job(query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<ListSymbolsJob> job(new ListSymbolsJob(query, project));
+    startCachedQuery(job, conn);
 }
 
 void Server::status(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1166,6 +1317,14 @@ void Server::reloadFileManager(const std::shared_ptr<QueryMessage> &query, const
     }
 }
 
+void Server::garbageCollect(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
+{
+    String report;
+    const bool ok = collectGarbage(query->query() == "compact", &report);
+    conn->write(report);
+    conn->finish(ok ? 0 : 1);
+}
+
 void Server::hasFileManager(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
 {
     const Path path = query->query();
@@ -1284,7 +1443,12 @@ void Server::setCurrentProject(const std::shared_ptr<Project> &project)
     if (project != old) {
         if (old && old->fileManager())
             old->fileManager()->clearFileSystemWatcher();
-        mCurrentProject = project;
+        if (old)
+            old->cancelPrefetch();
+        {
+            std::lock_guard<std::mutex> lock(mCurrentProjectMutex);
+            mCurrentProject = project;
+        }
         if (project) {
             Path::mkdir(mOptions.dataDir);
             FILE *f = fopen((mOptions.dataDir + ".currentProject").constData(), "w");
@@ -1303,6 +1467,7 @@ void Server::setCurrentProject(const std::shared_ptr<Project> &project)
             }
             if (!(mOptions.options & NoFileManager))
                 project->fileManager()->load(FileManager::Synchronous);
+            project->prefetch();
             // project->diagnoseAll();
         } else {
             Path::rm(mOptions.dataDir + ".currentProject");
@@ -1310,6 +1475,170 @@ void Server::setCurrentProject(const std::shared_ptr<Project> &project)
     }
 }
 
+void Server::startQuery(const std::shared_ptr<Connection> &conn, const std::shared_ptr<CancellationToken> &cancel,
+                        std::function<int()> &&query)
+{
+    if (!mQueryThreadPool) {
+        conn->finish(query());
+        return;
+    }
+
+    ++mActiveQueries;
+    // no point in finishing a query nobody is waiting for
+    const auto key = conn->disconnected().connect([cancel](const std::shared_ptr<Connection> &) { cancel->cancel(); });
+    std::weak_ptr<Connection> weak = conn;
+    mQueryThreadPool->start(std::make_shared<QueryThreadJob>(std::move(query), [this, weak, key](int ret) {
+                --mActiveQueries;
+                if (std::shared_ptr<Connection> c = weak.lock()) {
+                    c->disconnected().disconnect(key);
+                    c->finish(ret);
+                }
+            }));
+}
+
+void Server::startCachedQuery(const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &conn)
+{
+    std::shared_ptr<Project> project = job->project();
+    const std::shared_ptr<QueryMessage> query = job->queryMessage();
+    // unsaved buffers can change the output without any reindexing
+    if (!project || !project->queryCache().isEnabled() || !query->unsavedFiles().isEmpty()) {
+        startQuery(conn, job->cancellationToken(), [job, conn]() { return job->run(conn); });
+        return;
+    }
+
+    const String key = query->cacheKey();
+    QueryCache::Result cached;
+    uint64_t generation;
+    if (project->queryCache().find(key, cached, &generation)) {
+        if (!(query->flags() & QueryMessage::SilentQuery))
+            warning() << "Answering" << query->query() << "from the query cache";
+        for (const String &line : cached.output)
+            conn->write(line);
+        conn->finish(cached.status);
+        return;
+    }
+
+    job->setRecordOutput(true);
+    startQuery(conn, job->cancellationToken(), [job, conn, key, generation]() {
+            QueryCache::Result result;
+            result.status = job->run(conn);
+            // partial output, e.g. because the client went away
+            if (!job->isAborted()) {
+                result.output = job->takeRecordedOutput();
+                job->project()->queryCache().insert(key, generation, job->cacheFiles(), std::move(result));
+            }
+            return result.status;
+        });
+}
+
+// Runs one query of a batch or takes its output from the project's query cache
+static QueryCache::Result runBatchQuery(const std::shared_ptr<QueryJob> &job)
+{
+    QueryCache &cache = job->project()->queryCache();
+    const bool cacheable = cache.isEnabled() && job->queryMessage()->unsavedFiles().isEmpty();
+    String key;
+    uint64_t generation = 0;
+    QueryCache::Result result;
+    if (cacheable) {
+        key = job->queryMessage()->cacheKey();
+        if (cache.find(key, result, &generation))
+            return result;
+    }
+    job->setRecordOutput(true);
+    result.status = job->run();
+    result.output = job->takeRecordedOutput();
+    if (cacheable && !job->isAborted()) {
+        QueryCache::Result copy = result;
+        cache.insert(key, generation, job->cacheFiles(), std::move(copy));
+    }
+    return result;
+}
+
+void Server::batch(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
+{
+    const List<QueryMessage::BatchQuery> queries = query->batch();
+    List<std::shared_ptr<QueryMessage> > messages;
+    std::shared_ptr<Project> project;
+    for (const QueryMessage::BatchQuery &q : queries) {
+        messages.append(query->batchQuery(q));
+        if (!project && messages.last()->flags() & QueryMessage::HasLocation)
+            project = projectForQuery(messages.last());
+    }
+    // all queries run against the same project
+    if (!project)
+        project = currentProject();
+    if (!project) {
+        error("No project");
+        conn->write("No project");
+        conn->finish(1);
+        return;
+    }
+
+    struct BatchJob {
+        uint32_t id;
+        std::shared_ptr<QueryJob> job; // null if the location isn't indexed
+    };
+    // Each job has its own token since jobs cancel themselves when they have
+    // written --max lines. They all derive from the batch's token so a
+    // disconnect or the deadline stops the job that is running as well.
+    const std::shared_ptr<CancellationToken> cancel = std::make_shared<CancellationToken>(query->deadline());
+    List<BatchJob> jobs;
+    for (size_t i=0; i<queries.size(); ++i) {
+        const std::shared_ptr<QueryMessage> &msg = messages.at(i);
+        Location loc;
+        if (msg->flags() & QueryMessage::HasLocation) {
+            loc = msg->location();
+            if (loc.isNull() || !project->dependencies().contains(loc.fileId())) {
+                jobs.append(BatchJob { queries.at(i).id, std::shared_ptr<QueryJob>() });
+                continue;
+            }
+        }
+        std::shared_ptr<QueryJob> job;
+        switch (msg->type()) {
+        case QueryMessage::FollowLocation: job.reset(new FollowLocationJob(loc, msg, project)); break;
+        case QueryMessage::SymbolInfo: job.reset(new SymbolInfoJob(loc, msg, project)); break;
+        case QueryMessage::ReferencesLocation: job.reset(new ReferencesJob(loc, msg, project)); break;
+        case QueryMessage::ClassHierarchy: job.reset(new ClassHierarchyJob(loc, msg, project)); break;
+        case QueryMessage::ReferencesName: job.reset(new ReferencesJob(msg->query(), msg, project)); break;
+        case QueryMessage::FindSymbols: job.reset(new FindSymbolsJob(msg, project)); break;
+        case QueryMessage::ListSymbols: job.reset(new ListSymbolsJob(msg, project)); break;
+        default: {
+            const String err = String::format<64>("Unsupported query in batch on line %u: %d",
+                                                  queries.at(i).id, msg->type());
+            error() << err;
+            conn->write(err);
+            conn->finish(1);
+            return; }
+        }
+        job->setCancellationToken(std::make_shared<CancellationToken>(cancel->deadline(), cancel));
+        jobs.append(BatchJob { queries.at(i).id, job });
+    }
+
+    startQuery(conn, cancel, [jobs, cancel, conn]() -> int {
+            int ret = 1;
+            for (const BatchJob &job : jobs) {
+                if (cancel->isCancelled())
+                    return 1;
+                QueryCache::Result result;
+                if (job.job) {
+                    result = runBatchQuery(job.job);
+                } else {
+                    result.status = 1;
+                    result.output.append("Not indexed");
+                }
+                if (!result.status)
+                    ret = 0;
+                String out = String::format<64>("%u %d %zu", job.id, result.status, result.output.size());
+                for (const String &line : result.output) {
+                    out.append('\n');
+                    out.append(line);
+                }
+                writeQueryOutput(conn, out);
+            }
+            return ret;
+        });
+}
+
 std::shared_ptr<Project> Server::projectForQuery(const std::shared_ptr<QueryMessage> &query)
 {
     List<Match> matches;
@@ -1488,21 +1817,18 @@ void Server::sources(const std::shared_ptr<QueryMessage> &query, const std::shar
                 if (sources.isEmpty() && path.isHeader()) {
                     Set<uint32_t> seen;
                     std::function<uint32_t(uint32_t)> findSource = [&findSource, &project, &seen](uint32_t fileId) {
-                        DependencyNode *node = project->dependencyNode(fileId);
                         uint32_t ret = 0;
-                        if (node) {
-                            for (const auto &dep : node->dependents) {
-                                if (!seen.insert(dep.first))
-                                    continue;
-
-                                if (Location::path(dep.first).isSource()) {
-                                    ret = dep.first;
+                        for (uint32_t dep : project->dependencies().dependents(fileId)) {
+                            if (!seen.insert(dep))
+                                continue;
+
+                            if (Location::path(dep).isSource()) {
+                                ret = dep;
+                                break;
+                            } else {
+                                ret  = findSource(dep);
+                                if (ret)
                                     break;
-                                } else {
-                                    ret  = findSource(dep.first);
-                                    if (ret)
-                                        break;
-                                }
                             }
                         }
                         return ret;
@@ -1673,8 +1999,8 @@ void Server::classHierarchy(const std::shared_ptr<QueryMessage> &query, const st
         return;
     }
 
-    ClassHierarchyJob job(loc, query, project);
-    conn->finish(job.run(conn));
+    std::shared_ptr<ClassHierarchyJob> job(new ClassHierarchyJob(loc, query, project));
+    startCachedQuery(job, conn);
 }
 
 void Server::debugLocations(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1728,8 +2054,9 @@ void Server::tokens(const std::shared_ptr<QueryMessage> &query, const std::share
         return;
     }
 
-    TokensJob job(query, fileId, from, to, project);
-    conn->finish(job.run(conn));
+    // Tokenizing a file that isn't indexed with index-tokens parses it
+    std::shared_ptr<TokensJob> job = std::make_shared<TokensJob>(query, fileId, from, to, project);
+    startQuery(conn, job->cancellationToken(), [job, conn]() { return job->run(conn); });
 }
 
 void Server::handleVisitFileMessage(const std::shared_ptr<VisitFileMessage> &message, const std::shared_ptr<Connection> &conn)
@@ -1849,6 +2176,152 @@ bool Server::load()
     return true;
 }
 
+bool Server::importSnapshot(const Path &archive)
+{
+    const Path root = Path::pwd().ensureTrailingSlash();
+    if (mProjects.contains(root)) {
+        error() << "Can't import snapshot" << archive << "project" << root << "already exists";
+        return false;
+    }
+    std::shared_ptr<Project> project(new Project(root));
+    String err;
+    if (!Snapshot::importProject(project, archive, &err)) {
+        error("Failed to import snapshot %s: %s", archive.constData(), err.constData());
+        return false;
+    }
+    mProjects[root] = project;
+    project->init();
+    setCurrentProject(project);
+    error() << "Imported snapshot" << archive << "to" << root;
+    return true;
+}
+
+bool Server::exportSnapshot(const Path &archive)
+{
+    const Path pwd = Path::pwd().ensureTrailingSlash();
+    std::shared_ptr<Project> project;
+    for (const auto &proj : mProjects) {
+        if (pwd.startsWith(proj.first) && (!project || proj.first.size() > project->path().size()))
+            project = proj.second;
+    }
+    if (!project)
+        project = currentProject();
+    if (!project) {
+        error() << "No project to export";
+        return false;
+    }
+    String err;
+    if (!Snapshot::exportProject(project, archive, &err)) {
+        error("Failed to export snapshot %s: %s", archive.constData(), err.constData());
+        return false;
+    }
+    error() << "Exported" << project->path() << "to" << archive;
+    return true;
+}
+
+bool Server::collectGarbage(bool compact, String *report)
+{
+    if (mActiveQueries) {
+        *report = "Can't collect garbage while queries are running";
+        return false;
+    }
+    for (const auto &project : mProjects) {
+        if (project.second->isIndexing()) {
+            *report = "Can't collect garbage while " + project.first + " is indexing";
+            return false;
+        }
+    }
+
+    const uint32_t lastIdBefore = Location::lastId();
+
+    FileIdSet referenced = mActiveBuffers;
+    referenced.unite(mJobScheduler->headerErrors());
+    int directories = 0, files = 0;
+    uint64_t reclaimed = 0;
+    for (const auto &project : mProjects)
+        project.second->collectGarbage(referenced, directories, files, reclaimed);
+
+    // The last id stays where it is so a removed id is never handed out
+    // again while rdm is running
+    List<uint32_t> unreferenced;
+    for (const auto &it : Location::pathsToIds()) {
+        if (!referenced.contains(it.second))
+            unreferenced.append(it.second);
+    }
+    Location::remove(unreferenced);
+
+    String err;
+    const bool ok = !compact || compactFileIds(&err);
+
+    // The last id may not have changed, make sure the file is rewritten
+    mLastFileId = std::numeric_limits<uint32_t>::max();
+    saveFileIds();
+
+    *report = String::format<256>("Removed %d directories, %d temporary files and %zu file ids. Reclaimed %llu bytes.",
+                                  directories, files, unreferenced.size(), static_cast<unsigned long long>(reclaimed));
+    if (compact && ok)
+        *report << String::format<128>(" Last file id %u => %u.", lastIdBefore, Location::lastId());
+    if (!ok)
+        *report << " " << err;
+    return ok;
+}
+
+// Renumbers file ids by taking a snapshot of every project and importing
+// them again into an empty file id table. This is the only place the last
+// id goes down. It's only done on request and collectGarbage has made sure
+// no project has a job queued or running.
+bool Server::compactFileIds(String *err)
+{
+    Hash<Path, Path> snapshots;
+    for (const auto &project : mProjects) {
+        const Path archive = String::format<1024>("%s.gc-%zu.snapshot", mOptions.dataDir.constData(), snapshots.size());
+        if (!Snapshot::exportProject(project.second, archive, err)) {
+            for (const auto &snapshot : snapshots)
+                Path::rm(snapshot.second);
+            return false;
+        }
+        snapshots[project.first] = archive;
+    }
+
+    const std::shared_ptr<Project> current = currentProject();
+    const Path currentPath = current ? current->path() : Path();
+    List<Path> activeBuffers;
+    for (uint32_t fileId : mActiveBuffers)
+        activeBuffers.append(Location::path(fileId));
+    for (uint32_t fileId : mJobScheduler->headerErrors())
+        mJobScheduler->clearHeaderError(fileId);
+    setCurrentProject(std::shared_ptr<Project>());
+
+    Location::init(Hash<Path, uint32_t>());
+    bool ret = true;
+    for (const auto &snapshot : snapshots) {
+        Path dir = snapshot.first;
+        RTags::encodePath(dir);
+        mProjects.remove(snapshot.first);
+        Rct::removeDirectory(mOptions.dataDir + dir);
+
+        std::shared_ptr<Project> project(new Project(snapshot.first));
+        String importError;
+        if (Snapshot::importProject(project, snapshot.second, &importError)) {
+            Path::rm(snapshot.second);
+        } else {
+            error("Failed to restore %s after compacting file ids, project data is kept in %s: %s",
+                  snapshot.first.constData(), snapshot.second.constData(), importError.constData());
+            *err = "Failed to restore " + snapshot.first + ": " + importError;
+            ret = false;
+        }
+        mProjects[snapshot.first] = project;
+        project->init();
+    }
+
+    mActiveBuffers.clear();
+    for (const Path &path : activeBuffers)
+        mActiveBuffers.insert(Location::insertFile(path));
+    if (const std::shared_ptr<Project> project = mProjects.value(currentPath))
+        setCurrentProject(project);
+    return ret;
+}
+
 bool Server::saveFileIds()
 {
     const uint32_t lastId = Location::lastId();
@@ -2157,3 +2630,12 @@ bool Server::runTests()
 
     return ret;
 }
+
+void Server::syncFileSystem(const Path &path)
+{
+    if (!mSyncThread) {
+        mSyncThread = new SyncThread;
+        mSyncThread->start();
+    }
+    mSyncThread->sync(path);
+}
@@ -16,6 +16,8 @@
 #ifndef Server_h
 #define Server_h
 
+#include <mutex>
+
 #include "IndexMessage.h"
 #include "rct/Flags.h"
 #include "rct/Hash.h"
@@ -23,6 +25,7 @@
 #include "rct/SocketServer.h"
 #include "rct/String.h"
 #include "rct/Thread.h"
+#include "rct/Timer.h"
 #include "Source.h"
 #ifdef OS_Darwin
 #include <Availability.h>
@@ -32,6 +35,7 @@
 #endif
 #endif
 
+class CancellationToken;
 class CompletionThread;
 class Connection;
 class ErrorMessage;
@@ -42,8 +46,10 @@ class Message;
 class OutputMessage;
 class Project;
 class QueryMessage;
+class SyncThread;
 class VisitFileMessage;
 class JobScheduler;
+class ThreadPool;
 class Server
 {
 public:
@@ -79,24 +85,29 @@ public:
         NoFileLock = 0x1000000,
         PCHEnabled = 0x2000000,
         NoFileManager = 0x4000000,
-        ValidateFileMaps = 0x8000000
+        ValidateFileMaps = 0x8000000,
+        SyncFileMaps = 0x10000000,
+        PruneBlockedHeaders = 0x20000000,
+        IndexerCallbacks = 0x40000000
     };
     struct Options {
         Options()
             : jobCount(0), headerErrorJobCount(0), maxIncludeCompletionDepth(0),
               rpVisitFileTimeout(0), rpIndexDataMessageTimeout(0), rpConnectTimeout(0),
-              rpConnectAttempts(0), rpNiceValue(0), threadStackSize(0), maxCrashCount(0),
+              rpConnectAttempts(0), rpNiceValue(0), rpSessionJobs(0), rpWriteThreads(0), threadStackSize(0), maxCrashCount(0),
               completionCacheSize(0), testTimeout(60 * 1000 * 5),
-              maxFileMapScopeCacheSize(512), tcpPort(0)
+              maxFileMapCacheSize(512), maxFileMapCacheMemory(1024), fileMapSyncBatchSize(0), gcInterval(0), prefetchBudget(0),
+              queryThreadCount(0), scanThreadCount(0), queryCacheSize(0), tcpPort(0)
         {
         }
 
-        Path socketFile, dataDir, argTransform, rp, sandboxRoot;
+        Path socketFile, dataDir, argTransform, rp, sandboxRoot, exportSnapshot, importSnapshot;
         Flags<Option> options;
         size_t jobCount, headerErrorJobCount, maxIncludeCompletionDepth;
         int rpVisitFileTimeout, rpIndexDataMessageTimeout,
-            rpConnectTimeout, rpConnectAttempts, rpNiceValue, threadStackSize, maxCrashCount,
-            completionCacheSize, testTimeout, maxFileMapScopeCacheSize;
+            rpConnectTimeout, rpConnectAttempts, rpNiceValue, rpSessionJobs, rpWriteThreads, threadStackSize, maxCrashCount,
+            completionCacheSize, testTimeout, maxFileMapCacheSize, maxFileMapCacheMemory, fileMapSyncBatchSize, gcInterval, prefetchBudget,
+            queryThreadCount, scanThreadCount, queryCacheSize;
         uint16_t tcpPort;
         List<String> defaultArguments, excludeFilters;
         Set<String> blockedArguments;
@@ -116,10 +127,18 @@ public:
     void stopServers();
     void dumpJobs(const std::shared_ptr<Connection> &conn);
     std::shared_ptr<JobScheduler> jobScheduler() const { return mJobScheduler; }
+    // Used by queries that scan every file in a project, see ParallelScan
+    ThreadPool *scanThreadPool() const { return mScanThreadPool; }
+    // Syncs the file system path lives on from a thread of its own
+    void syncFileSystem(const Path &path);
     const Set<uint32_t> &activeBuffers() const { return mActiveBuffers; }
     bool isActiveBuffer(uint32_t fileId) const { return mActiveBuffers.contains(fileId); }
     int exitCode() const { return mExitCode; }
-    std::shared_ptr<Project> currentProject() const { return mCurrentProject.lock(); }
+    std::shared_ptr<Project> currentProject() const
+    {
+        std::lock_guard<std::mutex> lock(mCurrentProjectMutex);
+        return mCurrentProject.lock();
+    }
     void onNewMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn);
     bool saveFileIds();
     bool index(const String &arguments,
@@ -136,6 +155,10 @@ public:
 private:
     String guessArguments(const String &args, const Path &pwd, const Path &projectRootOverride);
     bool load();
+    bool importSnapshot(const Path &archive);
+    bool exportSnapshot(const Path &archive);
+    bool collectGarbage(bool compact, String *report);
+    bool compactFileIds(String *error);
     void onNewConnection(SocketServer *server);
     void setCurrentProject(const std::shared_ptr<Project> &project);
     void clearProjects();
@@ -160,6 +183,7 @@ private:
     void findSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void fixIts(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void followLocation(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
+    void garbageCollect(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void hasFileManager(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void includeFile(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void isIndexed(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
@@ -183,7 +207,16 @@ private:
     void classHierarchy(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void debugLocations(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void tokens(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
+    void batch(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
 
+    // Runs query on a query thread (or right away if there are none) and
+    // finishes conn with its return value on the main thread. cancel is
+    // cancelled if conn disconnects before that.
+    void startQuery(const std::shared_ptr<Connection> &conn, const std::shared_ptr<CancellationToken> &cancel,
+                    std::function<int()> &&query);
+    // Like startQuery but answers from the project's QueryCache if it can
+    // and adds the output to it otherwise
+    void startCachedQuery(const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &conn);
     std::shared_ptr<Project> projectForQuery(const std::shared_ptr<QueryMessage> &queryMessage);
     std::shared_ptr<Project> addProject(const Path &path);
 
@@ -193,6 +226,8 @@ private:
     typedef Hash<Path, std::shared_ptr<Project> > ProjectsMap;
     ProjectsMap mProjects;
     std::weak_ptr<Project> mCurrentProject;
+    // currentProject() is called from query threads
+    mutable std::mutex mCurrentProjectMutex;
 
     static Server *sInstance;
     Options mOptions;
@@ -204,7 +239,13 @@ private:
     uint32_t mLastFileId;
     std::shared_ptr<JobScheduler> mJobScheduler;
     CompletionThread *mCompletionThread;
+    SyncThread *mSyncThread;
+    ThreadPool *mQueryThreadPool, *mScanThreadPool;
+    // decodes IndexDataMessages that came in shared memory
+    ThreadPool *mDecodeThreadPool;
+    int mActiveQueries;
     Set<uint32_t> mActiveBuffers;
+    Timer mGarbageCollectTimer, mSaveHotFilesTimer;
     Set<std::shared_ptr<Connection> > mConnections;
 
     Signal<std::function<void()> > mIndexDataMessageReceived;
@@ -0,0 +1,550 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "Snapshot.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef RTAGS_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#include "Diagnostic.h"
+#include "FileMap.h"
+#include "FileMapBuilder.h"
+#include "Project.h"
+#include "rct/Log.h"
+#include "rct/Rct.h"
+#include "RTags.h"
+#include "Server.h"
+#include "Source.h"
+#include "Symbol.h"
+#include "Token.h"
+
+namespace {
+enum {
+    Magic = 0x53535452, // "RTSS"
+    Version = 1
+};
+
+enum BlockType {
+    MetaBlock = 1,
+    UnitBlock = 2,
+    EndBlock = 3
+};
+
+enum BlockFlag {
+    Compressed = 0x1
+};
+
+struct FileHeader {
+    uint32_t magic, version, databaseVersion, flags;
+};
+
+struct BlockHeader {
+    uint32_t type, flags;
+    uint64_t size, storedSize, checksum;
+};
+
+const Project::FileMapType fileMapTypes[] = {
+    Project::Symbols,
+    Project::SymbolNames,
+    Project::Targets,
+    Project::Usrs,
+    Project::Tokens
+};
+
+struct Relocator
+{
+    Path oldRoot, newRoot;
+    Hash<uint32_t, uint32_t> fileIds;
+
+    Path path(const Path &p) const
+    {
+        if (oldRoot != newRoot && p.startsWith(oldRoot))
+            return newRoot + p.mid(oldRoot.size());
+        return p;
+    }
+
+    void replace(String &str) const
+    {
+        if (oldRoot != newRoot)
+            str.replace(oldRoot, newRoot);
+    }
+
+    Location location(Location loc) const
+    {
+        if (loc.isNull())
+            return loc;
+        const uint32_t fileId = fileIds.value(loc.fileId());
+        return fileId ? Location(fileId, loc.line(), loc.column()) : Location();
+    }
+
+    Set<Location> locations(const Set<Location> &locs) const
+    {
+        Set<Location> ret;
+        for (Location loc : locs) {
+            loc = location(loc);
+            if (!loc.isNull())
+                ret.insert(loc);
+        }
+        return ret;
+    }
+
+    Diagnostics diagnostics(const Diagnostics &diags) const
+    {
+        Diagnostics ret;
+        for (const auto &diag : diags) {
+            const Location loc = location(diag.first);
+            if (loc.isNull())
+                continue;
+            Diagnostic &d = ret[loc];
+            d.type = diag.second.type;
+            d.message = diag.second.message;
+            d.length = diag.second.length;
+            for (const auto &range : diag.second.ranges) {
+                const Location r = location(range.first);
+                if (!r.isNull())
+                    d.ranges[r] = range.second;
+            }
+            d.children = diagnostics(diag.second.children);
+        }
+        return ret;
+    }
+
+    bool source(Source &source) const
+    {
+        source.fileId = fileIds.value(source.fileId);
+        source.compilerId = fileIds.value(source.compilerId);
+        source.buildRootId = fileIds.value(source.buildRootId);
+        if (!source.fileId)
+            return false;
+        source.extraCompiler = path(source.extraCompiler);
+        source.directory = path(source.directory);
+        for (auto &inc : source.includePaths)
+            inc.path = path(inc.path);
+        for (auto &arg : source.arguments)
+            replace(arg);
+        return true;
+    }
+};
+}
+
+static inline uint64_t checksum(const char *data, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t contentHash(const Path &path)
+{
+    const String contents = path.readAll();
+    return checksum(contents.constData(), contents.size());
+}
+
+static bool writeBlock(FILE *f, BlockType type, const String &data)
+{
+    BlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.size = header.storedSize = data.size();
+    const char *stored = data.constData();
+#ifdef RTAGS_HAS_ZLIB
+    String compressed;
+    if (!data.isEmpty()) {
+        uLongf len = compressBound(data.size());
+        compressed.resize(len);
+        if (compress2(reinterpret_cast<Bytef*>(compressed.data()), &len,
+                      reinterpret_cast<const Bytef*>(data.constData()), data.size(),
+                      Z_DEFAULT_COMPRESSION) == Z_OK && len < static_cast<uLongf>(data.size())) {
+            header.flags |= Compressed;
+            header.storedSize = len;
+            stored = compressed.constData();
+        }
+    }
+#endif
+    header.checksum = checksum(stored, header.storedSize);
+    return (fwrite(&header, sizeof(header), 1, f) == 1
+            && (!header.storedSize || fwrite(stored, header.storedSize, 1, f) == 1));
+}
+
+static bool readBlock(FILE *f, BlockType &type, String &data, String *error)
+{
+    BlockHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        *error = "Snapshot is truncated";
+        return false;
+    }
+    const long pos = ftell(f);
+    struct stat st;
+    if (pos == -1 || fstat(fileno(f), &st) || header.storedSize > static_cast<uint64_t>(st.st_size - pos)) {
+        *error = "Snapshot is truncated";
+        return false;
+    }
+    String stored;
+    stored.resize(header.storedSize);
+    if (header.storedSize && fread(stored.data(), header.storedSize, 1, f) != 1) {
+        *error = "Snapshot is truncated";
+        return false;
+    }
+    if (checksum(stored.constData(), stored.size()) != header.checksum) {
+        *error = String::format<128>("Checksum mismatch in snapshot block at offset %ld", pos);
+        return false;
+    }
+    if (header.flags & Compressed) {
+#ifdef RTAGS_HAS_ZLIB
+        data.resize(header.size);
+        uLongf len = header.size;
+        if (uncompress(reinterpret_cast<Bytef*>(data.data()), &len,
+                       reinterpret_cast<const Bytef*>(stored.constData()), stored.size()) != Z_OK
+            || len != header.size) {
+            *error = String::format<128>("Failed to uncompress snapshot block at offset %ld", pos);
+            return false;
+        }
+#else
+        *error = "Snapshot is compressed but rdm was built without zlib";
+        return false;
+#endif
+    } else if (header.size != header.storedSize) {
+        *error = String::format<128>("Invalid snapshot block at offset %ld", pos);
+        return false;
+    } else {
+        data = std::move(stored);
+    }
+    type = static_cast<BlockType>(header.type);
+    return true;
+}
+
+static bool writeSnapshot(const std::shared_ptr<Project> &project, FILE *f, String *error)
+{
+    const FileHeader fileHeader = { Magic, Version, RTags::DatabaseVersion, 0 };
+    if (fwrite(&fileHeader, sizeof(fileHeader), 1, f) != 1) {
+        *error = "Failed to write snapshot header: " + Rct::strerror();
+        return false;
+    }
+
+    const DependencyGraph &graph = project->dependencies();
+    const List<uint32_t> nodes = graph.fileIds();
+    const Sources sources = project->sources();
+
+    Set<uint32_t> fileIds;
+    for (uint32_t fileId : nodes)
+        fileIds.insert(fileId);
+    for (const auto &src : sources) {
+        fileIds.insert(src.second.fileId);
+        fileIds.insert(src.second.compilerId);
+        fileIds.insert(src.second.buildRootId);
+    }
+    fileIds.remove(0);
+
+    {
+        String meta;
+        Serializer serializer(meta);
+        serializer << project->path();
+
+        // Only files that are part of the dependency graph get a content hash,
+        // compilers and build roots don't decide whether a source is dirty.
+        serializer << static_cast<uint32_t>(fileIds.size());
+        for (uint32_t fileId : fileIds) {
+            const Path path = Location::path(fileId);
+            const uint64_t hash = graph.contains(fileId) ? contentHash(path) : 0;
+            serializer << fileId << path << hash;
+        }
+
+        serializer << static_cast<uint32_t>(sources.size());
+        for (const auto &src : sources)
+            src.second.encode(serializer, Source::IgnoreSandbox);
+
+        serializer << project->compilationDataBaseInfos() << project->diagnostics();
+
+        serializer << static_cast<uint32_t>(nodes.size());
+        for (uint32_t fileId : nodes) {
+            List<uint32_t> includes;
+            for (uint32_t inc : graph.includes(fileId))
+                includes.append(inc);
+            serializer << fileId << includes;
+        }
+
+        if (!writeBlock(f, MetaBlock, meta)) {
+            *error = "Failed to write snapshot: " + Rct::strerror();
+            return false;
+        }
+    }
+
+    for (uint32_t fileId : fileIds) {
+        if (!project->sourceFilePath(fileId).isDir())
+            continue;
+        Hash<String, String> files;
+        for (Project::FileMapType type : fileMapTypes) {
+            const Path path = project->sourceFilePath(fileId, Project::fileMapName(type));
+            if (path.isFile())
+                files[Project::fileMapName(type)] = path.readAll();
+        }
+        const Path info = project->sourceFilePath(fileId, "info");
+        if (info.isFile())
+            files["info"] = info.readAll();
+
+        String unit;
+        Serializer serializer(unit);
+        serializer << fileId << files;
+        if (!writeBlock(f, UnitBlock, unit)) {
+            *error = "Failed to write snapshot: " + Rct::strerror();
+            return false;
+        }
+    }
+
+    if (!writeBlock(f, EndBlock, String())) {
+        *error = "Failed to write snapshot: " + Rct::strerror();
+        return false;
+    }
+    return true;
+}
+
+template <typename Key, typename Value>
+static bool rewriteFileMap(const String &data, const Path &path,
+                           const std::function<bool(Key &key, Value &value)> &relocate)
+{
+    if (data.size() < sizeof(uint32_t) * 2)
+        return false;
+    FileMap<Key, Value> in;
+    in.init(data.constData(), data.size());
+    // relocated keys may sort differently, FileMapBuilder sorts them again
+    FileMapBuilder<Key, Value> out;
+    out.reserve(in.count());
+    for (uint32_t i=0; i<in.count(); ++i) {
+        Key key = in.keyAt(i);
+        Value value = in.valueAt(i);
+        if (relocate(key, value))
+            out.append(std::move(key), std::move(value));
+    }
+    return out.write(path, 0);
+}
+
+static bool writeUnit(const std::shared_ptr<Project> &project, const Relocator &relocator,
+                      uint32_t fileId, const String &name, String &data)
+{
+    const Path path = project->sourceFilePath(fileId, name.constData());
+    if (name == "info") {
+        relocator.replace(data);
+        Path::mkdir(path.parentDir(), Path::Recursive);
+        FILE *f = fopen(path.constData(), "w");
+        if (!f)
+            return false;
+        const bool ok = data.isEmpty() || fwrite(data.constData(), data.size(), 1, f) == 1;
+        return !fclose(f) && ok;
+    } else if (name == Project::fileMapName(Project::Symbols)) {
+        return rewriteFileMap<Location, Symbol>(data, path, [&relocator](Location &key, Symbol &symbol) {
+                key = relocator.location(key);
+                symbol.location = relocator.location(symbol.location);
+                // file symbols are named after their path
+                relocator.replace(symbol.symbolName);
+                relocator.replace(symbol.usr);
+                for (auto &arg : symbol.arguments)
+                    arg.first = relocator.location(arg.first);
+                return !key.isNull();
+            });
+    } else if (name == Project::fileMapName(Project::Tokens)) {
+        return rewriteFileMap<uint32_t, Token>(data, path, [&relocator](uint32_t &, Token &token) {
+                token.location = relocator.location(token.location);
+                return true;
+            });
+    } else if (name == Project::fileMapName(Project::SymbolNames)
+               || name == Project::fileMapName(Project::Targets)
+               || name == Project::fileMapName(Project::Usrs)) {
+        return rewriteFileMap<String, Set<Location> >(data, path, [&relocator](String &key, Set<Location> &locations) {
+                // file symbols and the targets of includes and statements
+                // are keyed on paths
+                relocator.replace(key);
+                locations = relocator.locations(locations);
+                return !locations.isEmpty();
+            });
+    }
+    warning() << "Unknown file in snapshot" << name;
+    return true;
+}
+
+static bool readSnapshot(const std::shared_ptr<Project> &project, FILE *f, String *error)
+{
+    FileHeader fileHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, f) != 1 || fileHeader.magic != Magic) {
+        *error = "Not a snapshot";
+        return false;
+    }
+    if (fileHeader.version != Version || fileHeader.databaseVersion != RTags::DatabaseVersion) {
+        *error = String::format<128>("Snapshot has wrong format. Got %d/%d expected %d/%d",
+                                     fileHeader.version, fileHeader.databaseVersion,
+                                     Version, RTags::DatabaseVersion);
+        return false;
+    }
+
+    BlockType type;
+    String data;
+    if (!readBlock(f, type, data, error))
+        return false;
+    if (type != MetaBlock) {
+        *error = "Snapshot is missing its project block";
+        return false;
+    }
+
+    Relocator relocator;
+    relocator.newRoot = project->path();
+    Set<uint32_t> changed;
+    Sources sources;
+    Hash<Path, CompilationDataBaseInfo> infos;
+    Diagnostics diagnostics;
+    Hash<uint32_t, List<uint32_t> > includes;
+    {
+        Deserializer deserializer(data);
+        deserializer >> relocator.oldRoot;
+
+        uint32_t count;
+        deserializer >> count;
+        while (count--) {
+            uint32_t id;
+            Path path;
+            uint64_t hash;
+            deserializer >> id >> path >> hash;
+            if (path.isEmpty())
+                continue;
+            path = relocator.path(path);
+            const uint32_t fileId = Location::insertFile(path, false);
+            relocator.fileIds[id] = fileId;
+            if (hash && contentHash(path) != hash)
+                changed.insert(fileId);
+        }
+        Server::instance()->saveFileIds();
+
+        deserializer >> count;
+        while (count--) {
+            Source source;
+            source.decode(deserializer, Source::IgnoreSandbox, Source::IgnoreLocations);
+            if (relocator.source(source))
+                sources[source.key()] = std::move(source);
+        }
+
+        Hash<Path, CompilationDataBaseInfo> oldInfos;
+        Diagnostics oldDiagnostics;
+        deserializer >> oldInfos >> oldDiagnostics;
+        for (auto &info : oldInfos)
+            infos[relocator.path(info.first)] = std::move(info.second);
+        diagnostics = relocator.diagnostics(oldDiagnostics);
+
+        deserializer >> count;
+        while (count--) {
+            uint32_t id;
+            List<uint32_t> incs;
+            deserializer >> id >> incs;
+            const uint32_t fileId = relocator.fileIds.value(id);
+            if (!fileId)
+                continue;
+            List<uint32_t> &ref = includes[fileId];
+            for (uint32_t inc : incs) {
+                if (const uint32_t incId = relocator.fileIds.value(inc))
+                    ref.append(incId);
+            }
+        }
+    }
+
+    while (true) {
+        if (!readBlock(f, type, data, error))
+            return false;
+        if (type == EndBlock)
+            break;
+        if (type != UnitBlock) {
+            *error = String::format<64>("Unknown snapshot block type %d", type);
+            return false;
+        }
+        Deserializer deserializer(data);
+        uint32_t id;
+        Hash<String, String> files;
+        deserializer >> id >> files;
+        const uint32_t fileId = relocator.fileIds.value(id);
+        if (!fileId)
+            continue;
+        for (auto &file : files) {
+            if (!writeUnit(project, relocator, fileId, file.first, file.second)) {
+                *error = "Failed to write " + project->sourceFilePath(fileId, file.first.constData());
+                return false;
+            }
+        }
+    }
+
+    // A source is considered up to date if none of the files it depends on
+    // changed since the snapshot was taken. The rest are left for
+    // IfModifiedDirty to reindex when the project is initialized.
+    const uint64_t now = Rct::currentTimeMs();
+    for (auto &src : sources) {
+        Source &source = src.second;
+        Set<uint32_t> seen;
+        List<uint32_t> pending;
+        pending.append(source.fileId);
+        seen.insert(source.fileId);
+        bool dirty = false;
+        while (!dirty && !pending.isEmpty()) {
+            const uint32_t fileId = pending.back();
+            pending.pop_back();
+            dirty = changed.contains(fileId);
+            for (uint32_t inc : includes.value(fileId)) {
+                if (seen.insert(inc))
+                    pending.append(inc);
+            }
+        }
+        source.parsed = dirty ? 0 : now;
+    }
+
+    return project->restoreSnapshot(std::move(sources), std::move(infos), std::move(diagnostics), includes);
+}
+
+namespace Snapshot {
+bool exportProject(const std::shared_ptr<Project> &project, const Path &archive, String *error)
+{
+    const Path tmp = archive + ".tmp";
+    FILE *f = fopen(tmp.constData(), "w");
+    if (!f) {
+        *error = "Can't open " + tmp + " for writing: " + Rct::strerror();
+        return false;
+    }
+    bool ok = writeSnapshot(project, f, error);
+    if (fclose(f) && ok) {
+        *error = "Failed to write snapshot: " + Rct::strerror();
+        ok = false;
+    }
+    if (ok && rename(tmp.constData(), archive.constData())) {
+        *error = "Can't rename " + tmp + " to " + archive + ": " + Rct::strerror();
+        ok = false;
+    }
+    if (!ok)
+        unlink(tmp.constData());
+    return ok;
+}
+
+bool importProject(const std::shared_ptr<Project> &project, const Path &archive, String *error)
+{
+    FILE *f = fopen(archive.constData(), "r");
+    if (!f) {
+        *error = "Can't open " + archive + ": " + Rct::strerror();
+        return false;
+    }
+    const bool ok = readSnapshot(project, f, error);
+    fclose(f);
+    return ok;
+}
+}
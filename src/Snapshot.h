@@ -0,0 +1,43 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef Snapshot_h
+#define Snapshot_h
+
+#include <memory>
+
+#include "rct/Path.h"
+#include "rct/String.h"
+
+class Project;
+
+/*
+ * A snapshot is a single file containing everything rdm knows about a
+ * project: sources, dependencies, diagnostics and the per-file maps, along
+ * with the path and a content hash of every file referenced. It is written as
+ * a list of individually checksummed (and, when built with zlib, compressed)
+ * blocks so neither side has to hold the whole index in memory.
+ *
+ * Paths below the exported project root are relocated to the root given on
+ * import and every file id is remapped to an id in the importing rdm's file id
+ * table. Sources whose dependencies all hash the same as when the snapshot was
+ * taken are marked as freshly parsed, the rest are reindexed on startup.
+ */
+namespace Snapshot {
+bool exportProject(const std::shared_ptr<Project> &project, const Path &archive, String *error);
+bool importProject(const std::shared_ptr<Project> &project, const Path &archive, String *error);
+}
+
+#endif
@@ -944,7 +944,7 @@ void Source::encode(Serializer &s, EncodeMode mode) const
     }
 }
 
-void Source::decode(Deserializer &s, EncodeMode mode)
+void Source::decode(Deserializer &s, EncodeMode mode, DecodeFlag flag)
 {
     clear();
     uint8_t lang;
@@ -966,8 +966,10 @@ void Source::decode(Deserializer &s, EncodeMode mode)
         Sandbox::decode(arguments);
     }
 
-    Location::set(source, fileId);
-    Location::set(compiler, compilerId);
-    Location::set(buildRoot, buildRootId);
+    if (flag == RegisterLocations) {
+        Location::set(source, fileId);
+        Location::set(compiler, compilerId);
+        Location::set(buildRoot, buildRootId);
+    }
     language = static_cast<Source::Language>(language);
 }
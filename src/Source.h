@@ -189,8 +189,12 @@ struct Source
         IgnoreSandbox,
         EncodeSandbox
     };
+    enum DecodeFlag {
+        RegisterLocations,
+        IgnoreLocations
+    };
     void encode(Serializer &serializer, EncodeMode mode) const;
-    void decode(Deserializer &deserializer, EncodeMode mode);
+    void decode(Deserializer &deserializer, EncodeMode mode, DecodeFlag flag = RegisterLocations);
 };
 
 RCT_FLAGS(Source::Flag);
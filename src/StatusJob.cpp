@@ -123,14 +123,14 @@ int StatusJob::execute()
         }
     }
 
-    const Dependencies &deps = proj->dependencies();
+    const List<uint32_t> deps = proj->dependencies().fileIds();
     if (query.isEmpty() || match("dependencies")) {
         matched = true;
         if (!write(delimiter) || !write("dependencies") || !write(delimiter))
             return 1;
 
-        for (auto it : deps) {
-            write(proj->dumpDependencies(it.first));
+        for (uint32_t fileId : deps) {
+            write(proj->dumpDependencies(fileId));
         }
         if (isAborted())
             return 1;
@@ -142,8 +142,8 @@ int StatusJob::execute()
         write("symbols");
         write(delimiter);
 
-        for (const auto &dep : deps) {
-            auto symbols = proj->openSymbols(dep.first);
+        for (uint32_t fileId : deps) {
+            auto symbols = proj->openSymbols(fileId);
             if (!symbols)
                 continue;
             const int count = symbols->count();
@@ -164,15 +164,15 @@ int StatusJob::execute()
         write(delimiter);
         write("targets");
         write(delimiter);
-        for (const auto &dep : deps) {
-            auto targets = proj->openTargets(dep.first);
+        for (uint32_t fileId : deps) {
+            auto targets = proj->openTargets(fileId);
             if (!targets)
                 continue;
             const int count = targets->count();
             for (int i=0; i<count; ++i) {
                 const String usr = targets->keyAt(i);
                 write<128>("  %s", usr.constData());
-                for (const auto &t : proj->findByUsr(usr, dep.first, Project::ArgDependsOn)) {
+                for (const auto &t : proj->findByUsr(usr, fileId, Project::ArgDependsOn)) {
                     write<1024>("      %s\t%s", t.location.toString(locationToStringFlags()).constData(),
                                 t.kindSpelling().constData());
                 }
@@ -191,8 +191,8 @@ int StatusJob::execute()
         write(delimiter);
         write("symbolnames");
         write(delimiter);
-        for (const auto &dep : deps) {
-            auto symNames = proj->openSymbolNames(dep.first);
+        for (uint32_t fileId : deps) {
+            auto symNames = proj->openSymbolNames(fileId);
             if (!symNames)
                 continue;
             const int count = symNames->count();
@@ -25,6 +25,17 @@ SymbolInfoJob::SymbolInfoJob(Location loc, const std::shared_ptr<QueryMessage> &
 {
 }
 
+FileIdSet SymbolInfoJob::cacheFiles() const
+{
+    // targets and references can be anywhere
+    if (!(queryFlags() & QueryMessage::SymbolInfoExcludeTargets) || !(queryFlags() & QueryMessage::SymbolInfoExcludeReferences))
+        return FileIdSet();
+    // base classes are looked up in the headers the file includes
+    FileIdSet ret = project()->dependencies(location.fileId(), Project::ArgDependsOn);
+    ret.insert(location.fileId());
+    return ret;
+}
+
 int SymbolInfoJob::execute()
 {
     Flags<Symbol::ToStringFlag> toStringFlags;
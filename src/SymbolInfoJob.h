@@ -24,6 +24,7 @@ class SymbolInfoJob : public QueryJob
 {
 public:
     SymbolInfoJob(Location loc, const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Project> &proj);
+    virtual FileIdSet cacheFiles() const override;
 protected:
     virtual int execute() override;
 private:
@@ -0,0 +1,59 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "SyncThread.h"
+
+#include "rct/Log.h"
+#include "rct/Rct.h"
+#include "RTags.h"
+
+SyncThread::SyncThread()
+    : Thread(), mShutdown(false)
+{
+}
+
+void SyncThread::sync(const Path &path)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPending.insert(path);
+    mCondition.notify_one();
+}
+
+void SyncThread::stop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mShutdown = true;
+    mCondition.notify_one();
+}
+
+void SyncThread::run()
+{
+    while (true) {
+        Set<Path> paths;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mShutdown && mPending.isEmpty())
+                mCondition.wait(lock);
+            // pending syncs are still done on shutdown
+            if (mPending.isEmpty())
+                break;
+            std::swap(paths, mPending);
+        }
+        for (const Path &path : paths) {
+            if (!RTags::syncFileSystem(path))
+                error("Failed to sync %s: %s", path.constData(), Rct::strerror().constData());
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SyncThread_h
+#define SyncThread_h
+
+#include <condition_variable>
+#include <mutex>
+
+#include "rct/Path.h"
+#include "rct/Set.h"
+#include "rct/Thread.h"
+
+/*
+ * Syncs the file systems of project data directories off the event loop.
+ * Requests that come in while a sync is running are coalesced into the next
+ * one.
+ */
+class SyncThread : public Thread
+{
+public:
+    SyncThread();
+
+    virtual void run() override;
+    void sync(const Path &path);
+    void stop();
+private:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    Set<Path> mPending;
+    bool mShutdown;
+};
+
+#endif
@@ -0,0 +1,134 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "TokenCache.h"
+
+#include "rct/Log.h"
+#include "rct/StopWatch.h"
+#include "RTags.h"
+
+// The file is parsed on its own with the arguments of a source that
+// includes it, so clang can't tell the language from a header's suffix
+static const char *languageArgument(Source::Language language, bool header)
+{
+    switch (language) {
+    case Source::C:
+    case Source::CHeader:
+        return header ? "c-header" : "c";
+    case Source::CPlusPlus:
+    case Source::CPlusPlus11:
+    case Source::CPlusPlusHeader:
+    case Source::CPlusPlus11Header:
+        return header ? "c++-header" : "c++";
+    case Source::ObjectiveC:
+        return header ? "objective-c-header" : "objective-c";
+    case Source::ObjectiveCPlusPlus:
+        return header ? "objective-c++-header" : "objective-c++";
+    case Source::NoLanguage:
+        break;
+    }
+    return 0;
+}
+
+static std::shared_ptr<const List<Token> > tokenize(uint32_t fileId, const Path &path, const Source &source)
+{
+    Flags<CXTranslationUnit_Flags> flags = CXTranslationUnit_SkipFunctionBodies;
+#if CINDEX_VERSION_MINOR >= 41
+    flags |= CXTranslationUnit_SingleFileParse;
+#else
+    flags |= CXTranslationUnit_Incomplete;
+#endif
+    CXIndex index = clang_createIndex(0, 0);
+    CXTranslationUnit unit = 0;
+    List<String> args = source.toCommandLine(Source::Default);
+    if (const char *language = languageArgument(source.language, fileId != source.fileId)) {
+        // the last -x wins
+        args << "-x" << language;
+    }
+    RTags::parseTranslationUnit(path, args, unit, index, 0, 0, flags);
+    if (!unit) {
+        clang_disposeIndex(index);
+        return std::shared_ptr<const List<Token> >();
+    }
+
+    std::shared_ptr<List<Token> > ret = std::make_shared<List<Token> >();
+    const CXFile file = clang_getFile(unit, path.constData());
+    const CXSourceRange range = clang_getRange(clang_getLocationForOffset(unit, file, 0),
+                                               clang_getLocationForOffset(unit, file, path.fileSize()));
+    CXToken *tokens = 0;
+    unsigned numTokens = 0;
+    clang_tokenize(unit, range, &tokens, &numTokens);
+    ret->reserve(numTokens);
+    for (unsigned i=0; i<numTokens; ++i) {
+        const CXSourceRange extent = clang_getTokenExtent(unit, tokens[i]);
+        unsigned line, column, offset, endOffset;
+        clang_getSpellingLocation(clang_getRangeStart(extent), 0, &line, &column, &offset);
+        clang_getSpellingLocation(clang_getRangeEnd(extent), 0, 0, 0, &endOffset);
+        const Token token = {
+            clang_getTokenKind(tokens[i]),
+            RTags::eatString(clang_getTokenSpelling(unit, tokens[i])),
+            Location(fileId, line, column),
+            offset,
+            endOffset - offset
+        };
+        ret->append(token);
+    }
+    clang_disposeTokens(unit, tokens, numTokens);
+    clang_disposeTranslationUnit(unit);
+    clang_disposeIndex(index);
+    return ret;
+}
+
+TokenCache::TokenCache(size_t maxFiles)
+    : mMaxFiles(maxFiles)
+{
+}
+
+std::shared_ptr<const List<Token> > TokenCache::tokens(uint32_t fileId, const Source &source)
+{
+    const Path path = Location::path(fileId);
+    const uint64_t lastModified = path.lastModifiedMs();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (size_t i=0; i<mEntries.size(); ++i) {
+            if (mEntries.at(i).fileId == fileId) {
+                Entry entry = mEntries.at(i);
+                mEntries.removeAt(i);
+                if (entry.lastModified != lastModified)
+                    break;
+                mEntries.append(entry);
+                return entry.tokens;
+            }
+        }
+    }
+
+    StopWatch sw;
+    Entry entry = { fileId, lastModified, tokenize(fileId, path, source) };
+    if (!entry.tokens)
+        return entry.tokens;
+    warning() << "Tokenized" << path << "in" << sw.elapsed() << "ms," << entry.tokens->size() << "tokens";
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.append(entry);
+    while (mEntries.size() > mMaxFiles)
+        mEntries.removeFirst();
+    return entry.tokens;
+}
+
+void TokenCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.clear();
+}
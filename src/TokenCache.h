@@ -0,0 +1,55 @@
+/* This file is part of RTags (http://rtags.net).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef TokenCache_h
+#define TokenCache_h
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/List.h"
+#include "Source.h"
+#include "Token.h"
+
+/*
+ * Tokens of recently requested files for projects that don't index tokens
+ * (index-tokens in .rtags-config). TokensJob asks for the tokens of a file
+ * and gets them from here, tokenizing the file with libclang if it isn't
+ * cached or has been modified since it was tokenized. Only the file itself
+ * is parsed, its includes are not followed.
+ */
+class TokenCache
+{
+public:
+    TokenCache(size_t maxFiles = 8);
+
+    // Sorted by offset. source provides the language and the arguments the
+    // file is tokenized with. Returns null if the file can't be parsed.
+    std::shared_ptr<const List<Token> > tokens(uint32_t fileId, const Source &source);
+    void clear();
+private:
+    struct Entry {
+        uint32_t fileId;
+        uint64_t lastModified;
+        std::shared_ptr<const List<Token> > tokens;
+    };
+
+    std::mutex mMutex;
+    List<Entry> mEntries; // least recently used first
+    const size_t mMaxFiles;
+};
+
+#endif
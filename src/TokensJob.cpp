@@ -15,6 +15,8 @@
 
 #include "TokensJob.h"
 
+#include <algorithm>
+
 #include "Project.h"
 #include "QueryMessage.h"
 #include "rct/Log.h"
@@ -30,21 +32,59 @@ TokensJob::TokensJob(const std::shared_ptr<QueryMessage> &query,
 {
 }
 
+// Any source will do for tokenizing a header, the language is what matters
+static bool findSource(const std::shared_ptr<Project> &project, uint32_t fileId, Source &source)
+{
+    List<Source> sources = project->sources(fileId);
+    if (sources.isEmpty()) {
+        for (uint32_t dep : project->dependencies(fileId, Project::DependsOnArg)) {
+            sources = project->sources(dep);
+            if (!sources.isEmpty())
+                break;
+        }
+    }
+    if (sources.isEmpty())
+        return false;
+    source = sources.first();
+    return true;
+}
+
 int TokensJob::execute()
 {
     std::shared_ptr<Project> proj = project();
     if (!proj)
         return 1;
-    auto map = proj->openTokens(mFileId);
-    if (!map)
-        return 2;
 
-    const uint32_t count = map->count();
+    // Projects only have tokens on disk with index-tokens in .rtags-config,
+    // otherwise the file is tokenized now
+    std::shared_ptr<FileMap<uint32_t, Token> > map;
+    std::shared_ptr<const List<Token> > tokens;
+    if (proj->sourceFilePath(mFileId, Project::fileMapName(Project::Tokens)).isFile()) {
+        map = proj->openTokens(mFileId);
+        if (!map)
+            return 2;
+    } else {
+        Source source;
+        if (!findSource(proj, mFileId, source))
+            return 2;
+        tokens = proj->tokenCache().tokens(mFileId, source);
+        if (!tokens)
+            return 2;
+    }
+
+    const uint32_t count = map ? map->count() : tokens->size();
+    auto tokenAt = [&map, &tokens](uint32_t idx) { return map ? map->valueAt(idx) : tokens->at(idx); };
     uint32_t i = 0;
     if (mFrom != 0) {
-        i = map->lowerBound(mFrom);
+        if (map) {
+            i = map->lowerBound(mFrom);
+        } else {
+            i = std::lower_bound(tokens->begin(), tokens->end(), mFrom, [](const Token &token, uint32_t offset) {
+                    return token.offset < offset;
+                }) - tokens->begin();
+        }
         if (i > 0 && i < count) {
-            const Token val = map->valueAt(i - 1);
+            const Token val = tokenAt(i - 1);
             if (val.offset + val.length >= mFrom)
                 --i;
         }
@@ -93,7 +133,7 @@ int TokensJob::execute()
     }
 
     while (i < count) {
-        const Token token = map->valueAt(i++);
+        const Token token = tokenAt(i++);
         if (token.offset > mTo)
             break;
         if (!writeToken(token))
@@ -77,12 +77,18 @@ static void signalHandler(int signal)
 #define EXCLUDEFILTER_DEFAULT "*/CMakeFiles/*;*/cmake*/Modules/*;*/conftest.c*;/tmp/*"
 #define DEFAULT_RP_VISITFILE_TIMEOUT 60000
 #define DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE 500
+#define DEFAULT_RDM_MAX_FILE_MAP_CACHE_MEMORY 1024
+#define DEFAULT_RDM_QUERY_CACHE_SIZE 256
 #define DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT 60000
 #define DEFAULT_RP_CONNECT_TIMEOUT 0 // won't time out
 #define DEFAULT_RP_CONNECT_ATTEMPTS 3
 #define DEFAULT_COMPLETION_CACHE_SIZE 10
 #define DEFAULT_MAX_INCLUDE_COMPLETION_DEPTH 3
 #define DEFAULT_MAX_CRASH_COUNT 5
+#define DEFAULT_FILE_MAP_SYNC_BATCH_SIZE 32
+#define DEFAULT_GC_INTERVAL 0
+#define DEFAULT_PREFETCH_BUDGET 256
+#define DEFAULT_QUERY_THREAD_COUNT 4
 #define XSTR(s) #s
 #define STR(s) XSTR(s)
 static size_t defaultStackSize = 0;
@@ -141,6 +147,8 @@ static void usage(FILE *f)
             "  --watch-sources-only                       Only watch source files (not dependencies).\n"
             "  --job-count|-j [arg]                       Spawn this many concurrent processes for indexing (default %d).\n"
             "  --header-error-job-count|-H [arg]          Allow this many concurrent header error jobs (default std::max(1, --job-count / 2)).\n"
+            "  --query-thread-count [arg]                 Run symbol queries on this many threads (0 means on the main thread) (default " STR(DEFAULT_QUERY_THREAD_COUNT) ").\n"
+            "  --scan-thread-count [arg]                  Use this many extra threads for queries that look at every file in a project (0 means none) (default number of cores).\n"
             "  --log-file|-L [arg]                        Log to this file.\n"
             "  --log-file-log-level [arg]                 Log level for log file (default is error).\n"
             "  --crash-dump-file [arg]                    File to dump crash log to (default is <datadir>/crash.dump).\n"
@@ -156,6 +164,8 @@ static void usage(FILE *f)
             "  --rp-connect-attempts [arg]                Number of times rp attempts to connect to rdm before giving up. (default " STR(DEFAULT_RP_CONNECT_ATTEMPTS) ").\n"
             "  --rp-indexer-message-timeout|-T [arg]      Timeout for rp indexer-message in ms (0 means no timeout) (default " STR(DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT) ").\n"
             "  --rp-nice-value|-a [arg]                   Nice value to use for rp (nice(2)) (default is no nicing).\n"
+            "  --rp-session-jobs [arg]                    Let each rp index up to [arg] new sources of one project in one libclang session, skipping function bodies in headers it has already parsed (experimental, requires --index-engine callbacks, 0 means one job per rp, idle sessions exit after 10s) (default 0).\n"
+            "  --rp-write-threads [arg]                   Number of threads each rp uses to write the data of the files it indexed (default is the number of cores divided by the job count, at most 4).\n"
             "  --rp-visit-file-timeout|-Z [arg]           Timeout for rp visitfile commands in ms (0 means no timeout) (default " STR(DEFAULT_RP_VISITFILE_TIMEOUT) ").\n"
             "  --separate-debug-and-release|-E            Normally rdm doesn't consider release and debug as different builds. Pass this if you want it to.\n"
             "  --setenv|-e [arg]                          Set this environment variable (--setenv \"foobar=1\").\n"
@@ -187,12 +197,21 @@ static void usage(FILE *f)
             "  --no-spell-checking|-l                     Don't pass -fspell-checking.\n"
             "  --no-unlimited-error|-f                    Don't pass -ferror-limit=0 to clang.\n"
             "  --Wlarge-by-value-copy|-r [arg]            Use -Wlarge-by-value-copy=[arg] when invoking clang.\n"
-            "  --max-file-map-cache-size|-y [arg]         Max files to cache per query (Should not exceed maximum number of open file descriptors allowed per process) (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE) ").\n"
+            "  --max-file-map-cache-size|-y [arg]         Max files to keep open per project. All projects together keep at most half the open file descriptor limit open (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE) ").\n"
+            "  --max-file-map-cache-memory [arg]          Max megabytes of project data to keep mapped per project (default " STR(DEFAULT_RDM_MAX_FILE_MAP_CACHE_MEMORY) ").\n"
+            "  --query-cache-size [arg]                   Max number of query results to keep per project (0 means no caching) (default " STR(DEFAULT_RDM_QUERY_CACHE_SIZE) ").\n"
             "  --no-comments                              Don't parse/store doxygen comments.\n"
             "  --arg-transform|-V [arg]                   Use arg to transform arguments. [arg] should be a executable with (execv(3)).\n"
             "  --debug-locations [arg]                    Set debug locations.\n"
             "  --validate-file-maps                       Spend some time validating project data on startup.\n"
+            "  --sync-file-maps [arg]                     When to fsync written project data: none, tu (each translation unit) or batch[=N] (every N jobs, default " STR(DEFAULT_FILE_MAP_SYNC_BATCH_SIZE) ") (default none).\n"
+            "  --prefetch-budget [arg]                    Megabytes of the most queried project data to read ahead when a project becomes current (0 means none) (default " STR(DEFAULT_PREFETCH_BUDGET) ").\n"
+            "  --gc-interval [arg]                        Interval in minutes for removing index data no project refers to anymore (0 means never) (default " STR(DEFAULT_GC_INTERVAL) ").\n"
+            "  --export-snapshot [arg]                    Write the project containing the current directory (or the current project) to this file and exit.\n"
+            "  --import-snapshot [arg]                    Restore a project exported with --export-snapshot into the current directory.\n"
             "  --pch-enabled                              Enable PCH (experimental).\n"
+            "  --prune-blocked-headers                    Don't walk declarations in headers indexed by other translation units.\n"
+            "  --index-engine [arg]                       How rp builds the index: visitor (clang_visitChildren) or callbacks (clang_indexTranslationUnit, has no symbols for return, break, continue and scopes) (default visitor).\n"
             "  --rp-path [path]                           Path to rp (default %s).\n"
             , std::max(2, ThreadPool::idealThreadCount()), defaultStackSize, defaultRP().constData());
 }
@@ -313,6 +332,19 @@ int main(int argc, char** argv)
         { "rp-path", required_argument, 0, 17 },
         { "log-timestamp", no_argument, 0, 18 },
         { "sandbox-root", required_argument, 0, 20 },
+        { "sync-file-maps", required_argument, 0, 22 },
+        { "export-snapshot", required_argument, 0, 23 },
+        { "import-snapshot", required_argument, 0, 24 },
+        { "gc-interval", required_argument, 0, 25 },
+        { "prefetch-budget", required_argument, 0, 26 },
+        { "query-thread-count", required_argument, 0, 27 },
+        { "max-file-map-cache-memory", required_argument, 0, 28 },
+        { "scan-thread-count", required_argument, 0, 29 },
+        { "query-cache-size", required_argument, 0, 30 },
+        { "prune-blocked-headers", no_argument, 0, 31 },
+        { "index-engine", required_argument, 0, 32 },
+        { "rp-session-jobs", required_argument, 0, 33 },
+        { "rp-write-threads", required_argument, 0, 34 },
         { 0, 0, 0, 0 }
     };
     const String shortOptions = Rct::shortOptions(opts);
@@ -421,12 +453,18 @@ int main(int argc, char** argv)
     serverOpts.rpIndexDataMessageTimeout = DEFAULT_RP_INDEXER_MESSAGE_TIMEOUT;
     serverOpts.rpConnectTimeout = DEFAULT_RP_CONNECT_TIMEOUT;
     serverOpts.rpConnectAttempts = DEFAULT_RP_CONNECT_ATTEMPTS;
-    serverOpts.maxFileMapScopeCacheSize = DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE;
+    serverOpts.maxFileMapCacheSize = DEFAULT_RDM_MAX_FILE_MAP_CACHE_SIZE;
+    serverOpts.maxFileMapCacheMemory = DEFAULT_RDM_MAX_FILE_MAP_CACHE_MEMORY;
+    serverOpts.queryCacheSize = DEFAULT_RDM_QUERY_CACHE_SIZE;
     serverOpts.rpNiceValue = INT_MIN;
     serverOpts.options = Server::Wall|Server::SpellChecking;
     serverOpts.maxCrashCount = DEFAULT_MAX_CRASH_COUNT;
     serverOpts.completionCacheSize = DEFAULT_COMPLETION_CACHE_SIZE;
     serverOpts.maxIncludeCompletionDepth = DEFAULT_MAX_INCLUDE_COMPLETION_DEPTH;
+    serverOpts.gcInterval = DEFAULT_GC_INTERVAL;
+    serverOpts.prefetchBudget = DEFAULT_PREFETCH_BUDGET;
+    serverOpts.queryThreadCount = DEFAULT_QUERY_THREAD_COUNT;
+    serverOpts.scanThreadCount = ThreadPool::idealThreadCount();
     serverOpts.rp = defaultRP();
     strcpy(crashDumpFilePath, "crash.dump");
 #ifdef OS_FreeBSD
@@ -569,8 +607,8 @@ int main(int argc, char** argv)
                 serverOpts.rpVisitFileTimeout = -1;
             break;
         case 'y':
-            serverOpts.maxFileMapScopeCacheSize = atoi(optarg);
-            if (serverOpts.maxFileMapScopeCacheSize <= 0) {
+            serverOpts.maxFileMapCacheSize = atoi(optarg);
+            if (serverOpts.maxFileMapCacheSize <= 0) {
                 fprintf(stderr, "Invalid argument to -y %s\n", optarg);
                 return 1;
             }
@@ -707,6 +745,112 @@ int main(int argc, char** argv)
         case 21:
             serverOpts.maxIncludeCompletionDepth = strtoul(optarg, 0, 10);
             break;
+        case 22:
+            serverOpts.options &= ~Server::SyncFileMaps;
+            serverOpts.fileMapSyncBatchSize = 0;
+            if (!strcmp(optarg, "tu")) {
+                serverOpts.options |= Server::SyncFileMaps;
+            } else if (!strcmp(optarg, "batch")) {
+                serverOpts.fileMapSyncBatchSize = DEFAULT_FILE_MAP_SYNC_BATCH_SIZE;
+            } else if (!strncmp(optarg, "batch=", 6)) {
+                serverOpts.fileMapSyncBatchSize = atoi(optarg + 6);
+                if (serverOpts.fileMapSyncBatchSize <= 0) {
+                    fprintf(stderr, "Invalid argument to --sync-file-maps %s\n", optarg);
+                    return 1;
+                }
+            } else if (strcmp(optarg, "none")) {
+                fprintf(stderr, "Invalid argument to --sync-file-maps %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 23:
+            serverOpts.exportSnapshot = optarg;
+            serverOpts.exportSnapshot.resolve(Path::MakeAbsolute);
+            break;
+        case 24:
+            serverOpts.importSnapshot = optarg;
+            if (!serverOpts.importSnapshot.resolve() || !serverOpts.importSnapshot.isFile()) {
+                fprintf(stderr, "%s doesn't seem to be a file\n", optarg);
+                return 1;
+            }
+            break;
+        case 25: {
+            bool ok;
+            serverOpts.gcInterval = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.gcInterval < 0) {
+                fprintf(stderr, "Invalid argument to --gc-interval %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 26: {
+            bool ok;
+            serverOpts.prefetchBudget = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.prefetchBudget < 0) {
+                fprintf(stderr, "Invalid argument to --prefetch-budget %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 27: {
+            bool ok;
+            serverOpts.queryThreadCount = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.queryThreadCount < 0) {
+                fprintf(stderr, "Invalid argument to --query-thread-count %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 28: {
+            bool ok;
+            serverOpts.maxFileMapCacheMemory = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.maxFileMapCacheMemory <= 0) {
+                fprintf(stderr, "Invalid argument to --max-file-map-cache-memory %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 29: {
+            bool ok;
+            serverOpts.scanThreadCount = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.scanThreadCount < 0) {
+                fprintf(stderr, "Invalid argument to --scan-thread-count %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 30: {
+            bool ok;
+            serverOpts.queryCacheSize = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.queryCacheSize < 0) {
+                fprintf(stderr, "Invalid argument to --query-cache-size %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 31:
+            serverOpts.options |= Server::PruneBlockedHeaders;
+            break;
+        case 32:
+            if (!strcmp(optarg, "visitor")) {
+                serverOpts.options &= ~Server::IndexerCallbacks;
+            } else if (!strcmp(optarg, "callbacks")) {
+                serverOpts.options |= Server::IndexerCallbacks;
+            } else {
+                fprintf(stderr, "Invalid argument to --index-engine %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 33: {
+            bool ok;
+            serverOpts.rpSessionJobs = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.rpSessionJobs < 0) {
+                fprintf(stderr, "Invalid argument to --rp-session-jobs %s\n", optarg);
+                return 1;
+            }
+            break; }
+        case 34: {
+            bool ok;
+            serverOpts.rpWriteThreads = String(optarg).toLong(&ok);
+            if (!ok || serverOpts.rpWriteThreads <= 0) {
+                fprintf(stderr, "Invalid argument to --rp-write-threads %s\n", optarg);
+                return 1;
+            }
+            break; }
         case 'T':
             serverOpts.rpIndexDataMessageTimeout = atoi(optarg);
             if (serverOpts.rpIndexDataMessageTimeout <= 0) {
@@ -799,6 +943,12 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (serverOpts.rpSessionJobs > 1 && !(serverOpts.options & Server::IndexerCallbacks)) {
+        // sessions index with clang_indexSourceFile which is the callbacks engine
+        fprintf(stderr, "--rp-session-jobs requires --index-engine callbacks\n");
+        return 1;
+    }
+
     if (daemon) {
         switch (fork()) {
         case -1:
@@ -824,6 +974,11 @@ int main(int argc, char** argv)
     if (serverOpts.excludeFilters.isEmpty())
         serverOpts.excludeFilters = String(EXCLUDEFILTER_DEFAULT).split(';');
 
+    if (!serverOpts.rpWriteThreads) {
+        // every rp may be writing at the same time
+        serverOpts.rpWriteThreads = std::max<int>(1, std::min<int>(4, ThreadPool::idealThreadCount() / std::max<size_t>(1, serverOpts.jobCount)));
+    }
+
     if (!serverOpts.headerErrorJobCount) {
         serverOpts.headerErrorJobCount = std::max<size_t>(1, serverOpts.jobCount / 2);
     } else {
@@ -924,6 +1079,14 @@ int main(int argc, char** argv)
         return server->runTests() ? 0 : 1;
     }
 
+    if (!serverOpts.exportSnapshot.isEmpty()) {
+        // Server::init exported it
+        const int ret = server->exitCode();
+        server.reset();
+        cleanupLogging();
+        return ret;
+    }
+
     loop->setInactivityTimeout(inactivityTimeout * 1000);
 
     loop->exec();
@@ -60,12 +60,15 @@ int main(int argc, char **argv)
 {
     LogLevel logLevel = LogLevel::Error;
     Path file;
+    int sessionJobs = 1;
 
     for (int i=1; i<argc; ++i) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
             ++logLevel;
         } else if (!strcmp(argv[i], "--priority")) { // ignore, only for wrapping purposes
             ++i;
+        } else if (!strcmp(argv[i], "--session") && i + 1 < argc) {
+            sessionJobs = std::max(1, atoi(argv[++i]));
         } else {
             file = argv[i];
         }
@@ -92,9 +95,24 @@ int main(int argc, char **argv)
 
     if (!file.isEmpty()) {
         data = file.readAll();
-    } else {
+        ClangIndexer indexer;
+        if (!indexer.exec(data)) {
+            error() << "ClangIndexer error";
+            return 3;
+        }
+        return 0;
+    }
+
+    // With --session rdm keeps writing new jobs to stdin until this rp has
+    // indexed sessionJobs of them, all in the same libclang session.
+    std::unique_ptr<ClangIndexer::Session> session;
+    if (sessionJobs > 1)
+        session.reset(new ClangIndexer::Session);
+    for (int job=0; job<sessionJobs; ++job) {
         uint32_t size;
         if (!fread(&size, sizeof(size), 1, stdin)) {
+            if (job) // rdm is done with us
+                break;
             error() << "Failed to read from stdin";
             return 1;
         }
@@ -106,11 +124,11 @@ int main(int argc, char **argv)
         // FILE *f = fopen("/tmp/data", "w");
         // fwrite(data.constData(), data.size(), 1, f);
         // fclose(f);
-    }
-    ClangIndexer indexer;
-    if (!indexer.exec(data)) {
-        error() << "ClangIndexer error";
-        return 3;
+        ClangIndexer indexer(session.get());
+        if (!indexer.exec(data)) {
+            error() << "ClangIndexer error";
+            return 3;
+        }
     }
 
     return 0;